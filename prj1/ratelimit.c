@@ -0,0 +1,182 @@
+#include "ratelimit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 256
+#define RATE_QUANTA 20
+
+static uint32_t slot_of(RateLimiter *rl, uint32_t addr) {
+  // fibonacci hashing spreads sequential addresses across the table
+  return (uint32_t)(addr * 2654435769u) & (rl->capacity - 1);
+}
+
+static void refill(RateLimiter *rl, RateBucket *b, uint32_t now_ms) {
+  float elapsed = (uint32_t)(now_ms - b->last_ms) / 1000.0f;
+  b->last_ms = now_ms;
+
+  // one second worth of tokens is the burst size
+  if (rl->byte_rate > 0) {
+    b->byte_tokens += elapsed * rl->byte_rate;
+    if (b->byte_tokens > rl->byte_rate) b->byte_tokens = rl->byte_rate;
+  }
+  if (rl->req_rate > 0) {
+    float burst = rl->req_rate < 1 ? 1 : rl->req_rate;
+    b->req_tokens += elapsed * rl->req_rate;
+    if (b->req_tokens > burst) b->req_tokens = burst;
+  }
+}
+
+static int grow(RateLimiter *rl) {
+  RateBucket *old = rl->slots;
+  uint32_t old_capacity = rl->capacity;
+
+  rl->slots = calloc(old_capacity * 2, sizeof(RateBucket));
+  if (rl->slots == NULL) {
+    perror("calloc");
+    rl->slots = old;
+    return -1;
+  }
+  rl->capacity = old_capacity * 2;
+
+  for (uint32_t i = 0; i < old_capacity; i++) {
+    if (old[i].addr == 0) continue;
+    uint32_t j = slot_of(rl, old[i].addr);
+    while (rl->slots[j].addr != 0) {
+      j = (j + 1) & (rl->capacity - 1);
+    }
+    rl->slots[j] = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+static RateBucket *lookup(RateLimiter *rl, uint32_t addr, uint32_t now_ms) {
+  uint32_t i = slot_of(rl, addr);
+  while (rl->slots[i].addr != 0) {
+    if (rl->slots[i].addr == addr) {
+      refill(rl, &rl->slots[i], now_ms);
+      return &rl->slots[i];
+    }
+    i = (i + 1) & (rl->capacity - 1);
+  }
+
+  // keep the load factor under one half so probe chains stay short
+  if ((rl->used + 1) * 2 > rl->capacity) {
+    if (grow(rl) < 0) return NULL;
+    return lookup(rl, addr, now_ms);
+  }
+
+  RateBucket *b = &rl->slots[i];
+  b->addr = addr;
+  b->last_ms = now_ms;
+  b->byte_tokens = rl->byte_rate;
+  b->req_tokens = rl->req_rate < 1 ? 1 : rl->req_rate;
+  rl->used++;
+  return b;
+}
+
+// backward shift deletion, so lookups never need tombstones
+static void remove_at(RateLimiter *rl, uint32_t i) {
+  uint32_t mask = rl->capacity - 1;
+  uint32_t j = i;
+
+  while (1) {
+    j = (j + 1) & mask;
+    if (rl->slots[j].addr == 0) break;
+    uint32_t home = slot_of(rl, rl->slots[j].addr);
+    // move j back into the hole unless its home lies in (i, j]
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      rl->slots[i] = rl->slots[j];
+      i = j;
+    }
+  }
+  memset(&rl->slots[i], 0, sizeof(RateBucket));
+  rl->used--;
+}
+
+int ratelimit_init(RateLimiter *rl, float byte_rate, float req_rate,
+                   uint32_t idle_ms) {
+  memset(rl, 0, sizeof(*rl));
+  rl->slots = calloc(INITIAL_CAPACITY, sizeof(RateBucket));
+  if (rl->slots == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  rl->capacity = INITIAL_CAPACITY;
+  rl->byte_rate = byte_rate;
+  rl->req_rate = req_rate;
+  rl->idle_ms = idle_ms;
+  return 0;
+}
+
+void ratelimit_free(RateLimiter *rl) {
+  free(rl->slots);
+  rl->slots = NULL;
+  rl->capacity = 0;
+  rl->used = 0;
+}
+
+// Returns how many milliseconds the source has to wait before it may be
+// read from again, 0 if both buckets hold tokens. In that case allowance is
+// set to the number of bytes that may be read right now. A read that is
+// part of a request header needs a whole request token; the rest of a
+// request is only held back by the byte bucket.
+uint32_t ratelimit_wait(RateLimiter *rl, uint32_t addr, uint32_t now_ms,
+                        int header, uint32_t *allowance) {
+  RateBucket *b = lookup(rl, addr, now_ms);
+  float wait = 0;
+
+  *allowance = UINT32_MAX;
+  if (b == NULL) return 0;
+
+  if (rl->byte_rate > 0) {
+    // wait for a slice of tokens rather than waking up for every byte
+    float quantum = rl->byte_rate / RATE_QUANTA;
+    if (quantum < 1) quantum = 1;
+    if (b->byte_tokens < quantum) {
+      wait = (quantum - b->byte_tokens) / rl->byte_rate;
+      rl->byte_limit_hits++;
+    } else {
+      *allowance = (uint32_t)b->byte_tokens;
+    }
+  }
+  if (rl->req_rate > 0 && header && b->req_tokens < 1) {
+    float req_wait = (1 - b->req_tokens) / rl->req_rate;
+    if (req_wait > wait) wait = req_wait;
+    rl->req_limit_hits++;
+  }
+
+  if (wait <= 0) return 0;
+  return (uint32_t)(wait * 1000) + 1;
+}
+
+void ratelimit_charge(RateLimiter *rl, uint32_t addr, uint32_t bytes,
+                      uint32_t requests, uint32_t now_ms) {
+  RateBucket *b = lookup(rl, addr, now_ms);
+  if (b == NULL) return;
+
+  if (rl->byte_rate > 0) b->byte_tokens -= bytes;
+  if (rl->req_rate > 0) b->req_tokens -= requests;
+}
+
+// Drop buckets that have been idle long enough to be full again; a fresh
+// bucket for the same source starts out identical.
+void ratelimit_expire(RateLimiter *rl, uint32_t now_ms) {
+  uint32_t i = 0;
+
+  while (i < rl->capacity) {
+    RateBucket *b = &rl->slots[i];
+    if (b->addr != 0 && (uint32_t)(now_ms - b->last_ms) >= rl->idle_ms) {
+      refill(rl, b, now_ms);
+      if (b->byte_tokens >= 0 && b->req_tokens >= 0) {
+        remove_at(rl, i);
+        rl->expired++;
+        // a shifted entry may now occupy slot i
+        continue;
+      }
+    }
+    i++;
+  }
+}
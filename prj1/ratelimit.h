@@ -0,0 +1,34 @@
+#include <stdint.h>
+
+// Per-source-address token buckets, kept in an open addressing table keyed
+// by IPv4 address. The byte bucket may go into debt, and a source in debt
+// has to wait for the refill before it is read from again. A request needs
+// a whole token before its header is read.
+
+typedef struct {
+  uint32_t addr;  // network order, 0 marks an empty slot
+  uint32_t last_ms;
+  float byte_tokens;
+  float req_tokens;
+} RateBucket;
+
+typedef struct {
+  RateBucket *slots;
+  uint32_t capacity;  // power of two
+  uint32_t used;
+  float byte_rate;  // bytes/sec, 0 for unlimited
+  float req_rate;   // requests/sec, 0 for unlimited
+  uint32_t idle_ms;
+  uint64_t byte_limit_hits;
+  uint64_t req_limit_hits;
+  uint64_t expired;
+} RateLimiter;
+
+int ratelimit_init(RateLimiter *rl, float byte_rate, float req_rate,
+                   uint32_t idle_ms);
+void ratelimit_free(RateLimiter *rl);
+uint32_t ratelimit_wait(RateLimiter *rl, uint32_t addr, uint32_t now_ms,
+                        int header, uint32_t *allowance);
+void ratelimit_charge(RateLimiter *rl, uint32_t addr, uint32_t bytes,
+                      uint32_t requests, uint32_t now_ms);
+void ratelimit_expire(RateLimiter *rl, uint32_t now_ms);
@@ -1,19 +1,27 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "ratelimit.h"
 
 #define MAX_EVENTS 50
 #define BACKLOG 1024
+#define SOCK_BUFSIZE (4 * 1024 * 1024)
+#define RATE_IDLE_MS 60000
+#define RATE_SWEEP_MS 1000
 
 typedef struct {
   int client_fd;
@@ -23,9 +31,76 @@ typedef struct {
   uint32_t bytes_recv;
   uint32_t bytes_sent;
   uint16_t processed;
+  // readiness tracked in minimal mode, cleared on EAGAIN
+  uint8_t readable;
+  uint8_t writable;
+  uint8_t lowat_lowered;
+  // source address for rate limiting, reads are paused until resume_ms
+  uint32_t addr;
+  uint8_t paused;
+  uint32_t resume_ms;
   char *msg;
 } ConnectionInfo;
 
+// syscall accounting, dumped on SIGUSR1 and at exit
+typedef struct {
+  uint64_t loops;
+  uint64_t events;
+  uint64_t epoll_wait;
+  uint64_t epoll_ctl;
+  uint64_t accept;
+  uint64_t recv;
+  uint64_t send;
+  uint64_t sockopt;
+  uint64_t close;
+  uint64_t requests;
+} SyscallStats;
+
+static SyscallStats stats;
+static int minimal_mode = 0;
+static int ratelimit_enabled = 0;
+static RateLimiter limiter;
+static volatile sig_atomic_t dump_stats = 0;
+static volatile sig_atomic_t running = 1;
+
+uint32_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void print_stats() {
+  uint64_t total = stats.epoll_wait + stats.epoll_ctl + stats.accept +
+                   stats.recv + stats.send + stats.sockopt + stats.close;
+  double reqs = stats.requests ? (double)stats.requests : 1.0;
+  double loops = stats.loops ? (double)stats.loops : 1.0;
+
+  fprintf(stderr, "mode: %s, requests: %lu, loops: %lu (%.2f events/loop)\n",
+          minimal_mode ? "minimal" : "default", stats.requests, stats.loops,
+          stats.events / loops);
+  fprintf(stderr,
+          "syscalls/request: total %.2f, recv %.2f, send %.2f, epoll_wait "
+          "%.2f, epoll_ctl %.2f, accept %.2f, sockopt %.2f, close %.2f\n",
+          total / reqs, stats.recv / reqs, stats.send / reqs,
+          stats.epoll_wait / reqs, stats.epoll_ctl / reqs,
+          stats.accept / reqs, stats.sockopt / reqs, stats.close / reqs);
+  if (ratelimit_enabled) {
+    fprintf(stderr,
+            "rate limit: %u sources, byte limit hits %lu, request limit hits "
+            "%lu, expired %lu\n",
+            limiter.used, limiter.byte_limit_hits, limiter.req_limit_hits,
+            limiter.expired);
+  }
+}
+
+void handle_signal(int sig) {
+  if (sig == SIGUSR1) {
+    dump_stats = 1;
+  } else {
+    running = 0;
+  }
+}
+
 void caesar_cipher(char *buffer, uint32_t len, uint16_t shift, uint16_t op) {
   if (op == 1) {
     shift = 26 - shift;
@@ -49,13 +124,60 @@ void reset_client_data(ConnectionInfo *client_data) {
   client_data->processed = 0;
 }
 
+void set_rcvlowat(ConnectionInfo *client_data, int lowat) {
+  stats.sockopt++;
+  if (setsockopt(client_data->client_fd, SOL_SOCKET, SO_RCVLOWAT, &lowat,
+                 sizeof(lowat)) == -1) {
+    perror("setsockopt SO_RCVLOWAT");
+  }
+  client_data->lowat_lowered = (lowat < HEADER_SIZE);
+}
+
 void cleanup_and_close(ConnectionInfo *client_data, struct epoll_event *event,
                        int epoll_fd, int fd) {
   reset_client_data(client_data);
-  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  client_data->readable = 0;
+  client_data->writable = 0;
+  client_data->lowat_lowered = 0;
+  client_data->paused = 0;
+  // closing the only reference to the fd removes it from the epoll set
+  if (!minimal_mode) {
+    stats.epoll_ctl++;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  }
+  stats.close++;
   close(fd);
 }
 
+// Over-limit sources are not disconnected; their reads are paused so the
+// socket buffer fills up and TCP flow control pushes back on the sender.
+int read_paused(ConnectionInfo *client_data, int header, uint32_t *len) {
+  if (!ratelimit_enabled) {
+    return 0;
+  }
+
+  uint32_t now = now_ms();
+  if (client_data->paused && (int32_t)(client_data->resume_ms - now) > 0) {
+    return 1;
+  }
+  client_data->paused = 0;
+
+  uint32_t allowance;
+  uint32_t wait =
+      ratelimit_wait(&limiter, client_data->addr, now, header, &allowance);
+  if (wait == 0) {
+    // never read more than the byte bucket holds
+    if (*len > allowance) {
+      *len = allowance;
+    }
+    return 0;
+  }
+  DEBUG_PRINT("pausing client %d for %u ms\n", client_data->client_fd, wait);
+  client_data->paused = 1;
+  client_data->resume_ms = now + wait;
+  return 1;
+}
+
 int handle_client(ConnectionInfo *client_data, struct epoll_event *event,
                   int epoll_fd) {
   int fd = client_data->client_fd;
@@ -64,14 +186,28 @@ int handle_client(ConnectionInfo *client_data, struct epoll_event *event,
   uint32_t *bytes_recv = &(client_data->bytes_recv);
   uint32_t *bytes_sent = &(client_data->bytes_sent);
 
+  if (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    client_data->readable = 1;
+  }
+  if (event->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+    client_data->writable = 1;
+  }
+
   while (1) {
     // Keep reading until we have a full header
 
     if (*bytes_recv < HEADER_SIZE) {
-      ssize_t count = recv(fd, msg + *bytes_recv, HEADER_SIZE - *bytes_recv, 0);
+      uint32_t len = HEADER_SIZE - *bytes_recv;
+      if ((minimal_mode && !client_data->readable) ||
+          read_paused(client_data, 1, &len)) {
+        break;
+      }
+      stats.recv++;
+      ssize_t count = recv(fd, msg + *bytes_recv, len, 0);
 
       if (count == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          client_data->readable = 0;
           break;
         } else {
           perror("recv header");
@@ -84,6 +220,10 @@ int handle_client(ConnectionInfo *client_data, struct epoll_event *event,
       }
 
       *bytes_recv += count;
+      if (ratelimit_enabled) {
+        ratelimit_charge(&limiter, client_data->addr, count,
+                         *bytes_recv == HEADER_SIZE, now_ms());
+      }
 
       // Fill metadata
       if (*bytes_recv == HEADER_SIZE) {
@@ -93,7 +233,7 @@ int handle_client(ConnectionInfo *client_data, struct epoll_event *event,
         DEBUG_PRINT("op : %d, shift : %d, msg_size : %d\n", client_data->op,
                     client_data->shift, *msg_size);
 
-        if (*msg_size > MAX_MSG_SIZE) {
+        if (*msg_size > MAX_MSG_SIZE || *msg_size < HEADER_SIZE) {
           DEBUG_PRINT(
               "Message too large, should be less than 10MB : received %d\n",
               *msg_size);
@@ -112,11 +252,26 @@ int handle_client(ConnectionInfo *client_data, struct epoll_event *event,
 
     // Header received, Keep reading until we have a full message
     if (*msg_size > 0 && *bytes_recv < *msg_size) {
-      ssize_t count = recv(fd, msg + *bytes_recv, *msg_size - *bytes_recv, 0);
+      uint32_t len = *msg_size - *bytes_recv;
+      if ((minimal_mode && !client_data->readable) ||
+          read_paused(client_data, 0, &len)) {
+        break;
+      }
+      stats.recv++;
+      ssize_t count = recv(fd, msg + *bytes_recv, len, 0);
       DEBUG_PRINT("bytes_recv : % d\n", *bytes_recv);
 
       if (count == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          client_data->readable = 0;
+          // the listener's SO_RCVLOWAT would hide a tail shorter than a
+          // header, so drop it to one byte until this message completes
+          if (minimal_mode && *msg_size - *bytes_recv < HEADER_SIZE &&
+              !client_data->lowat_lowered) {
+            set_rcvlowat(client_data, 1);
+            client_data->readable = 1;
+            continue;
+          }
           break;
         } else {
           perror("recv content");
@@ -129,6 +284,9 @@ int handle_client(ConnectionInfo *client_data, struct epoll_event *event,
       }
 
       *bytes_recv += count;
+      if (ratelimit_enabled) {
+        ratelimit_charge(&limiter, client_data->addr, count, 0, now_ms());
+      }
     }
 
     // Process the message
@@ -142,20 +300,32 @@ int handle_client(ConnectionInfo *client_data, struct epoll_event *event,
 
       *bytes_sent = 0;
 
-      // Modify the event to monitor for output readiness
-      event->events = EPOLLOUT | EPOLLET;
-      if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, event) == -1) {
-        perror("epoll_ctl change mode to out");
-        cleanup_and_close(client_data, event, epoll_fd, fd);
-        return -1;
+      if (minimal_mode) {
+        if (client_data->lowat_lowered) {
+          set_rcvlowat(client_data, HEADER_SIZE);
+        }
+      } else {
+        // Modify the event to monitor for output readiness
+        event->events = EPOLLOUT | EPOLLET;
+        stats.epoll_ctl++;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, event) == -1) {
+          perror("epoll_ctl change mode to out");
+          cleanup_and_close(client_data, event, epoll_fd, fd);
+          return -1;
+        }
       }
     }
 
     if (client_data->processed == 1 && *bytes_sent < *msg_size) {
+      if (minimal_mode && !client_data->writable) {
+        break;
+      }
+      stats.send++;
       ssize_t count =
           send(fd, client_data->msg + *bytes_sent, *msg_size - *bytes_sent, 0);
       if (count == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          client_data->writable = 0;
           break;
         } else {
           perror("send");
@@ -171,10 +341,16 @@ int handle_client(ConnectionInfo *client_data, struct epoll_event *event,
       DEBUG_PRINT("bytes_sent : %d\n", *bytes_sent);
     }
 
-    if (*bytes_sent == *msg_size) {
+    if (client_data->processed == 1 && *bytes_sent == *msg_size) {
       reset_client_data(client_data);
+      stats.requests++;
+      if (minimal_mode) {
+        // still registered for input, pick up any pipelined request
+        continue;
+      }
       // sending finished, modify the event to monitor for input readiness
       event->events = EPOLLIN | EPOLLET;
+      stats.epoll_ctl++;
       if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, event) == -1) {
         perror("epoll_ctl : change mode to in");
         cleanup_and_close(client_data, event, epoll_fd, fd);
@@ -190,18 +366,38 @@ int handle_client(ConnectionInfo *client_data, struct epoll_event *event,
 void setnonblocking(int sock) {
   int opts;
 
+  stats.sockopt++;
   opts = fcntl(sock, F_GETFL);
   if (opts < 0) {
     perror("fcntl(F_GETFL)");
     exit(1);
   }
   opts = (opts | O_NONBLOCK);
+  stats.sockopt++;
   if (fcntl(sock, F_SETFL, opts) < 0) {
     perror("fcntl(F_SETFL)");
     exit(1);
   }
 }
 
+// accepted sockets inherit buffer sizes and the low watermark from the
+// listener, so set them once here instead of per connection
+void set_listener_sockopts(int sockfd) {
+  int bufsize = SOCK_BUFSIZE;
+  int lowat = HEADER_SIZE;
+
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) ==
+          -1 ||
+      setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) ==
+          -1 ||
+      setsockopt(sockfd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) ==
+          -1) {
+    perror("setsockopt");
+    close(sockfd);
+    exit(EXIT_FAILURE);
+  }
+}
+
 int get_empty(int32_t *event_to_fd) {
   for (int i = 0; i < MAX_EVENTS; i++) {
     if (event_to_fd[i] == -1) {
@@ -225,11 +421,48 @@ int set_slot_by_fd(int32_t *event_to_fd, int fd, int slot) {
   return 0;
 }
 
+// Resume paused clients whose buckets have refilled, and return the epoll
+// timeout until the next one is due.
+int resume_paused(ConnectionInfo *client_data, int32_t *client_to_fd,
+                  int epoll_fd) {
+  uint32_t now = now_ms();
+  int timeout = -1;
+
+  for (int i = 0; i < MAX_EVENTS; i++) {
+    if (client_to_fd[i] == -1 || !client_data[i].paused) {
+      continue;
+    }
+
+    int32_t left = (int32_t)(client_data[i].resume_ms - now);
+    if (left > 0) {
+      if (timeout == -1 || left < timeout) {
+        timeout = left;
+      }
+      continue;
+    }
+
+    // edge triggered, so the data that was left unread raises no new event
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = client_to_fd[i];
+    if (handle_client(&client_data[i], &event, epoll_fd) < 0) {
+      client_to_fd[i] = -1;
+    } else if (client_data[i].paused) {
+      left = (int32_t)(client_data[i].resume_ms - now);
+      if (timeout == -1 || left < timeout) {
+        timeout = left > 0 ? left : 0;
+      }
+    }
+  }
+  return timeout;
+}
+
 int main(int argc, char *argv[]) {
   int opt;
   uint16_t port = 0;
+  float byte_rate = 0, req_rate = 0;
 
-  while ((opt = getopt(argc, argv, "p:")) != -1) {
+  while ((opt = getopt(argc, argv, "p:mr:q:")) != -1) {
     switch (opt) {
       case 'p':
         port = atoi(optarg);
@@ -238,12 +471,44 @@ int main(int argc, char *argv[]) {
           exit(EXIT_FAILURE);
         }
         break;
+      case 'm':
+        minimal_mode = 1;
+        break;
+      case 'r':
+        byte_rate = atof(optarg);
+        if (byte_rate <= 0) {
+          fprintf(stderr, "Invalid byte rate");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'q':
+        req_rate = atof(optarg);
+        if (req_rate <= 0) {
+          fprintf(stderr, "Invalid request rate");
+          exit(EXIT_FAILURE);
+        }
+        break;
       default:
-        fprintf(stderr, "Usage: %s [-p]", argv[0]);
+        fprintf(stderr, "Usage: %s [-p] [-m] [-r bytes/sec] [-q requests/sec]",
+                argv[0]);
         exit(EXIT_FAILURE);
     }
   }
 
+  if (byte_rate > 0 || req_rate > 0) {
+    if (ratelimit_init(&limiter, byte_rate, req_rate, RATE_IDLE_MS) < 0) {
+      exit(EXIT_FAILURE);
+    }
+    ratelimit_enabled = 1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+
   int sockfd;
   if ((sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
     perror("socket");
@@ -257,6 +522,10 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
+  if (minimal_mode) {
+    set_listener_sockopts(sockfd);
+  }
+
   struct sockaddr_in saddr;
   memset(&saddr, 0, sizeof(saddr));
   saddr.sin_family = AF_INET;
@@ -299,14 +568,38 @@ int main(int argc, char *argv[]) {
     client_to_fd[i] = -1;
   }
 
-  while (1) {
-    int n = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+  int timeout = -1;
+  uint32_t last_sweep = now_ms();
+  while (running) {
+    stats.epoll_wait++;
+    int n = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
+    if (n == -1) {
+      if (errno != EINTR) {
+        perror("epoll_wait");
+        break;
+      }
+      if (dump_stats) {
+        dump_stats = 0;
+        print_stats();
+      }
+      continue;
+    }
+    stats.loops++;
+    stats.events += n;
     for (int i = 0; i < n; i++) {
       if (events[i].data.fd == sockfd) {
         struct sockaddr_in client_addr;
         socklen_t client_addr_len = sizeof(client_addr);
-        int client_fd =
-            accept(sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
+        int client_fd;
+
+        stats.accept++;
+        if (minimal_mode) {
+          client_fd = accept4(sockfd, (struct sockaddr *)&client_addr,
+                              &client_addr_len, SOCK_NONBLOCK);
+        } else {
+          client_fd = accept(sockfd, (struct sockaddr *)&client_addr,
+                             &client_addr_len);
+        }
 
         if (client_fd == -1) {
           if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -316,24 +609,33 @@ int main(int argc, char *argv[]) {
             break;
           }
         }
-        setnonblocking(client_fd);
-
-        ev.data.fd = client_fd;
-        ev.events = EPOLLIN | EPOLLET;
-        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
-          perror("epoll_ctl add client");
-          close(client_fd);
+        if (!minimal_mode) {
+          setnonblocking(client_fd);
         }
-        DEBUG_PRINT("client connected: %d\n", client_fd);
 
         int empty_slot = get_empty(client_to_fd);
         if (empty_slot < 0) {
           DEBUG_PRINT("too many clients for %d\n", client_fd);
+          stats.close++;
           close(client_fd);
           continue;
         }
 
+        ev.data.fd = client_fd;
+        // in minimal mode the fd is registered once for both directions
+        ev.events = minimal_mode ? (EPOLLIN | EPOLLOUT | EPOLLET)
+                                 : (EPOLLIN | EPOLLET);
+        stats.epoll_ctl++;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+          perror("epoll_ctl add client");
+          stats.close++;
+          close(client_fd);
+          continue;
+        }
+        DEBUG_PRINT("client connected: %d\n", client_fd);
+
         client_data[empty_slot].client_fd = client_fd;
+        client_data[empty_slot].addr = client_addr.sin_addr.s_addr;
         set_slot_by_fd(client_to_fd, client_fd, empty_slot);
       } else {
         int slot = get_slot_by_fd(client_to_fd, events[i].data.fd);
@@ -346,6 +648,20 @@ int main(int argc, char *argv[]) {
         };
       }
     }
+
+    if (ratelimit_enabled) {
+      timeout = resume_paused(client_data, client_to_fd, epollfd);
+      uint32_t now = now_ms();
+      if (now - last_sweep >= RATE_SWEEP_MS) {
+        ratelimit_expire(&limiter, now);
+        last_sweep = now;
+      }
+    }
+  }
+
+  print_stats();
+  if (ratelimit_enabled) {
+    ratelimit_free(&limiter);
   }
 
   // clean up
@@ -0,0 +1,178 @@
+#include "access_log.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// Every ring has one producer, its worker, and one consumer, the writer
+// thread, so the two indexes are all the synchronisation there is: the
+// worker publishes a record by moving head past it, the writer frees the
+// slot by moving tail. The two sit on cache lines of their own.
+
+#define ACCESS_LOG_BUF_SIZE (1024 * 1024)
+
+typedef struct {
+  uint64_t head;  // next record to write, moved by the worker
+  uint64_t dropped;
+  uint64_t tail __attribute__((aligned(64)));  // next one to format
+  access_record_t records[ACCESS_LOG_RING_SIZE]
+      __attribute__((aligned(64)));
+} access_ring_t;
+
+int log_level = LEVEL_INFO;
+
+static const char *level_names[] = {"error", "info", "debug"};
+static const char *result_names[] = {"MISS",   "HIT",   "COLLAPSED",
+                                     "BYPASS", "LOCAL", "TUNNEL"};
+
+static FILE *file = NULL;
+static access_ring_t *rings[ACCESS_LOG_MAX_RINGS];
+static int ring_count = 0;
+static pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread access_ring_t *ring = NULL;
+
+// The level named, or -1.
+int access_log_parse_level(const char *name) {
+  for (int i = LEVEL_ERROR; i <= LEVEL_DEBUG; i++) {
+    if (strcasecmp(name, level_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Move to the next level, from debug back round to error.
+void access_log_step_level() {
+  int level = (LOG_LEVEL() + 1) % (LEVEL_DEBUG + 1);
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+  fprintf(stderr, "log level %s\n", level_names[level]);
+}
+
+// Whether a transaction should be recorded; at the error level only the
+// failed ones are.
+int access_log_wants(int failed) {
+  return ring != NULL && (failed || LOG_LEVEL() >= LEVEL_INFO);
+}
+
+void access_log_append(const access_record_t *record) {
+  uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+      ACCESS_LOG_RING_SIZE) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  ring->records[head & (ACCESS_LOG_RING_SIZE - 1)] = *record;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void format_record(const access_record_t *record, char *stamp,
+                          time_t *stamp_sec) {
+  time_t sec = record->time_ms / 1000;
+  if (sec != *stamp_sec) {
+    // the same second for a whole batch is formatted once
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    strftime(stamp, 32, "%Y-%m-%dT%H:%M:%S", &tm);
+    *stamp_sec = sec;
+  }
+
+  char addr[INET_ADDRSTRLEN];
+  struct in_addr in = {record->client_addr};
+  inet_ntop(AF_INET, &in, addr, sizeof(addr));
+
+  char status[8] = "-";
+  if (record->status != 0) {
+    snprintf(status, sizeof(status), "%u", record->status);
+  }
+  fprintf(file, "%s.%03u %s:%u %s %s %s %lu %uus %.*s\n", stamp,
+          (unsigned)(record->time_ms % 1000), addr, ntohs(record->client_port),
+          status, result_names[record->result],
+          record->complete ? "done" : "aborted", record->bytes,
+          record->duration_us, record->url_len, record->url);
+}
+
+static void *writer_main(void *unused) {
+  char stamp[32];
+  time_t stamp_sec = 0;
+  uint64_t reported = 0;
+
+  while (1) {
+    int written = 0;
+    uint64_t dropped = 0;
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < count; i++) {
+      access_ring_t *r = rings[i];
+      uint64_t tail = r->tail;
+      uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+      for (; tail != head; tail++) {
+        format_record(&r->records[tail & (ACCESS_LOG_RING_SIZE - 1)], stamp,
+                      &stamp_sec);
+        written++;
+      }
+      __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+      dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    if (dropped != reported) {
+      fprintf(file, "# %lu records dropped, the log could not keep up\n",
+              dropped - reported);
+      reported = dropped;
+    }
+
+    if (written == 0) {
+      fflush(file);
+      struct timespec nap = {0, ACCESS_LOG_IDLE_MS * 1000000L};
+      nanosleep(&nap, NULL);
+    }
+  }
+  return NULL;
+}
+
+// Open the log for appending and start its writer thread.
+int access_log_init(const char *path) {
+  file = fopen(path, "a");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+  setvbuf(file, NULL, _IOFBF, ACCESS_LOG_BUF_SIZE);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, writer_main, NULL) != 0) {
+    perror("pthread_create");
+    fclose(file);
+    file = NULL;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+// Give the calling worker a ring of its own; without an access log there is
+// nothing to do.
+int access_log_attach() {
+  if (file == NULL) {
+    return 0;
+  }
+  access_ring_t *r = calloc(1, sizeof(access_ring_t));
+  if (r == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  pthread_mutex_lock(&attach_lock);
+  int slot = ring_count;
+  if (slot < ACCESS_LOG_MAX_RINGS) {
+    rings[slot] = r;
+    __atomic_store_n(&ring_count, slot + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&attach_lock);
+  if (slot == ACCESS_LOG_MAX_RINGS) {
+    free(r);
+    return -1;
+  }
+  ring = r;
+  return 0;
+}
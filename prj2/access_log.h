@@ -0,0 +1,42 @@
+#include <stdint.h>
+
+#include "common.h"
+
+// Access log. Each worker appends fixed-size binary records to a ring of
+// its own without taking a lock, and a background thread formats them into
+// the log file in batches. A record that finds its ring full is dropped and
+// counted instead of holding up the event loop.
+
+#define ACCESS_LOG_RING_SIZE 4096  // records per worker, a power of two
+#define ACCESS_LOG_MAX_RINGS 64
+#define ACCESS_LOG_URL_MAX 216
+#define ACCESS_LOG_IDLE_MS 20  // the writer's nap when every ring is empty
+
+typedef enum {
+  RESULT_MISS,
+  RESULT_HIT,
+  RESULT_COLLAPSED,  // served from another client's fetch
+  RESULT_BYPASS,     // not cacheable
+  RESULT_LOCAL,      // answered by the proxy itself
+  RESULT_TUNNEL,     // CONNECT
+} access_result_t;
+
+typedef struct {
+  uint64_t time_ms;  // wall clock when the transaction ended
+  uint64_t bytes;    // response bytes sent to the client
+  uint32_t duration_us;
+  uint32_t client_addr;  // network byte order
+  uint16_t client_port;
+  uint16_t status;  // 0 when no response was sent
+  uint8_t result;
+  uint8_t complete;  // the response went out in full
+  uint16_t url_len;
+  char url[ACCESS_LOG_URL_MAX];
+} access_record_t;
+
+int access_log_init(const char *path);
+int access_log_attach();
+int access_log_wants(int failed);
+void access_log_append(const access_record_t *record);
+int access_log_parse_level(const char *name);
+void access_log_step_level();
@@ -0,0 +1,264 @@
+#include "blacklist.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// An entry matches when it occurs anywhere in the URL, compared without
+// regard to case. Nodes live in one array and keep their children as a
+// sibling list sorted by byte; the root's children are also indexed by a
+// full table since every step that falls back ends there.
+
+#define ROOT 0
+#define NONE 0xffffffffu
+
+typedef struct {
+  uint32_t child;    // first child
+  uint32_t sibling;  // next child of the same parent
+  uint32_t fail;     // longest proper suffix that is also in the trie
+  uint8_t c;
+  uint8_t match;  // an entry ends here or on the fail chain
+} ac_node_t;
+
+typedef struct {
+  ac_node_t *nodes;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t root_next[256];
+  size_t entries;
+} automaton_t;
+
+static automaton_t *current = NULL;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *source = NULL;  // NULL for stdin
+
+static void free_automaton(automaton_t *ac) {
+  if (ac != NULL) {
+    free(ac->nodes);
+    free(ac);
+  }
+}
+
+static uint32_t new_node(automaton_t *ac, uint8_t c) {
+  if (ac->count == ac->capacity) {
+    uint32_t capacity = ac->capacity ? ac->capacity * 2 : 1024;
+    ac_node_t *nodes = realloc(ac->nodes, capacity * sizeof(ac_node_t));
+    if (nodes == NULL) {
+      return NONE;
+    }
+    ac->nodes = nodes;
+    ac->capacity = capacity;
+  }
+  ac_node_t *node = &ac->nodes[ac->count];
+  node->child = NONE;
+  node->sibling = NONE;
+  node->fail = ROOT;
+  node->c = c;
+  node->match = 0;
+  return ac->count++;
+}
+
+static uint32_t find_child(const automaton_t *ac, uint32_t parent, uint8_t c) {
+  uint32_t n = ac->nodes[parent].child;
+  while (n != NONE && ac->nodes[n].c < c) {
+    n = ac->nodes[n].sibling;
+  }
+  return (n != NONE && ac->nodes[n].c == c) ? n : NONE;
+}
+
+static int insert(automaton_t *ac, const char *entry, size_t len) {
+  uint32_t n = ROOT;
+
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = tolower((unsigned char)entry[i]);
+    uint32_t *link = &ac->nodes[n].child;
+    while (*link != NONE && ac->nodes[*link].c < c) {
+      link = &ac->nodes[*link].sibling;
+    }
+    if (*link == NONE || ac->nodes[*link].c != c) {
+      uint32_t child = new_node(ac, c);
+      if (child == NONE) {
+        return -1;
+      }
+      // the array may have moved
+      link = &ac->nodes[n].child;
+      while (*link != NONE && ac->nodes[*link].c < c) {
+        link = &ac->nodes[*link].sibling;
+      }
+      ac->nodes[child].sibling = *link;
+      *link = child;
+    }
+    n = *link;
+  }
+  ac->nodes[n].match = 1;
+  return 0;
+}
+
+// Breadth-first pass that fills in the fail links; a parent's link is
+// always final before its children are visited.
+static int link_failures(automaton_t *ac) {
+  uint32_t *queue = malloc(ac->count * sizeof(uint32_t));
+  uint32_t head = 0, tail = 0;
+
+  if (queue == NULL) {
+    return -1;
+  }
+  for (int c = 0; c < 256; c++) {
+    ac->root_next[c] = ROOT;
+  }
+  for (uint32_t n = ac->nodes[ROOT].child; n != NONE;
+       n = ac->nodes[n].sibling) {
+    ac->root_next[ac->nodes[n].c] = n;
+    queue[tail++] = n;
+  }
+
+  while (head < tail) {
+    uint32_t parent = queue[head++];
+    for (uint32_t n = ac->nodes[parent].child; n != NONE;
+         n = ac->nodes[n].sibling) {
+      uint8_t c = ac->nodes[n].c;
+      uint32_t f = ac->nodes[parent].fail;
+      uint32_t next;
+      while (f != ROOT && (next = find_child(ac, f, c)) == NONE) {
+        f = ac->nodes[f].fail;
+      }
+      if (f == ROOT) {
+        next = ac->root_next[c];
+      }
+      ac->nodes[n].fail = next;
+      ac->nodes[n].match |= ac->nodes[next].match;
+      queue[tail++] = n;
+    }
+  }
+  free(queue);
+  return 0;
+}
+
+static automaton_t *compile(FILE *file) {
+  automaton_t *ac = calloc(1, sizeof(automaton_t));
+  if (ac == NULL || new_node(ac, 0) == NONE) {
+    free_automaton(ac);
+    return NULL;
+  }
+
+  size_t count = 0;
+  char **urls = read_urls_from_file(file, &count);
+  if (urls == NULL) {
+    free_automaton(ac);
+    return NULL;
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t len = strlen(urls[i]);
+    while (len > 0 && isspace((unsigned char)urls[i][len - 1])) len--;
+    // an empty entry would match every URL
+    if (len == 0) continue;
+    if (insert(ac, urls[i], len) < 0) {
+      free_urls(urls, count);
+      free_automaton(ac);
+      return NULL;
+    }
+    ac->entries++;
+  }
+  free_urls(urls, count);
+
+  if (link_failures(ac) < 0) {
+    free_automaton(ac);
+    return NULL;
+  }
+  return ac;
+}
+
+static automaton_t *load() {
+  FILE *file = stdin;
+
+  if (source != NULL) {
+    file = fopen(source, "r");
+    if (file == NULL) {
+      perror(source);
+      return NULL;
+    }
+  } else {
+    rewind(stdin);
+  }
+  automaton_t *ac = compile(file);
+  if (file != stdin) {
+    fclose(file);
+  }
+  return ac;
+}
+
+static void install(automaton_t *ac) {
+  pthread_rwlock_wrlock(&lock);
+  automaton_t *old = current;
+  current = ac;
+  pthread_rwlock_unlock(&lock);
+  free_automaton(old);
+}
+
+// Load the list from path, or from stdin when path is NULL.
+int blacklist_init(const char *path) {
+  source = path;
+  automaton_t *ac = load();
+  if (ac == NULL) {
+    return -1;
+  }
+  install(ac);
+  return 0;
+}
+
+static void *reload_main(void *unused) {
+  pthread_mutex_lock(&reload_lock);
+  automaton_t *ac = load();
+  if (ac != NULL) {
+    install(ac);
+    fprintf(stderr, "blacklist reloaded: %zu entries, %u nodes\n",
+            ac->entries, ac->count);
+  } else {
+    fprintf(stderr, "blacklist reload failed, keeping the old list\n");
+  }
+  pthread_mutex_unlock(&reload_lock);
+  return NULL;
+}
+
+// Rebuild the automaton from the same source on a thread of its own.
+void blacklist_reload() {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, reload_main, NULL) != 0) {
+    perror("pthread_create");
+    return;
+  }
+  pthread_detach(thread);
+}
+
+int blacklist_match(const char *url, size_t len) {
+  int matched = 0;
+
+  pthread_rwlock_rdlock(&lock);
+  const automaton_t *ac = current;
+  if (ac != NULL && ac->entries > 0) {
+    uint32_t n = ROOT;
+    for (size_t i = 0; i < len && !matched; i++) {
+      uint8_t c = tolower((unsigned char)url[i]);
+      uint32_t next;
+      while (n != ROOT && (next = find_child(ac, n, c)) == NONE) {
+        n = ac->nodes[n].fail;
+      }
+      n = (n == ROOT) ? ac->root_next[c] : next;
+      matched = ac->nodes[n].match;
+    }
+  }
+  pthread_rwlock_unlock(&lock);
+  return matched;
+}
+
+size_t blacklist_entries() {
+  pthread_rwlock_rdlock(&lock);
+  size_t entries = current ? current->entries : 0;
+  pthread_rwlock_unlock(&lock);
+  return entries;
+}
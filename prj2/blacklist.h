@@ -0,0 +1,14 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Blacklist compiled into an Aho-Corasick automaton over the entries, so a
+// lookup walks the URL once whatever the size of the list. A reload builds
+// the new automaton off the event loop and swaps it in under a write lock,
+// so the old one is only freed once no lookup is using it.
+
+int blacklist_init(const char *path);
+void blacklist_reload();
+int blacklist_match(const char *url, size_t len);
+size_t blacklist_entries();
@@ -0,0 +1,716 @@
+#define _GNU_SOURCE
+
+#include "cache.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk_cache.h"
+#include "slab.h"
+#include "utils.h"
+
+cache_stats_t cache_stats;
+
+// Workers share the cache. Even a lookup reorders the LRU lists, so one
+// mutex covers the index, the lists and the slab allocator. Committed
+// objects never change, and a reader holding a reference copies from their
+// blocks without it.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_object_t *buckets[CACHE_BUCKETS];
+static cache_object_t *probation_head, *probation_tail;
+static cache_object_t *protected_head, *protected_tail;
+static uint64_t budget = 0;
+static uint64_t used = 0;
+static uint64_t protected_bytes = 0;
+static uint64_t objects = 0;
+
+static uint32_t hash_key(const char *key) {
+  uint32_t h = 2166136261u;
+  for (; *key; key++) {
+    h = (h ^ (unsigned char)*key) * 16777619u;
+  }
+  return h;
+}
+
+int cache_init(uint64_t bytes) {
+  budget = bytes;
+  return 0;
+}
+
+int cache_enabled() { return budget > 0; }
+
+// The key is the method and the absolute URI; origin-form requests get the
+// Host header folded back in.
+char *cache_make_key(const char *req, size_t len, const char *host, int port) {
+  const char *sp = memchr(req, ' ', len);
+  if (sp == NULL) return NULL;
+  const char *target = sp + 1;
+  const char *target_end = memchr(target, ' ', req + len - target);
+  if (target_end == NULL) return NULL;
+
+  size_t method_len = sp - req;
+  size_t target_len = target_end - target;
+  size_t key_len = method_len + 1 + target_len + strlen(host) + 16;
+  char *key = malloc(key_len + 1);
+  if (key == NULL) return NULL;
+
+  if (target_len >= 7 && strncasecmp(target, "http://", 7) == 0) {
+    snprintf(key, key_len + 1, "%.*s %.*s", (int)method_len, req,
+             (int)target_len, target);
+  } else if (port == 80) {
+    snprintf(key, key_len + 1, "%.*s http://%s%.*s", (int)method_len, req,
+             host, (int)target_len, target);
+  } else {
+    snprintf(key, key_len + 1, "%.*s http://%s:%d%.*s", (int)method_len, req,
+             host, port, (int)target_len, target);
+  }
+  return key;
+}
+
+int cache_request_policy(const char *req, size_t len) {
+  const char *value;
+  size_t value_len;
+
+  if (!cache_enabled() || len < 4 || strncmp(req, "GET ", 4) != 0) {
+    return 0;
+  }
+  // the validator If-Range compares is the origin's to judge
+  if (find_header(req, len, "Authorization", &value_len) != NULL ||
+      find_header(req, len, "If-Range", &value_len) != NULL) {
+    return 0;
+  }
+  // a range can be cut from a stored object, but what the origin sends for
+  // one is only part of it
+  int store =
+      find_header(req, len, "Range", &value_len) == NULL ? CACHE_STORE : 0;
+
+  value = find_header(req, len, "Cache-Control", &value_len);
+  if (value != NULL) {
+    if (has_token(value, value_len, "no-store")) return 0;
+    if (has_token(value, value_len, "no-cache") ||
+        token_value(value, value_len, "max-age") == 0) {
+      return store;
+    }
+  } else {
+    value = find_header(req, len, "Pragma", &value_len);
+    if (value != NULL && has_token(value, value_len, "no-cache")) {
+      return store;
+    }
+  }
+  return CACHE_LOOKUP | store;
+}
+
+static time_t parse_http_date(const char *value, size_t len) {
+  char buf[64];
+  struct tm tm;
+
+  if (value == NULL || len >= sizeof(buf)) return -1;
+  memcpy(buf, value, len);
+  buf[len] = '\0';
+
+  memset(&tm, 0, sizeof(tm));
+  if (strptime(buf, "%a, %d %b %Y %H:%M:%S", &tm) == NULL) return -1;
+  return timegm(&tm);
+}
+
+// Decide whether a response may be stored and until when it is fresh,
+// following the freshness rules of RFC 9111 without revalidation.
+int cache_response_policy(const char *res, size_t header_len, time_t *expires) {
+  const char *value;
+  size_t value_len;
+  long lifetime = -1;
+
+  if (header_len < 12 || strncmp(res, "HTTP/1.", 7) != 0) return 0;
+  int status = atoi(res + 9);
+  switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+      break;
+    default:
+      return 0;
+  }
+
+  value = find_header(res, header_len, "Cache-Control", &value_len);
+  if (value != NULL) {
+    if (has_token(value, value_len, "no-store") ||
+        has_token(value, value_len, "no-cache") ||
+        has_token(value, value_len, "private")) {
+      return 0;
+    }
+    lifetime = token_value(value, value_len, "s-maxage");
+    if (lifetime < 0) lifetime = token_value(value, value_len, "max-age");
+  }
+
+  value = find_header(res, header_len, "Vary", &value_len);
+  if (value != NULL && memchr(value, '*', value_len) != NULL) return 0;
+  if (find_header(res, header_len, "Set-Cookie", &value_len) != NULL) {
+    return 0;
+  }
+
+  time_t now = time(NULL);
+  value = find_header(res, header_len, "Date", &value_len);
+  time_t date = parse_http_date(value, value_len);
+  if (date < 0) date = now;
+
+  if (lifetime < 0) {
+    value = find_header(res, header_len, "Expires", &value_len);
+    if (value != NULL) {
+      // an invalid date such as "0" means already expired
+      time_t expires_at = parse_http_date(value, value_len);
+      lifetime = expires_at < 0 ? 0 : expires_at - date;
+    }
+  }
+  if (lifetime < 0) {
+    value = find_header(res, header_len, "Last-Modified", &value_len);
+    time_t modified = parse_http_date(value, value_len);
+    if (modified >= 0 && modified < date) {
+      lifetime = (date - modified) * CACHE_HEURISTIC_PERCENT / 100;
+      if (lifetime > CACHE_HEURISTIC_MAX) lifetime = CACHE_HEURISTIC_MAX;
+    }
+  }
+  if (lifetime <= 0) return 0;
+
+  long age = 0;
+  value = find_header(res, header_len, "Age", &value_len);
+  if (value != NULL) age = atol(value);
+  if (now - date > age) age = now - date;
+
+  *expires = now + lifetime - age;
+  return *expires > now;
+}
+
+// Serialize the request's values for each header named in Vary.
+static char *build_vary(const char *vary, size_t vary_len, const char *req,
+                        size_t req_len) {
+  size_t cap = 64, n = 0;
+  char *out = malloc(cap);
+  const char *p = vary, *end = vary + vary_len;
+
+  if (out == NULL) return NULL;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == ',' || *p == '\t')) p++;
+    const char *name = p;
+    while (p < end && *p != ',' && *p != ' ' && *p != '\t') p++;
+    size_t name_len = p - name;
+    if (name_len == 0 || name_len > 64) continue;
+
+    char field[65];
+    for (size_t i = 0; i < name_len; i++) field[i] = tolower(name[i]);
+    field[name_len] = '\0';
+
+    size_t value_len = 0;
+    const char *value = find_header(req, req_len, field, &value_len);
+    if (value == NULL) value_len = 0;
+
+    while (n + name_len + value_len + 3 > cap) {
+      cap *= 2;
+      char *tmp = realloc(out, cap);
+      if (tmp == NULL) {
+        free(out);
+        return NULL;
+      }
+      out = tmp;
+    }
+    n += sprintf(out + n, "%s:%.*s\n", field, (int)value_len,
+                 value ? value : "");
+  }
+  out[n] = '\0';
+  return out;
+}
+
+// Check a stored variant against the request's values for the Vary fields.
+int cache_vary_matches(const char *stored, const char *req, size_t req_len) {
+  const char *line = stored;
+
+  while (*line) {
+    const char *colon = strchr(line, ':');
+    const char *eol = strchr(line, '\n');
+    if (colon == NULL || eol == NULL) return 0;
+
+    char field[65];
+    size_t name_len = colon - line;
+    if (name_len > 64) return 0;
+    memcpy(field, line, name_len);
+    field[name_len] = '\0';
+
+    size_t value_len = 0;
+    const char *value = find_header(req, req_len, field, &value_len);
+    if (value == NULL) value_len = 0;
+    if ((size_t)(eol - colon - 1) != value_len ||
+        (value_len && memcmp(colon + 1, value, value_len) != 0)) {
+      return 0;
+    }
+    line = eol + 1;
+  }
+  return 1;
+}
+
+static void lru_remove(cache_object_t *obj) {
+  cache_object_t **head, **tail;
+
+  if (obj->segment == SEGMENT_NONE) return;
+  if (obj->segment == SEGMENT_PROTECTED) {
+    head = &protected_head;
+    tail = &protected_tail;
+    protected_bytes -= obj->charged;
+  } else {
+    head = &probation_head;
+    tail = &probation_tail;
+  }
+
+  if (obj->lru_prev) {
+    obj->lru_prev->lru_next = obj->lru_next;
+  } else {
+    *head = obj->lru_next;
+  }
+  if (obj->lru_next) {
+    obj->lru_next->lru_prev = obj->lru_prev;
+  } else {
+    *tail = obj->lru_prev;
+  }
+  obj->lru_prev = obj->lru_next = NULL;
+  obj->segment = SEGMENT_NONE;
+}
+
+static void lru_push(cache_object_t *obj, segment_t segment) {
+  cache_object_t **head, **tail;
+
+  if (segment == SEGMENT_PROTECTED) {
+    head = &protected_head;
+    tail = &protected_tail;
+    protected_bytes += obj->charged;
+  } else {
+    head = &probation_head;
+    tail = &probation_tail;
+  }
+
+  obj->segment = segment;
+  obj->lru_prev = NULL;
+  obj->lru_next = *head;
+  if (*head) {
+    (*head)->lru_prev = obj;
+  } else {
+    *tail = obj;
+  }
+  *head = obj;
+}
+
+static void free_object(cache_object_t *obj) {
+  cache_block_t *block = obj->blocks;
+  while (block != NULL) {
+    cache_block_t *next = block->next;
+    slab_free(block, block->size + sizeof(cache_block_t));
+    block = next;
+  }
+  used -= obj->charged;
+  if (obj->spill_fd >= 0) {
+    close(obj->spill_fd);
+  }
+  free(obj->key);
+  free(obj->vary);
+  free(obj);
+}
+
+// Take an object out of the index; it is freed once its last reader is done.
+static void unlink_object(cache_object_t *obj) {
+  cache_object_t **link = &buckets[obj->hash % CACHE_BUCKETS];
+  while (*link != NULL && *link != obj) {
+    link = &(*link)->hash_next;
+  }
+  if (*link == obj) {
+    *link = obj->hash_next;
+    objects--;
+  }
+  obj->hash_next = NULL;
+  lru_remove(obj);
+  if (obj->prefetched) {
+    STAT_ADD(cache_stats.prefetch_unused, 1);
+    obj->prefetched = 0;
+  }
+
+  if (--obj->refcount == 0) {
+    free_object(obj);
+  }
+}
+
+static int evict_one() {
+  cache_object_t *victim = probation_tail ? probation_tail : protected_tail;
+  if (victim == NULL) return -1;
+
+  DEBUG_PRINT("cache evict %s\n", victim->key);
+  cache_stats.evictions++;
+  // still fresh objects move down to the disk tier. Its writer holds a
+  // reference until they are on disk; their blocks stop counting against
+  // the budget now, or making room would evict everything queued behind.
+  if (disk_cache_enabled() && victim->expires > time(NULL)) {
+    victim->refcount++;
+    if (disk_cache_store(victim) < 0) {
+      victim->refcount--;
+    } else {
+      used -= victim->charged;
+      victim->charged = 0;
+    }
+  }
+  unlink_object(victim);
+  return 0;
+}
+
+static void balance_segments() {
+  uint64_t cap = budget * CACHE_PROTECTED_PERCENT / 100;
+  while (protected_bytes > cap && protected_tail != NULL) {
+    cache_object_t *obj = protected_tail;
+    lru_remove(obj);
+    lru_push(obj, SEGMENT_PROBATION);
+  }
+}
+
+// Returns a referenced, fresh object for the request, or NULL on a miss.
+cache_object_t *cache_lookup(const char *key, const char *req, size_t len) {
+  uint32_t hash = hash_key(key);
+
+  pthread_mutex_lock(&lock);
+  cache_object_t *obj = buckets[hash % CACHE_BUCKETS];
+  cache_stats.lookups++;
+  while (obj != NULL && (obj->hash != hash || strcmp(obj->key, key) != 0)) {
+    obj = obj->hash_next;
+  }
+
+  if (obj != NULL && obj->expires <= time(NULL)) {
+    unlink_object(obj);
+    obj = NULL;
+  }
+  if (obj == NULL || (obj->vary && !cache_vary_matches(obj->vary, req, len))) {
+    cache_stats.misses++;
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+
+  lru_remove(obj);
+  lru_push(obj, SEGMENT_PROTECTED);
+  balance_segments();
+
+  if (obj->prefetched) {
+    obj->prefetched = 0;
+    STAT_ADD(cache_stats.prefetch_used, 1);
+  }
+  obj->refcount++;
+  cache_stats.hits++;
+  pthread_mutex_unlock(&lock);
+  return obj;
+}
+
+// Whether a fresh object is stored for key, without it counting as a use.
+int cache_contains(const char *key) {
+  uint32_t hash = hash_key(key);
+
+  pthread_mutex_lock(&lock);
+  cache_object_t *obj = buckets[hash % CACHE_BUCKETS];
+  while (obj != NULL && (obj->hash != hash || strcmp(obj->key, key) != 0)) {
+    obj = obj->hash_next;
+  }
+  int found = obj != NULL && obj->expires > time(NULL);
+  pthread_mutex_unlock(&lock);
+  return found;
+}
+
+void cache_retain(cache_object_t *obj) {
+  pthread_mutex_lock(&lock);
+  obj->refcount++;
+  pthread_mutex_unlock(&lock);
+}
+
+void cache_release(cache_object_t *obj) {
+  pthread_mutex_lock(&lock);
+  if (--obj->refcount == 0) {
+    free_object(obj);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Start collecting a response; the object is invisible until committed.
+cache_object_t *cache_begin(const char *key, time_t expires, const char *req,
+                            size_t req_len, const char *res,
+                            size_t res_header_len) {
+  cache_object_t *obj = calloc(1, sizeof(cache_object_t));
+  if (obj == NULL) return NULL;
+
+  obj->key = strdup(key);
+  if (obj->key == NULL) {
+    free(obj);
+    return NULL;
+  }
+  obj->hash = hash_key(key);
+  obj->expires = expires;
+  obj->refcount = 1;
+  obj->spill_fd = -1;
+
+  size_t vary_len;
+  const char *vary = find_header(res, res_header_len, "Vary", &vary_len);
+  if (vary != NULL) {
+    obj->vary = build_vary(vary, vary_len, req, req_len);
+    if (obj->vary == NULL) {
+      cache_release(obj);
+      return NULL;
+    }
+  }
+  return obj;
+}
+
+static cache_block_t *alloc_block(size_t size) {
+  size_t chunk = slab_chunk_size(size + sizeof(cache_block_t));
+
+  while (used + chunk > budget) {
+    if (evict_one() < 0) return NULL;
+  }
+  cache_block_t *block = slab_alloc(chunk);
+  if (block == NULL) return NULL;
+
+  used += chunk;
+  block->next = NULL;
+  block->size = chunk - sizeof(cache_block_t);
+  block->used = 0;
+  return block;
+}
+
+// Move an object that outgrew the memory tier into a staging file; it goes
+// to the disk tier when committed.
+static int spill(cache_object_t *obj) {
+  struct iovec iov[64];
+  cache_cursor_t cursor = {obj->blocks, 0};
+  int n;
+
+  obj->spill_fd = disk_cache_staging_file();
+  if (obj->spill_fd == -1) {
+    return -1;
+  }
+  while ((n = cache_read_iov(&cursor, iov, 64)) > 0) {
+    ssize_t written = writev(obj->spill_fd, iov, n);
+    if (written <= 0) {
+      return -1;
+    }
+    cache_advance(&cursor, written);
+  }
+
+  pthread_mutex_lock(&lock);
+  cache_block_t *block = obj->blocks;
+  while (block != NULL) {
+    cache_block_t *next = block->next;
+    slab_free(block, block->size + sizeof(cache_block_t));
+    block = next;
+  }
+  used -= obj->charged;
+  pthread_mutex_unlock(&lock);
+  obj->charged = 0;
+  obj->blocks = obj->tail = NULL;
+  return 0;
+}
+
+static int append_spilled(cache_object_t *obj, const char *buf, size_t len) {
+  if (obj->size + len > disk_cache_max_object()) {
+    return -1;
+  }
+  while (len > 0) {
+    ssize_t written = write(obj->spill_fd, buf, len);
+    if (written <= 0) {
+      return -1;
+    }
+    obj->size += written;
+    buf += written;
+    len -= written;
+  }
+  return 0;
+}
+
+// Returns -1 when the object outgrows the cache; the caller aborts it.
+int cache_append(cache_object_t *obj, const char *buf, size_t len) {
+  if (obj->spill_fd < 0 &&
+      obj->size + len > budget / CACHE_MAX_OBJECT_DIVISOR) {
+    if (!disk_cache_enabled() || spill(obj) < 0) {
+      return -1;
+    }
+  }
+  if (obj->spill_fd >= 0) {
+    return append_spilled(obj, buf, len);
+  }
+
+  while (len > 0) {
+    cache_block_t *block = obj->tail;
+    if (block == NULL || block->used == block->size) {
+      pthread_mutex_lock(&lock);
+      block = alloc_block(SLAB_MAX_CHUNK - sizeof(cache_block_t));
+      pthread_mutex_unlock(&lock);
+      if (block == NULL) {
+        // no room in memory; the disk tier may still take it
+        if (!disk_cache_enabled() || spill(obj) < 0) {
+          return -1;
+        }
+        return append_spilled(obj, buf, len);
+      }
+      obj->charged += block->size + sizeof(cache_block_t);
+      if (obj->tail) {
+        obj->tail->next = block;
+      } else {
+        obj->blocks = block;
+      }
+      obj->tail = block;
+    }
+
+    size_t n = block->size - block->used;
+    if (n > len) n = len;
+    memcpy(block->data + block->used, buf, n);
+    block->used += n;
+    obj->size += n;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Move a partly used tail block into the smallest chunk that holds it.
+static void shrink_tail(cache_object_t *obj) {
+  cache_block_t *tail = obj->tail;
+  if (tail == NULL) return;
+
+  size_t chunk = slab_chunk_size(tail->used + sizeof(cache_block_t));
+  if (chunk >= tail->size + sizeof(cache_block_t)) return;
+
+  cache_block_t *block = slab_alloc(chunk);
+  if (block == NULL) return;
+  block->next = NULL;
+  block->size = chunk - sizeof(cache_block_t);
+  block->used = tail->used;
+  memcpy(block->data, tail->data, tail->used);
+
+  cache_block_t **link = &obj->blocks;
+  while (*link != tail) link = &(*link)->next;
+  *link = block;
+  obj->tail = block;
+
+  size_t freed = tail->size - block->size;
+  slab_free(tail, tail->size + sizeof(cache_block_t));
+  used -= freed;
+  obj->charged -= freed;
+}
+
+void cache_commit(cache_object_t *obj) {
+  if (obj->spill_fd >= 0) {
+    // the disk tier's writer moves it there and drops the reference
+    if (disk_cache_store(obj) < 0) {
+      cache_release(obj);
+    }
+    STAT_ADD(cache_stats.stored, 1);
+    return;
+  }
+
+  // the memory copy supersedes whatever the disk tier holds
+  disk_cache_remove(obj->key);
+
+  pthread_mutex_lock(&lock);
+  shrink_tail(obj);
+
+  // a newer response replaces the stored one
+  cache_object_t *old = buckets[obj->hash % CACHE_BUCKETS];
+  while (old != NULL &&
+         (old->hash != obj->hash || strcmp(old->key, obj->key) != 0)) {
+    old = old->hash_next;
+  }
+  if (old != NULL) {
+    unlink_object(old);
+  }
+
+  obj->hash_next = buckets[obj->hash % CACHE_BUCKETS];
+  buckets[obj->hash % CACHE_BUCKETS] = obj;
+  objects++;
+  lru_push(obj, SEGMENT_PROBATION);
+  STAT_ADD(cache_stats.stored, 1);
+  DEBUG_PRINT("cache store %s (%lu bytes)\n", obj->key, obj->size);
+  pthread_mutex_unlock(&lock);
+}
+
+void cache_abort(cache_object_t *obj) { cache_release(obj); }
+
+// Fill iov with the unread part of an object, starting at cursor.
+int cache_read_iov(cache_cursor_t *cursor, struct iovec *iov, int max) {
+  cache_block_t *block = cursor->block;
+  uint32_t offset = cursor->offset;
+  int n = 0;
+
+  while (block != NULL && n < max) {
+    if (offset < block->used) {
+      iov[n].iov_base = block->data + offset;
+      iov[n].iov_len = block->used - offset;
+      n++;
+    }
+    block = block->next;
+    offset = 0;
+  }
+  return n;
+}
+
+// Like cache_read_iov() from a byte offset, for readers of an object that
+// is still growing; they cannot keep a cursor since the tail block may be
+// replaced or the blocks spilled between two reads.
+int cache_read_iov_at(cache_object_t *obj, uint64_t offset, struct iovec *iov,
+                      int max) {
+  cache_block_t *block = obj->blocks;
+
+  while (block != NULL && offset >= block->used) {
+    offset -= block->used;
+    block = block->next;
+  }
+  if (block == NULL) {
+    return 0;
+  }
+  cache_cursor_t cursor = {block, offset};
+  return cache_read_iov(&cursor, iov, max);
+}
+
+void cache_advance(cache_cursor_t *cursor, size_t bytes) {
+  while (cursor->block != NULL && bytes > 0) {
+    size_t left = cursor->block->used - cursor->offset;
+    if (bytes < left) {
+      cursor->offset += bytes;
+      return;
+    }
+    bytes -= left;
+    cursor->block = cursor->block->next;
+    cursor->offset = 0;
+  }
+  while (cursor->block != NULL && cursor->offset == cursor->block->used) {
+    cursor->block = cursor->block->next;
+    cursor->offset = 0;
+  }
+}
+
+void cache_print_stats(FILE *out) {
+  double lookups = cache_stats.lookups ? cache_stats.lookups : 1;
+  double served = cache_stats.bytes_served ? cache_stats.bytes_served : 1;
+
+  pthread_mutex_lock(&lock);
+  fprintf(out,
+          "cache: %lu objects, %lu/%lu bytes (%lu protected, %lu slab pages)\n",
+          objects, used, budget, protected_bytes, slab_pages());
+  fprintf(out,
+          "cache: lookups %lu, hits %lu, misses %lu, bypasses %lu, hit ratio "
+          "%.3f, byte hit ratio %.3f\n",
+          cache_stats.lookups, cache_stats.hits, cache_stats.misses,
+          cache_stats.bypasses, cache_stats.hits / lookups,
+          cache_stats.bytes_hit / served);
+  fprintf(out,
+          "cache: stored %lu, uncacheable %lu, evictions %lu, collapsed %lu, "
+          "partial hits %lu\n",
+          cache_stats.stored, cache_stats.uncacheable, cache_stats.evictions,
+          cache_stats.collapsed, cache_stats.partial);
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "common.h"
+
+// In-memory HTTP object cache. Objects hold the raw origin response in a
+// chain of slab chunks and are kept in a segmented LRU: new objects enter
+// the probationary segment and move to the protected one on their second
+// hit, so a burst of one-off downloads cannot flush the popular set.
+
+#define CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+#define CACHE_BUCKETS 4096
+#define CACHE_PROTECTED_PERCENT 80
+#define CACHE_MAX_OBJECT_DIVISOR 8
+#define CACHE_HEURISTIC_PERCENT 10
+#define CACHE_HEURISTIC_MAX (24 * 60 * 60)
+
+// what a request allows the cache to do
+#define CACHE_LOOKUP 0x1
+#define CACHE_STORE 0x2
+
+typedef struct cache_block_t {
+  struct cache_block_t *next;
+  uint32_t size;
+  uint32_t used;
+  char data[];
+} cache_block_t;
+
+typedef enum {
+  SEGMENT_NONE = 0,
+  SEGMENT_PROBATION = 1,
+  SEGMENT_PROTECTED = 2,
+} segment_t;
+
+typedef struct cache_object_t {
+  char *key;
+  uint32_t hash;
+  char *vary;  // request header values the response varies on
+  time_t expires;
+  uint64_t size;
+  uint64_t charged;
+  cache_block_t *blocks;
+  cache_block_t *tail;
+  int spill_fd;  // staging file once the object outgrew the memory tier
+  int refcount;
+  int prefetched;  // stored by the prefetcher and not asked for since
+  segment_t segment;
+  struct cache_object_t *lru_prev;
+  struct cache_object_t *lru_next;
+  struct cache_object_t *hash_next;
+} cache_object_t;
+
+// position of a reader within an object
+typedef struct {
+  cache_block_t *block;
+  uint32_t offset;
+} cache_cursor_t;
+
+typedef struct {
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t bypasses;
+  uint64_t stored;
+  uint64_t uncacheable;
+  uint64_t evictions;
+  uint64_t collapsed;  // requests that joined another client's fetch
+  uint64_t partial;    // hits that sent some ranges of the object
+  uint64_t bytes_served;
+  uint64_t bytes_hit;
+  uint64_t prefetch_used;    // prefetches a client asked for afterwards
+  uint64_t prefetch_unused;  // prefetched objects dropped before that
+} cache_stats_t;
+
+extern cache_stats_t cache_stats;
+
+int cache_init(uint64_t budget);
+int cache_enabled();
+char *cache_make_key(const char *req, size_t len, const char *host, int port);
+int cache_request_policy(const char *req, size_t len);
+int cache_response_policy(const char *res, size_t header_len, time_t *expires);
+cache_object_t *cache_lookup(const char *key, const char *req, size_t len);
+int cache_contains(const char *key);
+int cache_vary_matches(const char *stored, const char *req, size_t req_len);
+void cache_retain(cache_object_t *obj);
+void cache_release(cache_object_t *obj);
+cache_object_t *cache_begin(const char *key, time_t expires, const char *req,
+                            size_t req_len, const char *res,
+                            size_t res_header_len);
+int cache_append(cache_object_t *obj, const char *buf, size_t len);
+void cache_commit(cache_object_t *obj);
+void cache_abort(cache_object_t *obj);
+int cache_read_iov(cache_cursor_t *cursor, struct iovec *iov, int max);
+int cache_read_iov_at(cache_object_t *obj, uint64_t offset, struct iovec *iov,
+                      int max);
+void cache_advance(cache_cursor_t *cursor, size_t bytes);
+void cache_print_stats(FILE *out);
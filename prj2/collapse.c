@@ -0,0 +1,60 @@
+#include "collapse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct entry_t {
+  const char *key;
+  uint32_t hash;
+  void *fetch;
+  struct entry_t *next;
+} entry_t;
+
+static __thread entry_t *buckets[COLLAPSE_BUCKETS];
+
+static uint32_t hash_key(const char *key) {
+  uint32_t h = 2166136261u;
+  for (; *key; key++) {
+    h = (h ^ (unsigned char)*key) * 16777619u;
+  }
+  return h;
+}
+
+int collapse_add(const char *key, void *fetch) {
+  entry_t *entry = malloc(sizeof(entry_t));
+  if (entry == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  entry->key = key;
+  entry->hash = hash_key(key);
+  entry->fetch = fetch;
+  entry->next = buckets[entry->hash % COLLAPSE_BUCKETS];
+  buckets[entry->hash % COLLAPSE_BUCKETS] = entry;
+  return 0;
+}
+
+void *collapse_find(const char *key) {
+  uint32_t hash = hash_key(key);
+  entry_t *entry = buckets[hash % COLLAPSE_BUCKETS];
+
+  while (entry != NULL &&
+         (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+    entry = entry->next;
+  }
+  return entry ? entry->fetch : NULL;
+}
+
+void collapse_remove(const char *key, void *fetch) {
+  entry_t **link = &buckets[hash_key(key) % COLLAPSE_BUCKETS];
+
+  while (*link != NULL && (*link)->fetch != fetch) {
+    link = &(*link)->next;
+  }
+  if (*link != NULL) {
+    entry_t *entry = *link;
+    *link = entry->next;
+    free(entry);
+  }
+}
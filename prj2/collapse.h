@@ -0,0 +1,16 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Upstream fetches of cacheable objects in progress on this worker, by
+// cache key. A request for a key that is already being fetched waits for
+// that fetch and is served from the object it stores instead of going to
+// the origin itself.
+
+#define COLLAPSE_BUCKETS 1024
+
+// key must stay valid until the fetch is removed
+int collapse_add(const char *key, void *fetch);
+void *collapse_find(const char *key);
+void collapse_remove(const char *key, void *fetch);
@@ -1,8 +1,20 @@
 #include <stdio.h>
 #include <unistd.h>
 
-#define DEBUG 1
-#define DEBUG_PRINT(fmt, ...)                     \
-  do {                                            \
-    if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); \
+// verbosity of what goes to stderr and to the access log; set with -v and
+// stepped through at runtime with SIGUSR2
+#define LEVEL_ERROR 0  // errors, and only failed transactions in the log
+#define LEVEL_INFO 1   // every transaction in the log
+#define LEVEL_DEBUG 2  // and a trace of each connection on stderr
+
+extern int log_level;
+
+#define LOG_LEVEL() __atomic_load_n(&log_level, __ATOMIC_RELAXED)
+#define DEBUG_PRINT(fmt, ...)                                          \
+  do {                                                                 \
+    if (LOG_LEVEL() >= LEVEL_DEBUG) fprintf(stderr, fmt, __VA_ARGS__); \
   } while (0)
+
+// statistics counters are bumped from every worker
+#define STAT_ADD(counter, n) \
+  __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
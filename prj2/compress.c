@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "utils.h"
+
+#define GZIP_WINDOW_BITS (15 + 16)  // a gzip wrapper around deflate
+#define GZIP_MEM_LEVEL 8
+
+compress_stats_t compress_stats;
+
+struct compressor_t {
+  z_stream stream;
+};
+
+static int level = 0;  // none until set with -z
+
+int compress_init(int compression_level) {
+  if (compression_level < 1 || compression_level > 9) {
+    return -1;
+  }
+  level = compression_level;
+  return 0;
+}
+
+int compress_enabled() { return level > 0; }
+
+// Whether the request's Accept-Encoding lists gzip with a quality above
+// zero.
+int compress_accepted(const char *req, size_t len) {
+  size_t value_len;
+  const char *value = find_header(req, len, "Accept-Encoding", &value_len);
+  if (value == NULL) {
+    return 0;
+  }
+  const char *end = value + value_len;
+  const char *p = value;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *item = p;
+    while (p < end && *p != ',' && *p != ';' && *p != ' ') p++;
+    int gzip = p - item == 4 && strncasecmp(item, "gzip", 4) == 0;
+    const char *params = p;
+    while (p < end && *p != ',') p++;
+    if (!gzip) {
+      continue;
+    }
+    // gzip;q=0 turns it down
+    const char *q = memmem(params, p - params, "q=", 2);
+    return q == NULL || strtod(q + 2, NULL) > 0;
+  }
+  return 0;
+}
+
+// Text, and the structured formats that are text underneath.
+int compress_type_ok(const char *type, size_t len) {
+  static const char *kinds[] = {"json", "javascript", "xml", "ecmascript"};
+  const char *semicolon = memchr(type, ';', len);
+  if (semicolon != NULL) {
+    len = semicolon - type;
+  }
+  if (len >= 5 && strncasecmp(type, "text/", 5) == 0) {
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    size_t kind_len = strlen(kinds[i]);
+    for (size_t j = 0; j + kind_len <= len; j++) {
+      if (strncasecmp(type + j, kinds[i], kind_len) == 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// The cache key of the compressed variant of the object stored under key;
+// NULL if out of memory. Only bodies that were compressed are kept under it.
+char *compress_key(const char *key) {
+  // no URL has a space in it, so the variant's key is no other URL's
+  size_t key_len = strlen(key);
+  char *variant = malloc(key_len + sizeof(" gzip"));
+  if (variant != NULL) {
+    memcpy(variant, key, key_len);
+    memcpy(variant + key_len, " gzip", sizeof(" gzip"));
+  }
+  return variant;
+}
+
+int compress_is_key(const char *key) {
+  size_t key_len = strlen(key);
+  return key_len > 5 && strcmp(key + key_len - 5, " gzip") == 0;
+}
+
+compressor_t *compressor_new() {
+  compressor_t *c = calloc(1, sizeof(compressor_t));
+  if (c == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  if (deflateInit2(&c->stream, level, Z_DEFLATED, GZIP_WINDOW_BITS,
+                   GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr, "deflateInit2 failed\n");
+    free(c);
+    return NULL;
+  }
+  STAT_ADD(compress_stats.responses, 1);
+  return c;
+}
+
+// Compress in_len bytes into out. Everything is flushed, so the client can
+// decode what it has so far; finish ends the stream. Returns the bytes of
+// output, or -1 if they did not fit.
+ssize_t compressor_run(compressor_t *c, const char *in, size_t in_len,
+                       char *out, size_t out_len, int finish) {
+  z_stream *stream = &c->stream;
+  stream->next_in = (Bytef *)in;
+  stream->avail_in = in_len;
+  stream->next_out = (Bytef *)out;
+  stream->avail_out = out_len;
+
+  // with no room left over the flush may not have been complete
+  int ret = deflate(stream, finish ? Z_FINISH : Z_SYNC_FLUSH);
+  int ok = finish ? ret == Z_STREAM_END : ret == Z_OK || ret == Z_BUF_ERROR;
+  if (!ok || stream->avail_in != 0 || stream->avail_out == 0) {
+    return -1;
+  }
+  size_t produced = out_len - stream->avail_out;
+  STAT_ADD(compress_stats.bytes_in, in_len);
+  STAT_ADD(compress_stats.bytes_out, produced);
+  return produced;
+}
+
+void compressor_free(compressor_t *c) {
+  if (c != NULL) {
+    deflateEnd(&c->stream);
+    free(c);
+  }
+}
+
+void compress_print_stats(FILE *out) {
+  double in = compress_stats.bytes_in ? compress_stats.bytes_in : 1;
+  fprintf(out,
+          "gzip: level %d, responses %lu, bytes in %lu, out %lu, ratio %.3f\n",
+          level, compress_stats.responses, compress_stats.bytes_in,
+          compress_stats.bytes_out, compress_stats.bytes_out / in);
+}
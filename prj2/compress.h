@@ -0,0 +1,38 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+// On-the-fly gzip encoding of textual response bodies for clients that
+// accept it. The compressed variant is cached under a key of its own, so it
+// is stored once it has been made and later requests for it are hits rather
+// than compressed again. Anything else keeps the plain key for all clients.
+
+#define COMPRESS_MIN_LENGTH 256  // smaller bodies are not worth it
+// room the relay buffer keeps free behind what it reads, for the added
+// headers and for compressed output that came out larger than its input
+#define COMPRESS_SLACK 512
+
+typedef struct compressor_t compressor_t;
+
+typedef struct {
+  uint64_t responses;  // compressed on the way
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+} compress_stats_t;
+
+extern compress_stats_t compress_stats;
+
+int compress_init(int level);
+int compress_enabled();
+int compress_accepted(const char *req, size_t len);
+int compress_type_ok(const char *type, size_t len);
+char *compress_key(const char *key);
+int compress_is_key(const char *key);
+compressor_t *compressor_new();
+ssize_t compressor_run(compressor_t *c, const char *in, size_t in_len,
+                       char *out, size_t out_len, int finish);
+void compressor_free(compressor_t *c);
+void compress_print_stats(FILE *out);
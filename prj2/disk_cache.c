@@ -0,0 +1,611 @@
+#define _GNU_SOURCE
+
+#include "disk_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t key_len;
+  uint32_t vary_len;
+  uint32_t reserved;
+  int64_t expires;
+  uint64_t size;
+} disk_record_t;
+
+struct disk_entry_t {
+  char *key;
+  uint32_t hash;
+  char *vary;
+  time_t expires;
+  disk_segment_t *segment;
+  off_t offset;
+  uint64_t size;
+  disk_entry_t *hash_next;
+  disk_entry_t *seg_next;
+};
+
+// files to unlink or close in the background
+typedef struct reclaim_job_t {
+  int fd;
+  char *path;
+  struct reclaim_job_t *next;
+} reclaim_job_t;
+
+// objects to write in the background, each holding a reference
+typedef struct store_job_t {
+  cache_object_t *obj;
+  uint64_t queued;  // of its memory-tier bytes
+  struct store_job_t *next;
+} store_job_t;
+
+disk_stats_t disk_stats;
+
+static char *cache_dir = NULL;
+static uint64_t budget = 0;
+static uint64_t total_size = 0;
+static uint64_t entry_count = 0;
+static disk_entry_t *buckets[DISK_BUCKETS];
+static disk_segment_t *oldest = NULL, *active = NULL;
+static uint32_t next_id = 0;
+
+// the index, the segment list and the end of the active segment; never
+// held while the memory tier's lock is taken
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_ready = PTHREAD_COND_INITIALIZER;
+static reclaim_job_t *reclaim_jobs = NULL;
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t store_ready = PTHREAD_COND_INITIALIZER;
+static store_job_t *store_head = NULL, **store_tail = &store_head;
+static uint64_t store_queued = 0;
+
+static void *store_main(void *unused);
+
+static uint32_t hash_key(const char *key) {
+  uint32_t h = 2166136261u;
+  for (; *key; key++) {
+    h = (h ^ (unsigned char)*key) * 16777619u;
+  }
+  return h;
+}
+
+static char *segment_path(uint32_t id) {
+  char *path = malloc(strlen(cache_dir) + 32);
+  if (path != NULL) sprintf(path, "%s/seg-%08u.log", cache_dir, id);
+  return path;
+}
+
+// Unlinking a large file can stall on block freeing, and so can closing
+// the last descriptor of an unlinked one; both happen on this thread.
+static void *reclaim_main(void *unused) {
+  while (1) {
+    pthread_mutex_lock(&reclaim_lock);
+    while (reclaim_jobs == NULL) {
+      pthread_cond_wait(&reclaim_ready, &reclaim_lock);
+    }
+    reclaim_job_t *job = reclaim_jobs;
+    reclaim_jobs = job->next;
+    pthread_mutex_unlock(&reclaim_lock);
+
+    if (job->path != NULL) {
+      if (unlink(job->path) == -1) perror("unlink segment");
+      free(job->path);
+    }
+    if (job->fd >= 0) close(job->fd);
+    free(job);
+  }
+  return NULL;
+}
+
+static void reclaim(int fd, char *path) {
+  reclaim_job_t *job = malloc(sizeof(reclaim_job_t));
+  if (job == NULL) {
+    if (path) unlink(path);
+    if (fd >= 0) close(fd);
+    free(path);
+    return;
+  }
+  job->fd = fd;
+  job->path = path;
+
+  pthread_mutex_lock(&reclaim_lock);
+  job->next = reclaim_jobs;
+  reclaim_jobs = job;
+  pthread_cond_signal(&reclaim_ready);
+  pthread_mutex_unlock(&reclaim_lock);
+}
+
+static void remove_from_bucket(disk_entry_t *entry) {
+  disk_entry_t **link = &buckets[entry->hash % DISK_BUCKETS];
+  while (*link != NULL && *link != entry) {
+    link = &(*link)->hash_next;
+  }
+  if (*link == entry) {
+    *link = entry->hash_next;
+    entry_count--;
+  }
+}
+
+static void remove_from_segment(disk_entry_t *entry) {
+  disk_entry_t **link = &entry->segment->entries;
+  while (*link != NULL && *link != entry) {
+    link = &(*link)->seg_next;
+  }
+  if (*link == entry) *link = entry->seg_next;
+}
+
+static void free_entry(disk_entry_t *entry) {
+  free(entry->key);
+  free(entry->vary);
+  free(entry);
+}
+
+static disk_entry_t *find_entry(const char *key, uint32_t hash) {
+  disk_entry_t *entry = buckets[hash % DISK_BUCKETS];
+  while (entry != NULL &&
+         (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+    entry = entry->hash_next;
+  }
+  return entry;
+}
+
+static void drop_entry(disk_entry_t *entry) {
+  remove_from_bucket(entry);
+  remove_from_segment(entry);
+  free_entry(entry);
+}
+
+static int add_entry(const char *key, const char *vary, time_t expires,
+                     disk_segment_t *segment, off_t offset, uint64_t size) {
+  disk_entry_t *entry = calloc(1, sizeof(disk_entry_t));
+  if (entry == NULL) return -1;
+
+  entry->key = strdup(key);
+  entry->vary = vary ? strdup(vary) : NULL;
+  if (entry->key == NULL || (vary && entry->vary == NULL)) {
+    free_entry(entry);
+    return -1;
+  }
+  entry->hash = hash_key(key);
+  entry->expires = expires;
+  entry->segment = segment;
+  entry->offset = offset;
+  entry->size = size;
+
+  // the newest copy of a key wins, older bytes become dead space
+  disk_entry_t *old = find_entry(key, entry->hash);
+  if (old != NULL) drop_entry(old);
+
+  entry->hash_next = buckets[entry->hash % DISK_BUCKETS];
+  buckets[entry->hash % DISK_BUCKETS] = entry;
+  entry->seg_next = segment->entries;
+  segment->entries = entry;
+  entry_count++;
+  return 0;
+}
+
+static disk_segment_t *open_segment(uint32_t id, int create) {
+  char *path = segment_path(id);
+  if (path == NULL) return NULL;
+
+  int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0),
+                0600);
+  free(path);
+  if (fd == -1) {
+    perror("open segment");
+    return NULL;
+  }
+
+  disk_segment_t *segment = calloc(1, sizeof(disk_segment_t));
+  if (segment == NULL) {
+    close(fd);
+    return NULL;
+  }
+  segment->id = id;
+  segment->fd = fd;
+  segment->refcount = 1;
+
+  if (oldest == NULL) {
+    oldest = segment;
+  } else {
+    disk_segment_t *last = oldest;
+    while (last->next) last = last->next;
+    last->next = segment;
+  }
+  return segment;
+}
+
+static void release_segment(disk_segment_t *segment) {
+  if (--segment->refcount == 0) {
+    reclaim(segment->fd, NULL);
+    free(segment);
+  }
+}
+
+// Retire the oldest segment: its entries leave the index and the file is
+// reclaimed once no client is still reading from it.
+static void retire_oldest() {
+  disk_segment_t *segment = oldest;
+  if (segment == NULL || segment == active) return;
+
+  oldest = segment->next;
+  while (segment->entries != NULL) {
+    disk_entry_t *entry = segment->entries;
+    segment->entries = entry->seg_next;
+    remove_from_bucket(entry);
+    free_entry(entry);
+  }
+  total_size -= segment->size;
+  segment->retired = 1;
+  disk_stats.segments_retired++;
+  DEBUG_PRINT("disk cache retiring segment %u\n", segment->id);
+
+  reclaim(-1, segment_path(segment->id));
+  release_segment(segment);
+}
+
+static void enforce_budget() {
+  while (total_size > budget && oldest != NULL && oldest != active) {
+    retire_oldest();
+  }
+}
+
+// Make sure the active segment can take a record of len bytes.
+static int reserve(uint64_t len) {
+  if (active == NULL ||
+      (active->size > 0 && active->size + len > DISK_SEGMENT_SIZE)) {
+    disk_segment_t *segment = open_segment(next_id, 1);
+    if (segment == NULL) return -1;
+    next_id++;
+    active = segment;
+    enforce_budget();
+  }
+  return 0;
+}
+
+static void scan_segment(disk_segment_t *segment) {
+  struct stat st;
+  off_t off = 0;
+  time_t now = time(NULL);
+
+  if (fstat(segment->fd, &st) == -1) return;
+  while (off + (off_t)sizeof(disk_record_t) <= st.st_size) {
+    disk_record_t rec;
+    if (pread(segment->fd, &rec, sizeof(rec), off) != sizeof(rec) ||
+        rec.magic != DISK_RECORD_MAGIC || rec.key_len == 0 ||
+        rec.key_len > DISK_MAX_KEY || rec.vary_len > DISK_MAX_KEY) {
+      break;
+    }
+    off_t body = off + sizeof(rec) + rec.key_len + rec.vary_len;
+    if (body + (off_t)rec.size > st.st_size) break;
+
+    char *key = malloc(rec.key_len + rec.vary_len + 2);
+    if (key == NULL) break;
+    char *vary = key + rec.key_len + 1;
+    if (pread(segment->fd, key, rec.key_len + rec.vary_len,
+              off + sizeof(rec)) != rec.key_len + rec.vary_len) {
+      free(key);
+      break;
+    }
+    memmove(vary, key + rec.key_len, rec.vary_len);
+    key[rec.key_len] = '\0';
+    vary[rec.vary_len] = '\0';
+
+    if (rec.expires > now) {
+      add_entry(key, rec.vary_len ? vary : NULL, rec.expires, segment, body,
+                rec.size);
+    }
+    free(key);
+    off = body + rec.size;
+  }
+  // anything after the last whole record was cut short by a crash
+  segment->size = off;
+  total_size += off;
+}
+
+static int compare_ids(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Rebuild the index from the segments left by a previous run.
+static void recover() {
+  DIR *dir = opendir(cache_dir);
+  uint32_t *ids = NULL;
+  size_t count = 0, cap = 0;
+  struct dirent *de;
+
+  if (dir == NULL) return;
+  while ((de = readdir(dir)) != NULL) {
+    uint32_t id;
+    char tail;
+    if (sscanf(de->d_name, "seg-%8u.lo%c", &id, &tail) != 2 || tail != 'g') {
+      continue;
+    }
+    if (count == cap) {
+      cap = cap ? cap * 2 : 16;
+      uint32_t *tmp = realloc(ids, cap * sizeof(uint32_t));
+      if (tmp == NULL) break;
+      ids = tmp;
+    }
+    ids[count++] = id;
+  }
+  closedir(dir);
+
+  qsort(ids, count, sizeof(uint32_t), compare_ids);
+  for (size_t i = 0; i < count; i++) {
+    disk_segment_t *segment = open_segment(ids[i], 0);
+    if (segment == NULL) continue;
+    scan_segment(segment);
+    next_id = ids[i] + 1;
+  }
+  free(ids);
+  DEBUG_PRINT("disk cache recovered %lu objects, %lu bytes\n", entry_count,
+              total_size);
+}
+
+int disk_cache_init(const char *dir, uint64_t bytes) {
+  cache_dir = strdup(dir);
+  if (cache_dir == NULL) return -1;
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+    perror("mkdir");
+    return -1;
+  }
+  budget = bytes;
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, reclaim_main, NULL) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  pthread_detach(tid);
+  if (pthread_create(&tid, NULL, store_main, NULL) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  pthread_detach(tid);
+
+  recover();
+  enforce_budget();
+  return reserve(0);
+}
+
+int disk_cache_enabled() { return budget > 0; }
+
+// a single object may take up to a quarter of the tier
+uint64_t disk_cache_max_object() { return budget / DISK_MAX_OBJECT_DIVISOR; }
+
+int disk_cache_lookup(const char *key, const char *req, size_t len,
+                      disk_hit_t *hit) {
+  uint32_t hash = hash_key(key);
+
+  pthread_mutex_lock(&lock);
+  disk_entry_t *entry = find_entry(key, hash);
+  disk_stats.lookups++;
+  if (entry != NULL && entry->expires <= time(NULL)) {
+    drop_entry(entry);
+    entry = NULL;
+  }
+  if (entry == NULL ||
+      (entry->vary && !cache_vary_matches(entry->vary, req, len))) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+
+  disk_stats.hits++;
+  entry->segment->refcount++;
+  hit->segment = entry->segment;
+  hit->offset = entry->offset;
+  hit->size = entry->size;
+  pthread_mutex_unlock(&lock);
+  return 1;
+}
+
+// Whether a fresh object is stored for key, without it counting as a use.
+int disk_cache_contains(const char *key) {
+  if (!disk_cache_enabled()) return 0;
+  pthread_mutex_lock(&lock);
+  disk_entry_t *entry = find_entry(key, hash_key(key));
+  int found = entry != NULL && entry->expires > time(NULL);
+  pthread_mutex_unlock(&lock);
+  return found;
+}
+
+void disk_cache_release(disk_segment_t *segment) {
+  pthread_mutex_lock(&lock);
+  release_segment(segment);
+  pthread_mutex_unlock(&lock);
+}
+
+static int append_record(const char *key, const char *vary, time_t expires,
+                         uint64_t size, off_t *body) {
+  disk_record_t rec;
+  struct iovec iov[3];
+  size_t key_len = strlen(key), vary_len = vary ? strlen(vary) : 0;
+
+  if (key_len > DISK_MAX_KEY || vary_len > DISK_MAX_KEY) return -1;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = DISK_RECORD_MAGIC;
+  rec.key_len = key_len;
+  rec.vary_len = vary_len;
+  rec.expires = expires;
+  rec.size = size;
+
+  uint64_t len = sizeof(rec) + key_len + vary_len;
+  if (reserve(len + size) < 0) return -1;
+
+  iov[0].iov_base = &rec;
+  iov[0].iov_len = sizeof(rec);
+  iov[1].iov_base = (void *)key;
+  iov[1].iov_len = key_len;
+  iov[2].iov_base = (void *)(vary ? vary : "");
+  iov[2].iov_len = vary_len;
+  if (pwritev(active->fd, iov, 3, active->size) != (ssize_t)len) {
+    return -1;
+  }
+  *body = active->size + len;
+  return 0;
+}
+
+static void finish_record(const char *key, const char *vary, time_t expires,
+                          off_t body, uint64_t size) {
+  uint64_t len = body + size - active->size;
+
+  active->size += len;
+  total_size += len;
+  disk_stats.bytes_written += len;
+  disk_stats.stored++;
+  add_entry(key, vary, expires, active, body, size);
+  enforce_budget();
+}
+
+static int write_blocks(cache_object_t *obj, off_t off) {
+  struct iovec iov[64];
+  cache_cursor_t cursor = {obj->blocks, 0};
+  int n;
+
+  while ((n = cache_read_iov(&cursor, iov, 64)) > 0) {
+    ssize_t written = pwritev(active->fd, iov, n, off);
+    if (written <= 0) return -1;
+    cache_advance(&cursor, written);
+    off += written;
+  }
+  return 0;
+}
+
+// The copy from a staging file stays in the kernel.
+static int write_spilled(cache_object_t *obj, off_t out) {
+  off_t in = 0;
+
+  while ((uint64_t)in < obj->size) {
+    ssize_t n = copy_file_range(obj->spill_fd, &in, active->fd, &out,
+                                obj->size - in, 0);
+    if (n <= 0) return -1;
+  }
+  return 0;
+}
+
+// Append an object to the active segment. Only this thread appends, so the
+// body is written without the lock; the entry goes into the index after.
+static void write_object(cache_object_t *obj) {
+  off_t body;
+
+  pthread_mutex_lock(&lock);
+  if (append_record(obj->key, obj->vary, obj->expires, obj->size, &body) < 0) {
+    disk_stats.write_errors++;
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  pthread_mutex_unlock(&lock);
+
+  int ret = obj->spill_fd >= 0 ? write_spilled(obj, body)
+                               : write_blocks(obj, body);
+
+  pthread_mutex_lock(&lock);
+  if (ret < 0) {
+    // the next record goes over what was written of this one
+    disk_stats.write_errors++;
+  } else {
+    finish_record(obj->key, obj->vary, obj->expires, body, obj->size);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void *store_main(void *unused) {
+  while (1) {
+    pthread_mutex_lock(&store_lock);
+    while (store_head == NULL) {
+      pthread_cond_wait(&store_ready, &store_lock);
+    }
+    store_job_t *job = store_head;
+    store_head = job->next;
+    if (store_head == NULL) store_tail = &store_head;
+    pthread_mutex_unlock(&store_lock);
+
+    write_object(job->obj);
+    cache_release(job->obj);
+
+    pthread_mutex_lock(&store_lock);
+    store_queued -= job->queued;
+    pthread_mutex_unlock(&store_lock);
+    free(job);
+  }
+  return NULL;
+}
+
+// Queue a committed object, either one leaving the memory tier or one
+// spooled to a staging file, for the writer. It takes over the caller's
+// reference unless this fails.
+int disk_cache_store(cache_object_t *obj) {
+  uint64_t queued = obj->spill_fd >= 0 ? 0 : obj->charged;
+  store_job_t *job = malloc(sizeof(store_job_t));
+  if (job == NULL) return -1;
+  job->obj = obj;
+  job->queued = queued;
+  job->next = NULL;
+
+  pthread_mutex_lock(&store_lock);
+  if (queued > 0 && store_queued + queued > DISK_MAX_QUEUED) {
+    pthread_mutex_unlock(&store_lock);
+    free(job);
+    return -1;
+  }
+  store_queued += queued;
+  *store_tail = job;
+  store_tail = &job->next;
+  pthread_cond_signal(&store_ready);
+  pthread_mutex_unlock(&store_lock);
+  return 0;
+}
+
+// An anonymous file in the cache directory for objects too large for the
+// memory tier; it disappears when closed.
+int disk_cache_staging_file() {
+  int fd = open(cache_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    char *path = malloc(strlen(cache_dir) + 16);
+    if (path == NULL) return -1;
+    sprintf(path, "%s/tmp-XXXXXX", cache_dir);
+    fd = mkstemp(path);
+    if (fd != -1) unlink(path);
+    free(path);
+  }
+  return fd;
+}
+
+void disk_cache_remove(const char *key) {
+  disk_entry_t *entry;
+
+  if (!disk_cache_enabled()) return;
+  pthread_mutex_lock(&lock);
+  entry = find_entry(key, hash_key(key));
+  if (entry != NULL) drop_entry(entry);
+  pthread_mutex_unlock(&lock);
+}
+
+void disk_cache_print_stats(FILE *out) {
+  if (!disk_cache_enabled()) return;
+  pthread_mutex_lock(&lock);
+  fprintf(out,
+          "disk cache: %lu objects, %lu/%lu bytes, lookups %lu, hits %lu, "
+          "stored %lu (%lu bytes), segments retired %lu, write errors %lu\n",
+          entry_count, total_size, budget, disk_stats.lookups, disk_stats.hits,
+          disk_stats.stored, disk_stats.bytes_written,
+          disk_stats.segments_retired, disk_stats.write_errors);
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "common.h"
+
+// Second cache tier on local disk. Objects are appended to segment files
+// and found through an in-memory index; hits are sent with sendfile() so the
+// body only ever lives in the page cache. Objects are written by a thread of
+// the tier's own, so neither the event loops nor the memory tier's lock wait
+// on the disk. Space is reclaimed a whole segment at a time, oldest first,
+// with the unlink done off the event loop too.
+
+#define DISK_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DISK_DEFAULT_BUDGET (1024LL * 1024 * 1024)
+#define DISK_BUCKETS 16384
+#define DISK_RECORD_MAGIC 0x50585943
+#define DISK_MAX_KEY 8192
+#define DISK_MAX_OBJECT_DIVISOR 4
+// memory-tier bytes waiting for the writer; objects beyond it are dropped
+#define DISK_MAX_QUEUED (32 * 1024 * 1024)
+
+struct cache_object_t;
+
+typedef struct disk_entry_t disk_entry_t;
+
+typedef struct disk_segment_t {
+  uint32_t id;
+  int fd;
+  uint64_t size;
+  int refcount;
+  int retired;
+  disk_entry_t *entries;
+  struct disk_segment_t *next;
+} disk_segment_t;
+
+// where a hit's bytes are; the caller holds a segment reference
+typedef struct {
+  disk_segment_t *segment;
+  off_t offset;
+  uint64_t size;
+} disk_hit_t;
+
+typedef struct {
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t stored;
+  uint64_t bytes_written;
+  uint64_t segments_retired;
+  uint64_t write_errors;
+} disk_stats_t;
+
+extern disk_stats_t disk_stats;
+
+int disk_cache_init(const char *dir, uint64_t budget);
+int disk_cache_enabled();
+uint64_t disk_cache_max_object();
+int disk_cache_lookup(const char *key, const char *req, size_t len,
+                      disk_hit_t *hit);
+void disk_cache_release(disk_segment_t *segment);
+int disk_cache_contains(const char *key);
+int disk_cache_store(struct cache_object_t *obj);
+int disk_cache_staging_file();
+void disk_cache_remove(const char *key);
+void disk_cache_print_stats(FILE *out);
@@ -0,0 +1,99 @@
+#include "fair.h"
+
+#include <pthread.h>
+
+#include "timer.h"
+
+// The buckets are refilled lazily from the time of their last use, in
+// whole milliseconds of the workers' loop clocks.
+
+typedef struct {
+  uint64_t tokens;
+  uint64_t last;  // refilled up to here
+} fair_bucket_t;
+
+fair_stats_t fair_stats;
+
+static uint64_t quantum = FAIR_DEFAULT_QUANTUM;
+static uint64_t rate = 0;  // bytes a second per address, none until set
+static uint64_t burst;
+static fair_bucket_t buckets[FAIR_BUCKETS];
+static pthread_mutex_t locks[FAIR_LOCKS];
+
+int fair_init(long long send_quantum, long long address_rate,
+              long long address_burst) {
+  if (send_quantum < 0 || address_rate < 0 || address_burst < 0) {
+    return -1;
+  }
+  quantum = send_quantum;
+  rate = address_rate;
+  // a second's worth unless told otherwise, and never less than a send
+  burst = address_burst ? address_burst : rate;
+  if (burst < FAIR_MIN_SEND) {
+    burst = FAIR_MIN_SEND;
+  }
+  for (int i = 0; i < FAIR_BUCKETS; i++) {
+    buckets[i].tokens = burst;
+  }
+  for (int i = 0; i < FAIR_LOCKS; i++) {
+    pthread_mutex_init(&locks[i], NULL);
+  }
+  return 0;
+}
+
+// 0 when connections take no turns.
+uint64_t fair_quantum() { return quantum; }
+
+int fair_throttling() { return rate > 0; }
+
+static uint32_t bucket_of(uint32_t addr) {
+  return (addr * 2654435761u) % FAIR_BUCKETS;
+}
+
+static void refill(fair_bucket_t *bucket) {
+  uint64_t now = timer_now();
+  // another worker's clock may be a little behind
+  if (now > bucket->last) {
+    bucket->tokens += (now - bucket->last) * rate / 1000;
+    if (bucket->tokens > burst) {
+      bucket->tokens = burst;
+    }
+    bucket->last = now;
+  }
+}
+
+// Bytes the address may send now.
+uint64_t fair_tokens(uint32_t addr) {
+  uint32_t i = bucket_of(addr);
+  pthread_mutex_lock(&locks[i % FAIR_LOCKS]);
+  refill(&buckets[i]);
+  uint64_t tokens = buckets[i].tokens;
+  pthread_mutex_unlock(&locks[i % FAIR_LOCKS]);
+  return tokens;
+}
+
+void fair_take(uint32_t addr, uint64_t bytes) {
+  uint32_t i = bucket_of(addr);
+  pthread_mutex_lock(&locks[i % FAIR_LOCKS]);
+  buckets[i].tokens = buckets[i].tokens > bytes ? buckets[i].tokens - bytes
+                                                : 0;
+  pthread_mutex_unlock(&locks[i % FAIR_LOCKS]);
+}
+
+// Milliseconds until the address has FAIR_MIN_SEND bytes to send again.
+uint64_t fair_delay(uint32_t addr) {
+  uint64_t tokens = fair_tokens(addr);
+  STAT_ADD(fair_stats.throttled, 1);
+  if (tokens >= FAIR_MIN_SEND) {
+    return 0;
+  }
+  return (FAIR_MIN_SEND - tokens) * 1000 / rate + 1;
+}
+
+void fair_print_stats(FILE *out) {
+  fprintf(out,
+          "fair: quantum %lu, rate %lu, burst %lu, rounds %lu, deferred %lu, "
+          "throttled %lu\n",
+          quantum, rate, rate ? burst : 0, fair_stats.rounds,
+          fair_stats.deferred, fair_stats.throttled);
+}
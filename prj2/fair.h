@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+
+// Fair sharing of what the proxy sends to its clients. Each worker serves
+// the connections that have bytes for their clients in deficit round robin:
+// a connection sends at most a quantum per turn, and one that used its turn
+// up waits behind the others for the next round, so a bulk download takes
+// its share of the event loop and no more. Optionally each client address
+// also has a token bucket shared by all workers, which caps the rate of
+// all its connections together.
+
+#define FAIR_DEFAULT_QUANTUM (64 * 1024)
+#define FAIR_BUCKETS 4096  // addresses that collide share a bucket
+#define FAIR_LOCKS 64
+#define FAIR_MIN_SEND 4096  // a throttled connection waits for this much
+
+typedef struct {
+  uint64_t rounds;     // with connections waiting for their turn
+  uint64_t deferred;   // turns used up with more to send
+  uint64_t throttled;  // waits for an address's tokens
+} fair_stats_t;
+
+extern fair_stats_t fair_stats;
+
+int fair_init(long long quantum, long long rate, long long burst);
+uint64_t fair_quantum();
+int fair_throttling();
+uint64_t fair_tokens(uint32_t addr);
+void fair_take(uint32_t addr, uint64_t bytes);
+uint64_t fair_delay(uint32_t addr);
+void fair_print_stats(FILE *out);
@@ -1,362 +1,2679 @@
+#define _GNU_SOURCE
+
 #include "handler.h"
 
-void reset_proxy_data(proxy_data_t *data) {
-  free(data->req_buf);
-  free(data->res_buf);
-  free(data->client_fd_data);
-  free(data->server_fd_data);
-  free(data);
+#include <stdarg.h>
+#include <sys/sendfile.h>
+
+#include "compress.h"
+#include "fair.h"
+#include "prefetch.h"
+
+// connections this worker closed while handling the current batch of events;
+// freed once the batch is done so later events in it never see a dangling
+// pointer
+static __thread proxy_data_t *closed_list = NULL;
+
+// connections that used up their turn at sending with more to send, in the
+// order they did; each round gives the ones queued before it another turn
+static __thread proxy_data_t *send_queue = NULL;
+static __thread proxy_data_t **send_queue_tail = NULL;
+static __thread uint64_t send_round = 0;
+
+static void unfollow(proxy_data_t *data);
+static void unqueue_sends(proxy_data_t *data);
+static void release_followers(proxy_data_t *data, int complete);
+static void on_timeout(wheel_timer_t *timer);
+static int relay_tunnel(proxy_data_t *data, int epoll_fd);
+static void cancel_attempts(proxy_data_t *data);
+static int start_attempt(proxy_data_t *data);
+
+// A connection's control block and both of its fd_data_t are carved in one
+// piece from pages of CONN_BLOCKS_PER_PAGE, and go back on this worker's
+// free list when the connection is done. The relay buffer stays with the
+// block, so a new connection usually costs no allocation at all.
+typedef struct conn_block_t {
+  proxy_data_t data;
+  fd_data_t client;
+  fd_data_t server;
+  struct conn_block_t *next_free;
+} conn_block_t;
+
+static __thread conn_block_t *free_blocks = NULL;
+
+static int grow_blocks() {
+  conn_block_t *page = malloc(CONN_BLOCKS_PER_PAGE * sizeof(conn_block_t));
+  if (page == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  for (int i = 0; i < CONN_BLOCKS_PER_PAGE; i++) {
+    page[i].data.res_buf = NULL;
+    page[i].next_free = free_blocks;
+    free_blocks = &page[i];
+  }
+  return 0;
+}
+
+// A zeroed connection whose fd_data_t point back at it, or NULL.
+proxy_data_t *alloc_proxy_data() {
+  if (free_blocks == NULL && grow_blocks() < 0) {
+    return NULL;
+  }
+  conn_block_t *block = free_blocks;
+  free_blocks = block->next_free;
+
+  char *res_buf = block->data.res_buf;
+  memset(block, 0, sizeof(conn_block_t));
+  proxy_data_t *data = &block->data;
+  if (res_buf != NULL) {
+    data->res_buf = res_buf;
+    data->res_buf_capacity = RELAY_BUF_SIZE;
+  }
+  data->client_fd_data = &block->client;
+  data->server_fd_data = &block->server;
+  block->client.data = data;
+  block->server.data = data;
+  data->client_fd = -1;
+  data->server_fd = -1;
+  // the real deadline is worked out when the timer fires
+  data->timer.fire = on_timeout;
+  data->active = timer_now();
+  timer_set(&data->timer, data->active + IDLE_TIMEOUT);
+  stats_mark(data->marks, MARK_ACCEPT);
+  STAT_ADD(proxy_stats.connections, 1);
+  STAT_ADD(proxy_stats.active, 1);
+  return data;
+}
+
+// Take on a client connection; fd is nonblocking. Returns NULL, with fd
+// closed, if that failed.
+proxy_data_t *open_client(int fd, const struct sockaddr_in *addr,
+                          int epoll_fd) {
+  proxy_data_t *data = alloc_proxy_data();
+  if (data == NULL) {
+    close(fd);
+    return NULL;
+  }
+  data->client_fd_data->fd = fd;
+  data->client_fd = fd;
+  data->client_addr = *addr;
+  data->epoll_fd = epoll_fd;
+  data->state |= CLIENT_OPEN;
+  data->state |= REQUEST_NOT_RECEIVED;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = data->client_fd_data;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    perror("epoll_ctl add client");
+    close(fd);
+    reset_proxy_data(data);
+    return NULL;
+  }
+  DEBUG_PRINT("client connected: %d\n", fd);
+  return data;
+}
+
+void reset_proxy_data(proxy_data_t *data) {
+  conn_block_t *block = (conn_block_t *)data;
+
+  timer_cancel(&data->timer);
+  STAT_ADD(proxy_stats.active, -1);
+  free(data->cache_key);
+  free(data->req_buf);
+  free(data->pipelined);
+  block->next_free = free_blocks;
+  free_blocks = block;
+}
+
+static void release_hit(proxy_data_t *data) {
+  if (data->hit != NULL) {
+    cache_release(data->hit);
+    data->hit = NULL;
+  }
+  if (data->disk_hit.segment != NULL) {
+    disk_cache_release(data->disk_hit.segment);
+    data->disk_hit.segment = NULL;
+  }
+  free(data->parts);
+  data->parts = NULL;
+}
+
+static void release_pipe(proxy_data_t *data) {
+  if (data->pipe != NULL) {
+    pipe_pool_put(data->pipe, data->piped);
+    data->pipe = NULL;
+    data->piped = 0;
+  }
+  if (data->up_pipe != NULL) {
+    pipe_pool_put(data->up_pipe, data->up_piped);
+    data->up_pipe = NULL;
+    data->up_piped = 0;
+  }
+}
+
+// Queue an access log record for the transaction that just ended.
+static void log_transaction(proxy_data_t *data, int complete) {
+  if (!access_log_wants(!complete || data->status >= 500)) {
+    return;
+  }
+  access_record_t record;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  stats_mark(data->marks, MARK_DONE);
+
+  record.time_ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+  record.bytes = data->served;
+  record.duration_us = data->marks[MARK_DONE] - data->marks[MARK_PARSED];
+  record.client_addr = data->client_addr.sin_addr.s_addr;
+  record.client_port = data->client_addr.sin_port;
+  record.status = data->status;
+  record.complete = complete;
+  record.result = data->result;
+  record.url_len = data->target_len < ACCESS_LOG_URL_MAX
+                       ? data->target_len
+                       : ACCESS_LOG_URL_MAX;
+  int tunnel = strncmp(data->req_buf, "CONNECT ", 8) == 0;
+  memcpy(record.url, data->req_buf + (tunnel ? 8 : 4), record.url_len);
+  access_log_append(&record);
+}
+
+void cleanup_and_close(proxy_data_t *data, int epoll_fd) {
+  timer_cancel(&data->timer);
+  if (data->marks[MARK_PARSED] != 0) {
+    log_transaction(data, 0);
+  }
+  unfollow(data);
+  // close file descriptors as needed
+  if (data->state & CLIENT_OPEN) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->client_fd, NULL);
+    close(data->client_fd);
+    DEBUG_PRINT("client disconnected: %d\n", data->client_fd);
+  }
+  if (data->state & SERVER_OPEN) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->server_fd, NULL);
+    close(data->server_fd);
+    DEBUG_PRINT("server disconnected: %d\n", data->server_fd);
+  }
+  if (data->state & RESOLVING) {
+    resolver_cancel(data->host, data);
+  }
+  cancel_attempts(data);
+  release_hit(data);
+  release_pipe(data);
+  prefetch_page_end(data->page);
+  data->page = NULL;
+  compressor_free(data->gzip);
+  data->gzip = NULL;
+  if (data->store != NULL) {
+    cache_abort(data->store);
+    data->store = NULL;
+  }
+  release_followers(data, 0);
+  unqueue_sends(data);
+  data->state = CLOSED;
+  data->next_closed = closed_list;
+  closed_list = data;
+}
+
+void release_closed() {
+  while (closed_list != NULL) {
+    proxy_data_t *data = closed_list;
+    closed_list = data->next_closed;
+    reset_proxy_data(data);
+  }
+}
+
+static int alloc_relay_buf(proxy_data_t *data) {
+  if (data->res_buf == NULL) {
+    data->res_buf = malloc(RELAY_BUF_SIZE + 1);
+    if (data->res_buf == NULL) {
+      perror("malloc");
+      cleanup_and_close(data, data->epoll_fd);
+      return -1;
+    }
+    data->res_buf_capacity = RELAY_BUF_SIZE;
+  }
+  return 0;
+}
+
+// The deadline for what the connection is waiting on now.
+static uint64_t deadline(proxy_data_t *data) {
+  state_t state = data->state;
+  uint64_t idle = data->active + IDLE_TIMEOUT;
+  uint64_t due;
+
+  if (state & REQUEST_NOT_RECEIVED) {
+    return idle;
+  }
+  if (state & (RESOLVING | CONNECTING)) {
+    due = data->phase_start + CONNECT_TIMEOUT;
+    if ((state & CONNECTING) &&
+        data->next_addr < data->origin_addrs.count &&
+        data->attempt_start + CONNECT_ATTEMPT_DELAY < due) {
+      return data->attempt_start + CONNECT_ATTEMPT_DELAY;  // the next one
+    }
+  } else if (state & TUNNEL) {
+    due = data->active + TUNNEL_IDLE_TIMEOUT;  // however long it lives
+  } else if (!(state & (RESPONSE_HEADER_RECEIVED | RESPONSE_RECEIVED |
+                        CACHE_HIT))) {
+    due = data->phase_start + HEADER_TIMEOUT;
+  } else {
+    due = idle;
+  }
+  if (!(state & TUNNEL) && due > data->started + TRANSFER_TIMEOUT) {
+    due = data->started + TRANSFER_TIMEOUT;
+  }
+  if (data->throttled_until != 0 && data->throttled_until < due) {
+    due = data->throttled_until;  // the address has tokens again
+  }
+  return due;
+}
+
+// Only needed when the deadline may have moved closer; a timer that fires
+// early is set again for the real one.
+static void arm_timer(proxy_data_t *data) {
+  if (!(data->state & CLOSED)) {
+    timer_set(&data->timer, deadline(data));
+  }
+}
+
+static void queue_sends(proxy_data_t *data) {
+  if (data->send_pprev != NULL) {
+    return;
+  }
+  if (send_queue_tail == NULL) {
+    send_queue_tail = &send_queue;
+  }
+  data->send_round = send_round;
+  data->send_next = NULL;
+  data->send_pprev = send_queue_tail;
+  *send_queue_tail = data;
+  send_queue_tail = &data->send_next;
+}
+
+static void unqueue_sends(proxy_data_t *data) {
+  if (data->send_pprev == NULL) {
+    return;
+  }
+  *data->send_pprev = data->send_next;
+  if (data->send_next != NULL) {
+    data->send_next->send_pprev = data->send_pprev;
+  } else {
+    send_queue_tail = data->send_pprev;
+  }
+  data->send_pprev = NULL;
+}
+
+// A connection that is not waiting in the queue starts a turn whenever an
+// event finds it: it had nothing left to send, or its client was not
+// taking any more.
+static void begin_turn(proxy_data_t *data) {
+  if (data->send_pprev == NULL) {
+    data->deficit = fair_quantum();
+  }
+}
+
+// Bytes the connection may send its client now. With none, it waits in the
+// queue for its next turn, or on its timer for its address's tokens.
+static uint64_t send_allowance(proxy_data_t *data) {
+  uint64_t allowance = fair_quantum() > 0 ? data->deficit : UINT64_MAX;
+
+  if (allowance == 0) {
+    if (data->send_pprev == NULL) {
+      STAT_ADD(fair_stats.deferred, 1);
+      queue_sends(data);
+    }
+    return 0;
+  }
+  // the prefetcher is the proxy's own client
+  if (fair_throttling() && !data->prefetch) {
+    uint32_t addr = data->client_addr.sin_addr.s_addr;
+    uint64_t tokens = fair_tokens(addr);
+    if (tokens == 0) {
+      data->throttled_until = timer_now() + fair_delay(addr);
+      arm_timer(data);
+      return 0;
+    }
+    if (tokens < allowance) {
+      allowance = tokens;
+    }
+  }
+  return allowance;
+}
+
+static void charge_send(proxy_data_t *data, uint64_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+  data->deficit = data->deficit > bytes ? data->deficit - bytes : 0;
+  if (fair_throttling() && !data->prefetch) {
+    fair_take(data->client_addr.sin_addr.s_addr, bytes);
+  }
+}
+
+// Cut iov[0, n) down to max bytes. Returns how many entries are left.
+static int trim_iov(struct iovec *iov, int n, uint64_t max) {
+  for (int i = 0; i < n; i++) {
+    if (iov[i].iov_len >= max) {
+      iov[i].iov_len = max;
+      return i + 1;
+    }
+    max -= iov[i].iov_len;
+  }
+  return n;
+}
+
+// Give the connections queued before this round their next turn; those that
+// use it up again wait for the round after.
+void run_send_round() {
+  if (send_queue == NULL) {
+    return;
+  }
+  STAT_ADD(fair_stats.rounds, 1);
+  uint64_t round = send_round++;
+  while (send_queue != NULL && send_queue->send_round == round) {
+    proxy_data_t *data = send_queue;
+    unqueue_sends(data);
+    begin_turn(data);
+    if (data->state & TUNNEL) {
+      relay_tunnel(data, data->epoll_fd);
+    } else {
+      handle_client(data, NULL, data->epoll_fd);
+    }
+  }
+}
+
+int send_round_pending() { return send_queue != NULL; }
+
+// Answer from the proxy itself. Without a body the reply is the status line
+// alone, and the connection ends with it.
+static int respond_status(proxy_data_t *data, const char *status,
+                          const char *body, size_t len) {
+  if (alloc_relay_buf(data) < 0) {
+    return -1;
+  }
+  if (body == NULL) {
+    data->client_keepalive = 0;
+    data->res_buf_used = snprintf(data->res_buf, data->res_buf_capacity,
+                                  "HTTP/1.0 %s\r\n\r\n", status);
+  } else {
+    // the header takes far less than the room left for it
+    if (len > data->res_buf_capacity - 256) {
+      len = data->res_buf_capacity - 256;
+    }
+    data->res_buf_used = snprintf(
+        data->res_buf, data->res_buf_capacity,
+        "HTTP/1.%d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu"
+        "\r\nCache-Control: no-store\r\n%s\r\n",
+        data->client_http11, status, len,
+        data->client_keepalive ? "" : "Connection: close\r\n");
+    memcpy(data->res_buf + data->res_buf_used, body, len);
+    data->res_buf_used += len;
+  }
+  data->res_buf_start = 0;
+  data->status = atoi(status);
+  data->response_complete = 1;
+  data->state &= ~REQUEST_RECEIVED;
+  data->state |= RESPONSE_RECEIVED;
+  data->active = timer_now();
+  arm_timer(data);
+
+  // Modify the event to monitor for output readiness
+  struct epoll_event client_event;
+  client_event.events = EPOLLOUT | EPOLLET;
+  client_event.data.ptr = data->client_fd_data;
+  if (epoll_ctl(data->epoll_fd, EPOLL_CTL_MOD, data->client_fd,
+                &client_event) == -1) {
+    perror("epoll_ctl change mode to out");
+    cleanup_and_close(data, data->epoll_fd);
+    return -1;
+  }
+  return 0;
+}
+
+static int respond_bad_request(proxy_data_t *data) {
+  data->result = RESULT_LOCAL;
+  if (respond_status(data, "400 Bad Request", NULL, 0) < 0) {
+    return -1;
+  }
+  // the 400 has always been the bare status line, and clients of this proxy
+  // compare it as such
+  data->res_buf_used -= 2;
+  return 0;
+}
+
+// A request for STATS_PATH made to the proxy itself rather than through it.
+static int is_stats_request(proxy_data_t *data) {
+  size_t len = strlen(STATS_PATH);
+  const char *target = data->req_buf + 4;
+  return strncmp(target, STATS_PATH, len) == 0 &&
+         (target[len] == ' ' || target[len] == '?');
+}
+
+static int serve_stats(proxy_data_t *data) {
+  char *body = NULL;
+  size_t len = 0;
+
+  data->result = RESULT_LOCAL;
+  FILE *out = open_memstream(&body, &len);
+  if (out == NULL) {
+    perror("open_memstream");
+    return respond_status(data, "500 Internal Server Error", NULL, 0);
+  }
+  stats_print(out);
+  cache_print_stats(out);
+  disk_cache_print_stats(out);
+  pool_print_stats(out);
+  prefetch_print_stats(out);
+  compress_print_stats(out);
+  fair_print_stats(out);
+  fclose(out);
+  int ret = respond_status(data, "200 OK", body, len);
+  free(body);
+  return ret;
+}
+
+// The origin could not be reached, or did not answer in time. Nothing has
+// gone to the client yet, so it is told so right away. Returns -1 if the
+// connection had to be closed.
+static int fail_upstream(proxy_data_t *data, const char *status) {
+  DEBUG_PRINT("%s for %s:%d\n", status, data->host, data->port);
+  STAT_ADD(proxy_stats.upstream_failures, 1);
+  unfollow(data);
+  if (data->state & SERVER_OPEN) {
+    epoll_ctl(data->epoll_fd, EPOLL_CTL_DEL, data->server_fd, NULL);
+    close(data->server_fd);
+    data->server_fd = -1;
+  }
+  if (data->state & RESOLVING) {
+    resolver_cancel(data->host, data);
+  }
+  cancel_attempts(data);
+  data->state &= ~(SERVER_OPEN | CONNECTING | RESOLVING | REQUEST_SENT |
+                   UPSTREAM_PAUSED | UPSTREAM_BLOCKED);
+  release_followers(data, 0);
+  return respond_status(data, status, NULL, 0);
+}
+
+static void on_timeout(wheel_timer_t *timer) {
+  proxy_data_t *data =
+      (proxy_data_t *)((char *)timer - offsetof(proxy_data_t, timer));
+  uint64_t due = deadline(data);
+
+  if (due > timer_now()) {
+    timer_set(timer, due);
+    return;
+  }
+  if (data->throttled_until != 0 && data->throttled_until <= timer_now()) {
+    // it sends again in the next round
+    data->throttled_until = 0;
+    queue_sends(data);
+    arm_timer(data);
+    return;
+  }
+  if ((data->state & CONNECTING) &&
+      data->next_addr < data->origin_addrs.count &&
+      data->phase_start + CONNECT_TIMEOUT > due) {
+    // the attempts out are slow: the next address joins the race
+    start_attempt(data);
+    return;
+  }
+  STAT_ADD(proxy_stats.timeouts, 1);
+  if (!(data->state & (REQUEST_NOT_RECEIVED | RESPONSE_HEADER_RECEIVED |
+                              RESPONSE_RECEIVED | CACHE_HIT))) {
+    fail_upstream(data, "504 Gateway Timeout");
+  } else {
+    DEBUG_PRINT("client %d timed out\n", data->client_fd);
+    cleanup_and_close(data, data->epoll_fd);
+  }
+}
+
+// Whether the object just found is stored with chunked framing, judged
+// from the start of its header.
+static int hit_is_chunked(proxy_data_t *data) {
+  char head[4096];
+  const char *buf = head;
+  ssize_t len;
+
+  if (data->hit != NULL) {
+    buf = data->hit->blocks->data;
+    len = data->hit->blocks->used;
+  } else {
+    len = pread(data->disk_hit.segment->fd, head, sizeof(head),
+                data->disk_hit.offset);
+    if (len > (ssize_t)data->disk_hit.size) len = data->disk_hit.size;
+  }
+
+  http_parser_t parser;
+  size_t value_len;
+  http_parser_init(&parser);
+  if (len <= 0 || http_parse(&parser, buf, len) != 1) {
+    return 0;
+  }
+  const char *value =
+      http_header(&parser, buf, "Transfer-Encoding", &value_len);
+  return value != NULL && has_token(value, value_len, "chunked");
+}
+
+// The status of the object just found, for the access log.
+static int stored_status(proxy_data_t *data) {
+  char line[13] = "";
+
+  if (data->hit != NULL) {
+    cache_block_t *block = data->hit->blocks;
+    memcpy(line, block->data, block->used < 12 ? block->used : 12);
+  } else if (pread(data->disk_hit.segment->fd, line, 12,
+                   data->disk_hit.offset) != 12) {
+    return 0;
+  }
+  return atoi(line + 9);
+}
+
+// Copy up to len bytes from the start of the object just found.
+static ssize_t read_stored(proxy_data_t *data, char *buf, size_t len) {
+  if (data->hit != NULL) {
+    struct iovec iov[16];
+    int n = cache_read_iov_at(data->hit, 0, iov, 16);
+    size_t copied = 0;
+    for (int i = 0; i < n && copied < len; i++) {
+      size_t take = iov[i].iov_len < len - copied ? iov[i].iov_len
+                                                  : len - copied;
+      memcpy(buf + copied, iov[i].iov_base, take);
+      copied += take;
+    }
+    return copied;
+  }
+  if (len > data->disk_hit.size) len = data->disk_hit.size;
+  return pread(data->disk_hit.segment->fd, buf, len, data->disk_hit.offset);
+}
+
+// Whether the object just found is one that a client taking gzip gets
+// compressed, and so has to come from the compressed variant instead.
+static int hit_is_compressible(proxy_data_t *data) {
+  char head[4096];
+  http_parser_t parser;
+  size_t len;
+
+  ssize_t head_len = read_stored(data, head, sizeof(head));
+  http_parser_init(&parser);
+  if (head_len < 12 || http_parse(&parser, head, head_len) != 1 ||
+      atoi(head + 9) != 200) {
+    return 0;
+  }
+  uint64_t size = data->hit != NULL ? data->hit->size : data->disk_hit.size;
+  const char *type = http_header(&parser, head, "Content-Type", &len);
+  return size - parser.length >= COMPRESS_MIN_LENGTH && type != NULL &&
+         compress_type_ok(type, len) &&
+         http_header(&parser, head, "Content-Encoding", &len) == NULL;
+}
+
+// The key a request is looked up and collapsed under: that of the
+// compressed variant when there is one for a client that takes it, the
+// plain one otherwise. key is consumed; NULL if out of memory.
+static char *lookup_key(proxy_data_t *data, char *key) {
+  if (key == NULL || !data->accepts_gzip) {
+    return key;
+  }
+  char *variant = compress_key(key);
+  if (variant != NULL &&
+      (cache_contains(variant) || disk_cache_contains(variant))) {
+    free(key);
+    return variant;
+  }
+  free(variant);
+  return key;
+}
+
+// printf onto the text built at *p, short of end. Returns -1 if it does not
+// fit.
+static int put_text(char **p, const char *end, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(*p, end - *p, fmt, ap);
+  va_end(ap);
+  if (n < 0 || n >= end - *p) {
+    return -1;
+  }
+  *p += n;
+  return 0;
+}
+
+// A multipart boundary that no other response of this run shares: the
+// clock and the client's address, mixed, then a count of this worker's.
+static void make_boundary(proxy_data_t *data, char *buf, size_t size) {
+  static __thread uint64_t made = 0;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t seed = now.tv_sec * 1000000000ull + now.tv_nsec;
+  seed ^= (uint64_t)data->client_addr.sin_addr.s_addr << 16 |
+          data->client_addr.sin_port;
+  snprintf(buf, size, "%016lx%06lx", seed * 0x9e3779b97f4a7c15u,
+           made++ & 0xffffff);
+}
+
+#define PART_HEADER \
+  "\r\n--%s\r\nContent-Type: %.*s\r\nContent-Range: bytes %lu-%lu/%lu\r\n\r\n"
+
+// Answer a Range request from the object just found: 206 with the ranges
+// it names, as a multipart body if there are several, or 416 if none of
+// them is in the object. Returns 0 when the whole object is to be sent
+// instead, -1 once the connection has been closed.
+static int begin_range(proxy_data_t *data, const char *range,
+                       size_t range_len) {
+  http_parser_t parser;
+  http_range_t ranges[HTTP_MAX_RANGES];
+  size_t len;
+
+  if (alloc_relay_buf(data) < 0) {
+    return -1;
+  }
+  // the stored header is parsed at the front of the relay buffer, and the
+  // new one built behind it
+  char *buf = data->res_buf;
+  ssize_t head = read_stored(data, buf, data->res_buf_capacity / 2);
+  http_parser_init(&parser);
+  if (head < 12 || http_parse(&parser, buf, head) != 1 ||
+      atoi(buf + 9) != 200 ||
+      http_header(&parser, buf, "Transfer-Encoding", &len) != NULL) {
+    return 0;
+  }
+  uint64_t size = data->hit != NULL ? data->hit->size : data->disk_hit.size;
+  size -= parser.length;
+  int n = http_parse_range(range, range_len, size, ranges, HTTP_MAX_RANGES);
+  if (n == 0) {
+    return 0;
+  }
+  // a multipart body ends with a part of text alone
+  int count = n > 1 ? n + 1 : 1;
+  range_part_t *parts = calloc(count, sizeof(range_part_t));
+  if (parts == NULL) {
+    perror("calloc");
+    return 0;
+  }
+
+  char *out = buf + parser.length;
+  char *p = out;
+  const char *end = buf + data->res_buf_capacity;
+  int fits = 1;
+  if (n < 0) {
+    fits = put_text(&p, end,
+                    "HTTP/1.%d 416 Range Not Satisfiable\r\nContent-Range: "
+                    "bytes */%lu\r\nContent-Length: 0\r\n\r\n",
+                    data->client_http11, size) == 0;
+    data->status = 416;
+  } else {
+    const char *type = http_header(&parser, buf, "Content-Type", &len);
+    if (type == NULL) {
+      type = "application/octet-stream";
+      len = strlen(type);
+    }
+    fits = put_text(&p, end, "HTTP/1.%d 206 Partial Content\r\n",
+                    data->client_http11) == 0;
+    for (int i = 0; i < parser.count && fits; i++) {
+      const http_header_t *h = &parser.headers[i];
+      const char *name = buf + h->name;
+      if ((h->name_len == 14 && !strncasecmp(name, "Content-Length", 14)) ||
+          (h->name_len == 13 && !strncasecmp(name, "Content-Range", 13)) ||
+          (n > 1 && h->name_len == 12 &&
+           !strncasecmp(name, "Content-Type", 12))) {
+        continue;
+      }
+      fits = put_text(&p, end, "%.*s: %.*s\r\n", (int)h->name_len, name,
+                      (int)h->value_len, buf + h->value) == 0;
+    }
+    if (n == 1) {
+      fits = fits &&
+             put_text(&p, end,
+                      "Content-Range: bytes %lu-%lu/%lu\r\n"
+                      "Content-Length: %lu\r\n\r\n",
+                      ranges[0].first, ranges[0].last, size,
+                      ranges[0].last - ranges[0].first + 1) == 0;
+    } else {
+      char boundary[24];
+      make_boundary(data, boundary, sizeof(boundary));
+      // the closing delimiter, less the CRLF before the first one, which
+      // ends the header
+      uint64_t total = strlen(boundary) + 8 - 2;
+      for (int i = 0; i < n; i++) {
+        total += snprintf(NULL, 0, PART_HEADER, boundary, (int)len, type,
+                          ranges[i].first, ranges[i].last, size);
+        total += ranges[i].last - ranges[i].first + 1;
+      }
+      fits = fits &&
+             put_text(&p, end,
+                      "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                      "Content-Length: %lu\r\n",
+                      boundary, total) == 0;
+      for (int i = 0; i < n && fits; i++) {
+        fits = put_text(&p, end, PART_HEADER, boundary, (int)len, type,
+                        ranges[i].first, ranges[i].last, size) == 0;
+        parts[i].text_end = p - out;
+      }
+      fits = fits && put_text(&p, end, "\r\n--%s--\r\n", boundary) == 0;
+    }
+    for (int i = 0; i < n; i++) {
+      parts[i].start = parser.length + ranges[i].first;
+      parts[i].end = parser.length + ranges[i].last + 1;
+    }
+    data->status = 206;
+  }
+  if (!fits) {
+    free(parts);
+    return 0;
+  }
+  parts[count - 1].text_end = p - out;
+  memmove(buf, out, p - out);
+  data->res_buf_start = 0;
+  data->res_buf_used = p - out;
+  data->parts = parts;
+  data->part_count = count;
+  data->part_next = 0;
+  STAT_ADD(cache_stats.partial, 1);
+  return 1;
+}
+
+// Answer the request from the cache when a fresh object is stored for it.
+// Returns 1 on a hit, 0 when the request has to go to the origin.
+static int serve_from_cache(proxy_data_t *data) {
+  data->accepts_gzip = compress_enabled() &&
+                       compress_accepted(data->req_buf, data->req_buf_used);
+  data->cache_policy = cache_request_policy(data->req_buf, data->req_buf_used);
+  if (!data->cache_policy) {
+    if (cache_enabled()) {
+      STAT_ADD(cache_stats.bypasses, 1);
+    }
+    return 0;
+  }
+
+  size_t range_len;
+  const char *range =
+      find_header(data->req_buf, data->req_buf_used, "Range", &range_len);
+  char *key = cache_make_key(data->req_buf, data->req_buf_used, data->host,
+                             data->port);
+  // ranges are cut from the plain object
+  data->cache_key = range == NULL ? lookup_key(data, key) : key;
+  if (data->cache_key == NULL) {
+    data->cache_policy = 0;
+    return 0;
+  }
+  // a prefetch checked the cache before it was made, and must not count as
+  // a use of what it finds there
+  if (!(data->cache_policy & CACHE_LOOKUP) || data->prefetch) {
+    return 0;
+  }
+
+  cache_object_t *obj =
+      cache_lookup(data->cache_key, data->req_buf, data->req_buf_used);
+  if (obj != NULL) {
+    DEBUG_PRINT("cache hit %s\n", data->cache_key);
+    data->hit = obj;
+    data->hit_cursor.block = obj->blocks;
+    data->hit_cursor.offset = 0;
+  } else if (disk_cache_enabled() &&
+             disk_cache_lookup(data->cache_key, data->req_buf,
+                               data->req_buf_used, &data->disk_hit)) {
+    DEBUG_PRINT("disk cache hit %s\n", data->cache_key);
+  } else {
+    if (range != NULL) {
+      // the origin sends just the range, and nobody may wait on a fetch
+      // that stores nothing
+      data->cache_policy = 0;
+    }
+    return 0;
+  }
+  if (!data->client_http11 && hit_is_chunked(data)) {
+    // fetched again so the body can be decoded on the way
+    release_hit(data);
+    data->cache_policy = 0;
+    return 0;
+  }
+  if (data->accepts_gzip && range == NULL &&
+      !compress_is_key(data->cache_key) && hit_is_compressible(data)) {
+    // stored as is for a client that does not take gzip; fetched again to
+    // make the compressed variant
+    release_hit(data);
+    return 0;
+  }
+  int ranged = range != NULL ? begin_range(data, range, range_len) : 0;
+  if (ranged < 0) {
+    return 1;
+  }
+  data->response_complete = 1;
+  data->state &= ~REQUEST_RECEIVED;
+  data->state |= RESPONSE_RECEIVED | CACHE_HIT;
+  data->result = RESULT_HIT;
+  if (!ranged && access_log_wants(1)) {
+    data->status = stored_status(data);
+  }
+
+  // the object goes out through the usual client output path
+  struct epoll_event client_event;
+  client_event.events = EPOLLOUT | EPOLLET;
+  client_event.data.ptr = data->client_fd_data;
+  if (epoll_ctl(data->epoll_fd, EPOLL_CTL_MOD, data->client_fd,
+                &client_event) == -1) {
+    perror("epoll_ctl change mode to out");
+    cleanup_and_close(data, data->epoll_fd);
+  }
+  return 1;
+}
+
+static socklen_t addr_len(const resolve_addr_t *addr) {
+  return addr->sa.sa_family == AF_INET6 ? sizeof(addr->in6)
+                                        : sizeof(addr->in);
+}
+
+static void close_attempt(proxy_data_t *data, fd_data_t *attempt) {
+  epoll_ctl(data->epoll_fd, EPOLL_CTL_DEL, attempt->fd, NULL);
+  close(attempt->fd);
+  attempt->fd = -1;  // its events still pending in this batch are ignored
+  data->attempts_open--;
+}
+
+// Close the connects still racing, once one has won or the request is over.
+static void cancel_attempts(proxy_data_t *data) {
+  for (int i = 0; i < data->next_addr && data->attempts_open > 0; i++) {
+    if (data->attempts[i].fd != -1) {
+      close_attempt(data, &data->attempts[i]);
+    }
+  }
+  data->state &= ~CONNECTING;
+}
+
+// fd is connected to data->server_addr and becomes the transaction's
+// server side. op is EPOLL_CTL_MOD for a socket epoll already watches as a
+// connect attempt.
+static int use_server(proxy_data_t *data, int fd, int reused, int op) {
+  data->server_fd = fd;
+  data->server_reused = reused;
+  data->state |= SERVER_OPEN;
+  stats_mark(data->marks, MARK_CONNECTED);
+
+  // register to epoll; a retry keeps the fd_data of the first connection
+  // since events for the old socket may still be pending in this batch
+  fd_data_t *server_fd_data = data->server_fd_data;
+  server_fd_data->fd = fd;
+
+  struct epoll_event server_event;
+  server_event.events = EPOLLOUT | EPOLLET;
+  server_event.data.ptr = server_fd_data;
+
+  if (epoll_ctl(data->epoll_fd, op, fd, &server_event) == -1) {
+    perror("epoll_ctl");
+    cleanup_and_close(data, data->epoll_fd);
+    return -1;
+  }
+
+  DEBUG_PRINT("Connected to server of fd %d with host %s:%d%s\n", fd,
+              data->host, data->port, reused ? " (reused)" : "");
+  return 0;
+}
+
+// Start a connect to the next origin address, going on at once past those
+// that fail right away. The attempt races the ones already out; when none is
+// left to start and none is out, the origin is unreachable. Returns -1 if
+// the connection had to be closed.
+static int start_attempt(proxy_data_t *data) {
+  while (data->next_addr < data->origin_addrs.count) {
+    int i = data->next_addr++;
+    const resolve_addr_t *addr = &data->origin_addrs.addrs[i];
+    int fd = socket(addr->sa.sa_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+      perror("socket");
+      cleanup_and_close(data, data->epoll_fd);
+      return -1;
+    }
+    setnonblocking(fd);
+    STAT_ADD(proxy_stats.connect_attempts, 1);
+
+    if (connect(fd, &addr->sa, addr_len(addr)) == 0) {
+      data->server_addr = *addr;
+      cancel_attempts(data);
+      return use_server(data, fd, 0, EPOLL_CTL_ADD);
+    }
+    if (errno != EINPROGRESS) {
+      fprintf(stderr, "connect to %s:%d: %s\n", data->host, data->port,
+              strerror(errno));
+      close(fd);
+      continue;
+    }
+
+    fd_data_t *attempt = &data->attempts[i];
+    attempt->fd = fd;
+    attempt->data = data;
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLET;
+    event.data.ptr = attempt;
+    if (epoll_ctl(data->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      perror("epoll_ctl");
+      close(fd);
+      attempt->fd = -1;
+      cleanup_and_close(data, data->epoll_fd);
+      return -1;
+    }
+    data->attempts_open++;
+    data->attempt_start = timer_now();
+    data->state |= CONNECTING;
+    arm_timer(data);
+    return 0;
+  }
+  if (data->attempts_open == 0) {
+    return fail_upstream(data, "502 Bad Gateway");
+  }
+  arm_timer(data);
+  return 0;
+}
+
+// Connect to the origin, taking an idle connection to any of its addresses
+// from the pool when use_pool is set and one is parked there.
+static int connect_server(proxy_data_t *data, int use_pool) {
+  for (int i = 0; use_pool && i < data->origin_addrs.count; i++) {
+    int fd = pool_get(&data->origin_addrs.addrs[i].sa);
+    if (fd != -1) {
+      data->server_addr = data->origin_addrs.addrs[i];
+      return use_server(data, fd, 1, EPOLL_CTL_ADD);
+    }
+  }
+  for (int i = 0; i < data->origin_addrs.count; i++) {
+    data->attempts[i].fd = -1;
+  }
+  data->next_addr = 0;
+  return start_attempt(data);
+}
+
+// A nonblocking connect is over once the socket turns writable, but only
+// SO_ERROR tells whether it succeeded. The first attempt to succeed wins and
+// the others are closed; one that fails makes way for the next address right
+// away. Returns -1 if the connection had to be closed.
+static int finish_connect(proxy_data_t *data, fd_data_t *attempt) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+    err = errno;
+  }
+  if (err != 0) {
+    fprintf(stderr, "connect to %s:%d: %s\n", data->host, data->port,
+            strerror(err));
+    close_attempt(data, attempt);
+    return start_attempt(data);
+  }
+  int fd = attempt->fd;
+  attempt->fd = -1;
+  data->attempts_open--;
+  data->server_addr = data->origin_addrs.addrs[attempt - data->attempts];
+  cancel_attempts(data);
+  data->phase_start = timer_now();
+  return use_server(data, fd, 0, EPOLL_CTL_MOD);
+}
+
+// A parked connection may be closed by the origin just as it is reused.
+// Nothing has reached the client yet, so the request goes out again on a
+// fresh connection.
+static int retry_server(proxy_data_t *data) {
+  DEBUG_PRINT("reused connection to %s:%d failed, reconnecting\n",
+              data->host, data->port);
+  epoll_ctl(data->epoll_fd, EPOLL_CTL_DEL, data->server_fd, NULL);
+  close(data->server_fd);
+  data->server_fd = -1;
+  data->state &= ~(SERVER_OPEN | REQUEST_SENT | UPSTREAM_BLOCKED);
+  data->state |= REQUEST_RECEIVED;
+  data->bytes_sent = 0;
+  data->phase_start = timer_now();
+  arm_timer(data);
+  return connect_server(data, 0);
+}
+
+// Hand the upstream connection back to the pool once its response has been
+// relayed in full, instead of closing it.
+static void release_server(proxy_data_t *data) {
+  if (!(data->state & SERVER_OPEN) || !data->upstream_keepalive) {
+    return;
+  }
+  epoll_ctl(data->epoll_fd, EPOLL_CTL_DEL, data->server_fd, NULL);
+  pool_put(&data->server_addr.sa, data->server_fd);
+  DEBUG_PRINT("server parked: %d\n", data->server_fd);
+  data->state &= ~SERVER_OPEN;
+  data->server_fd = -1;
+}
+
+// With framing set the body's own framing headers go too, for a body that
+// is decoded on its way to the client.
+static int is_hop_by_hop(const char *line, int framing) {
+  static const char *names[] = {"Connection:", "Proxy-Connection:",
+                                "Keep-Alive:", "Transfer-Encoding:",
+                                "Content-Length:"};
+
+  for (int i = 0; i < (framing ? 5 : 3); i++) {
+    if (strncasecmp(line, names[i], strlen(names[i])) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Remove connection-level headers from the header block that starts at
+// buf and ends the buffered data at end. Returns the number of bytes
+// removed; everything behind the header block moves down with it.
+static uint32_t strip_hop_by_hop(char *buf, char *end, int framing) {
+  char *line = strstr(buf, "\r\n") + 2;
+  uint32_t removed = 0;
+
+  while (line < end && *line != '\r') {
+    char *next = strstr(line, "\r\n") + 2;
+    if (is_hop_by_hop(line, framing)) {
+      memmove(line, next, end - next + 1);
+      end -= next - line;
+      removed += next - line;
+    } else {
+      line = next;
+    }
+  }
+  return removed;
+}
+
+// Origins are spoken to in HTTP/1.1 so that their connections can be
+// reused; the client's own connection headers do not apply upstream.
+static void rewrite_request(proxy_data_t *data) {
+  char *line = strstr(data->req_buf, "\r\n");
+
+  if (line - data->req_buf >= 8 && memcmp(line - 8, "HTTP/1.0", 8) == 0) {
+    line[-1] = '1';
+  }
+  data->req_buf_used -=
+      strip_hop_by_hop(data->req_buf, data->req_buf + data->req_buf_used, 0);
+}
+
+// Set aside whatever the client sent behind the request that ends at end,
+// so it is not mistaken for part of this one.
+static int hold_pipelined(proxy_data_t *data, char *end) {
+  uint32_t extra = data->req_buf + data->req_buf_used - end;
+
+  if (extra == 0) {
+    return 0;
+  }
+  data->pipelined = malloc(extra);
+  if (data->pipelined == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  memcpy(data->pipelined, end, extra);
+  data->pipelined_used = extra;
+  data->req_buf_used -= extra;
+  data->req_buf[data->req_buf_used] = '\0';
+  return 0;
+}
+
+// Get the connection ready for the client's next request once a response
+// has gone out in full. Returns -1 if the connection had to be closed.
+int next_transaction(proxy_data_t *data) {
+  int epoll_fd = data->epoll_fd;
+
+  if (data->state & SERVER_OPEN) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->server_fd, NULL);
+    close(data->server_fd);
+    DEBUG_PRINT("server disconnected: %d\n", data->server_fd);
+    data->server_fd = -1;
+  }
+  release_hit(data);
+  release_followers(data, 0);
+  free(data->cache_key);
+  data->cache_key = NULL;
+  data->cache_policy = 0;
+  data->following = 0;
+  data->hit_offset = 0;
+  data->target_len = 0;
+  data->status = 0;
+  data->served = 0;
+  data->response_complete = 0;
+  data->result = RESULT_MISS;
+
+  data->state = CLIENT_OPEN | REQUEST_NOT_RECEIVED;
+  data->content_type = NONE;
+  data->bytes_sent = 0;
+  data->header_length = 0;
+  data->content_length = 0;
+  data->body_received = 0;
+  data->dechunk = 0;
+  data->accepts_gzip = 0;
+  data->res_buf_used = 0;
+  data->res_buf_start = 0;
+  data->server_reused = 0;
+  data->upstream_keepalive = 0;
+  http_parser_init(&data->req_parser);
+  http_parser_init(&data->res_parser);
+
+  data->req_buf_used = 0;
+  if (data->pipelined != NULL) {
+    if (data->req_buf_capacity < data->pipelined_used) {
+      char *buf = realloc(data->req_buf, data->pipelined_used + 1);
+      if (buf == NULL) {
+        perror("realloc");
+        cleanup_and_close(data, epoll_fd);
+        return -1;
+      }
+      data->req_buf = buf;
+      data->req_buf_capacity = data->pipelined_used;
+    }
+    memcpy(data->req_buf, data->pipelined, data->pipelined_used);
+    data->req_buf_used = data->pipelined_used;
+    free(data->pipelined);
+    data->pipelined = NULL;
+    data->pipelined_used = 0;
+  }
+  if (data->req_buf != NULL) {
+    data->req_buf[data->req_buf_used] = '\0';
+  }
+
+  struct epoll_event client_event;
+  client_event.events = EPOLLIN | EPOLLET;
+  client_event.data.ptr = data->client_fd_data;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->client_fd, &client_event) ==
+      -1) {
+    perror("epoll_ctl change mode to in");
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  }
+  DEBUG_PRINT("client %d ready for the next request\n", data->client_fd);
+  return 0;
+}
+
+static void on_resolved(void *arg, const resolve_result_t *result) {
+  proxy_data_t *data = (proxy_data_t *)arg;
+
+  data->state &= ~RESOLVING;
+  if (result == NULL) {
+    DEBUG_PRINT("could not resolve %s\n", data->host);
+    fail_upstream(data, "502 Bad Gateway");
+    return;
+  }
+  stats_mark(data->marks, MARK_RESOLVED);
+  data->origin_addrs = *result;
+  for (int i = 0; i < result->count; i++) {
+    resolve_addr_t *addr = &data->origin_addrs.addrs[i];
+    if (addr->sa.sa_family == AF_INET6) {
+      addr->in6.sin6_port = htons(data->port);
+    } else {
+      addr->in.sin_port = htons(data->port);
+    }
+  }
+  // a tunnel's connection is its own, never one kept for requests
+  connect_server(data, !(data->state & TUNNEL));
+}
+
+// Send the request to the origin; the connect happens once the name is
+// resolved, which may be right away when it is cached.
+static int forward_request(proxy_data_t *data) {
+  rewrite_request(data);
+  data->result = data->cache_policy ? RESULT_MISS : RESULT_BYPASS;
+  data->state |= RESOLVING;
+  data->phase_start = timer_now();
+  arm_timer(data);
+  resolver_lookup(data->host, on_resolved, data);
+  return (data->state & CLOSED) ? -1 : 0;
+}
+
+// Register a cacheable request as the fetch for its object, so that
+// requests for the same object arriving meanwhile can wait on it.
+static void lead_fetch(proxy_data_t *data) {
+  if ((data->cache_policy & CACHE_STORE) && data->cache_key != NULL &&
+      collapse_add(data->cache_key, data) == 0) {
+    data->leading = 1;
+  }
+}
+
+static void unfollow(proxy_data_t *data) {
+  if (data->leader == NULL) {
+    return;
+  }
+  proxy_data_t **link = &data->leader->followers;
+  while (*link != NULL && *link != data) {
+    link = &(*link)->next_follower;
+  }
+  if (*link == data) {
+    *link = data->next_follower;
+  }
+  data->leader = NULL;
+  data->next_follower = NULL;
+}
+
+// A follower whose leader's object cannot serve it goes to the origin.
+static void fetch_alone(proxy_data_t *data) {
+  unfollow(data);
+  if (data->following) {
+    release_hit(data);
+    data->following = 0;
+    data->hit_offset = 0;
+    data->state &= ~(RESPONSE_RECEIVED | CACHE_HIT);
+    data->state |= REQUEST_RECEIVED;
+  }
+  DEBUG_PRINT("client %d fetching %s on its own\n", data->client_fd,
+              data->cache_key);
+  forward_request(data);
+}
+
+// Run a follower's output side, and its next request if that completed it.
+static void resume_follower(proxy_data_t *data) {
+  if (data->state & CLIENT_BLOCKED) {
+    return;
+  }
+  if (relay_response(data, data->epoll_fd) == 0 &&
+      (data->state & REQUEST_NOT_RECEIVED)) {
+    handle_client(data, NULL, data->epoll_fd);
+  }
+}
+
+// Start streaming the leader's object, which has just begun, to a follower
+// that waits on it.
+static void follow_store(proxy_data_t *data) {
+  proxy_data_t *leader = data->leader;
+  cache_object_t *obj = leader->store;
+
+  // a leader and its followers share a key whether or not they take gzip
+  if ((obj->vary != NULL &&
+       !cache_vary_matches(obj->vary, data->req_buf, data->req_buf_used)) ||
+      (leader->gzip != NULL && !data->accepts_gzip) ||
+      (!data->client_http11 &&
+       (leader->content_type == CHUNKED || leader->gzip != NULL))) {
+    fetch_alone(data);
+    return;
+  }
+  cache_retain(obj);
+  data->hit = obj;
+  data->status = leader->status;
+  data->following = 1;
+  data->hit_offset = 0;
+  // a leader that stops short closes its followers instead
+  data->response_complete = 1;
+  data->state &= ~REQUEST_RECEIVED;
+  data->state |= RESPONSE_RECEIVED | CACHE_HIT;
+
+  struct epoll_event client_event;
+  client_event.events = EPOLLOUT | EPOLLET;
+  client_event.data.ptr = data->client_fd_data;
+  if (epoll_ctl(data->epoll_fd, EPOLL_CTL_MOD, data->client_fd,
+                &client_event) == -1) {
+    perror("epoll_ctl change mode to out");
+    cleanup_and_close(data, data->epoll_fd);
+  }
+}
+
+// Wait on a fetch another client started for the same object. Returns 1
+// when the request is now a follower.
+static int join_fetch(proxy_data_t *data) {
+  if (!(data->cache_policy & CACHE_LOOKUP)) {
+    return 0;
+  }
+  proxy_data_t *leader = collapse_find(data->cache_key);
+  if (leader == NULL) {
+    return 0;
+  }
+  DEBUG_PRINT("collapsed %s onto client %d\n", data->cache_key,
+              leader->client_fd);
+  STAT_ADD(cache_stats.collapsed, 1);
+  if (leader->prefetch) {
+    // the prefetch paid off before it was even done; what it stores is
+    // this client's now
+    STAT_ADD(cache_stats.prefetch_used, 1);
+    leader->prefetch = 0;
+    if (leader->store != NULL) {
+      leader->store->prefetched = 0;
+    }
+  }
+  data->result = RESULT_COLLAPSED;
+  data->leader = leader;
+  data->next_follower = leader->followers;
+  leader->followers = data;
+  if (leader->store != NULL) {
+    // the body is already streaming in; catch up from the start
+    follow_store(data);
+  }
+  return 1;
+}
+
+// New bytes were stored; followers that caught up can send them.
+static void feed_followers(proxy_data_t *data) {
+  proxy_data_t *follower = data->followers;
+  while (follower != NULL) {
+    proxy_data_t *next = follower->next_follower;
+    if (follower->following) {
+      resume_follower(follower);
+    }
+    follower = next;
+  }
+}
+
+// The fetch is over, or its object will not be stored after all. With
+// complete set the followers finish from the stored object; otherwise
+// those that have sent nothing go to the origin and the rest are cut off.
+static void release_followers(proxy_data_t *data, int complete) {
+  if (data->leading) {
+    collapse_remove(data->cache_key, data);
+    data->leading = 0;
+  }
+
+  proxy_data_t *follower = data->followers;
+  data->followers = NULL;
+  while (follower != NULL) {
+    proxy_data_t *next = follower->next_follower;
+    follower->leader = NULL;
+    follower->next_follower = NULL;
+    if (complete && follower->following) {
+      resume_follower(follower);
+    } else if (!follower->following || follower->hit_offset == 0) {
+      fetch_alone(follower);
+    } else {
+      cleanup_and_close(follower, follower->epoll_fd);
+    }
+    follower = next;
+  }
+}
+
+// Open a tunnel for a CONNECT request, through the same blacklist, resolver
+// and connect path as any other request. A blacklisted one is refused: the
+// warning page cannot be served inside somebody else's TLS.
+static int start_tunnel(proxy_data_t *data) {
+  if (blacklist_match(data->req_buf + 8, data->target_len)) {
+    STAT_ADD(proxy_stats.blacklisted, 1);
+    data->result = RESULT_LOCAL;
+    return respond_status(data, "403 Forbidden", NULL, 0);
+  }
+  STAT_ADD(proxy_stats.tunnels, 1);
+  data->result = RESULT_TUNNEL;
+  data->state |= RESOLVING;
+  data->phase_start = timer_now();
+  arm_timer(data);
+  resolver_lookup(data->host, on_resolved, data);
+  return (data->state & CLOSED) ? -1 : 0;
+}
+
+// The origin accepted the connection. The client is told, and from here on
+// bytes go both ways without being looked at, each direction through a
+// pipe of its own.
+static int open_tunnel(proxy_data_t *data) {
+  data->pipe = pipe_pool_get();
+  data->up_pipe = pipe_pool_get();
+  if (data->pipe == NULL || data->up_pipe == NULL) {
+    release_pipe(data);
+    return fail_upstream(data, "503 Service Unavailable");
+  }
+  if (alloc_relay_buf(data) < 0) {
+    return -1;
+  }
+  data->res_buf_used =
+      snprintf(data->res_buf, data->res_buf_capacity,
+               "HTTP/1.%d 200 Connection established\r\n\r\n",
+               data->client_http11);
+  data->res_buf_start = 0;
+  data->status = 200;
+  data->state &= ~REQUEST_RECEIVED;
+  data->state |= RESPONSE_HEADER_RECEIVED;
+  DEBUG_PRINT("tunnel to %s:%d open\n", data->host, data->port);
+
+  // the set-up is timed like any transaction, what the tunnel carries is not
+  uint64_t marks[MARK_COUNT];
+  memcpy(marks, data->marks, sizeof(marks));
+  stats_record(marks);
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  event.data.ptr = data->client_fd_data;
+  if (epoll_ctl(data->epoll_fd, EPOLL_CTL_MOD, data->client_fd, &event) ==
+      -1) {
+    perror("epoll_ctl");
+    cleanup_and_close(data, data->epoll_fd);
+    return -1;
+  }
+  event.data.ptr = data->server_fd_data;
+  if (epoll_ctl(data->epoll_fd, EPOLL_CTL_MOD, data->server_fd, &event) ==
+      -1) {
+    perror("epoll_ctl");
+    cleanup_and_close(data, data->epoll_fd);
+    return -1;
+  }
+  return relay_tunnel(data, data->epoll_fd);
+}
+
+// One direction of a tunnel: fill its pipe from one socket and drain it into
+// the other. idle, blocked and eof are the state flags of the two ends. Once
+// the sender is done and the pipe is empty, the receiver gets a half-close
+// and the pipe goes back. Returns 1 on progress, 0 when neither end is ready
+// and -1 on an error.
+static int pump(proxy_data_t *data, int from, int to, relay_pipe_t **pipe,
+                uint32_t *piped, state_t idle, state_t blocked, state_t eof) {
+  state_t *state = &(data->state);
+  int progress = 0;
+
+  if (*pipe == NULL) {
+    return 0;  // this direction is over
+  }
+  if (!(*state & (idle | eof)) && *piped < (*pipe)->capacity) {
+    ssize_t count = splice(from, NULL, (*pipe)->fds[1], NULL,
+                           (*pipe)->capacity - *piped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (count == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("splice into tunnel");
+        return -1;
+      }
+      *state |= idle;
+    } else if (count == 0) {
+      *state |= eof;
+      progress = 1;
+    } else {
+      *piped += count;
+      if (from == data->server_fd) {
+        STAT_ADD(proxy_stats.bytes_upstream, count);
+      }
+      progress = 1;
+    }
+  }
+
+  uint64_t len = *piped;
+  if (len > 0 && !(*state & blocked) && to == data->client_fd) {
+    uint64_t allowance = send_allowance(data);
+    len = allowance < len ? allowance : len;
+  }
+  if (len > 0 && !(*state & blocked)) {
+    ssize_t count = splice((*pipe)->fds[0], NULL, to, NULL, len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (count == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("splice out of tunnel");
+        return -1;
+      }
+      *state |= blocked;
+    } else {
+      *piped -= count;
+      if (to == data->client_fd) {
+        STAT_ADD(cache_stats.bytes_served, count);
+        data->served += count;
+      }
+      // a pipe that was full also refuses with EAGAIN
+      *state &= ~idle;
+      progress = 1;
+    }
+  }
+
+  if ((*state & eof) && *piped == 0) {
+    shutdown(to, SHUT_WR);
+    pipe_pool_put(*pipe, 0);
+    *pipe = NULL;
+    progress = 1;
+  }
+  return progress;
+}
+
+// Relay a tunnel both ways until neither direction can make progress; it
+// ends once both sides have finished sending. Bytes the client sent behind
+// the CONNECT go to the origin first, and the 200 reply to the client.
+static int relay_tunnel(proxy_data_t *data, int epoll_fd) {
+  state_t *state = &(data->state);
+
+  while (1) {
+    int progress = 0;
+    int ret;
+
+    if (data->pipelined != NULL) {
+      ret = 0;
+      if (!(*state & SERVER_BLOCKED)) {
+        ssize_t count = send(data->server_fd,
+                             data->pipelined + data->bytes_sent,
+                             data->pipelined_used - data->bytes_sent, 0);
+        if (count == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          perror("send");
+          ret = -1;
+        } else if (count == -1) {
+          *state |= SERVER_BLOCKED;
+        } else if ((data->bytes_sent += count) == data->pipelined_used) {
+          free(data->pipelined);
+          data->pipelined = NULL;
+          data->pipelined_used = 0;
+          data->bytes_sent = 0;
+          ret = 1;
+        }
+      }
+    } else {
+      ret = pump(data, data->client_fd, data->server_fd, &data->up_pipe,
+                 &data->up_piped, CLIENT_IDLE, SERVER_BLOCKED, CLIENT_EOF);
+    }
+    if (ret < 0) {
+      cleanup_and_close(data, epoll_fd);
+      return -1;
+    }
+    progress |= ret;
+
+    uint64_t served = data->served;
+    if (data->res_buf_start < data->res_buf_used) {
+      ret = 0;
+      uint64_t len = data->res_buf_used - data->res_buf_start;
+      if (!(*state & CLIENT_BLOCKED)) {
+        uint64_t allowance = send_allowance(data);
+        len = allowance < len ? allowance : len;
+      }
+      if (!(*state & CLIENT_BLOCKED) && len > 0) {
+        ssize_t count = send(data->client_fd,
+                             data->res_buf + data->res_buf_start, len, 0);
+        if (count == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          perror("send");
+          ret = -1;
+        } else if (count == -1) {
+          *state |= CLIENT_BLOCKED;
+        } else {
+          data->res_buf_start += count;
+          data->served += count;
+          ret = 1;
+        }
+      }
+    } else {
+      ret = pump(data, data->server_fd, data->client_fd, &data->pipe,
+                 &data->piped, UPSTREAM_BLOCKED, CLIENT_BLOCKED, SERVER_EOF);
+    }
+    if (ret < 0) {
+      cleanup_and_close(data, epoll_fd);
+      return -1;
+    }
+    progress |= ret;
+    charge_send(data, data->served - served);
+
+    if (data->pipe == NULL && data->up_pipe == NULL) {
+      DEBUG_PRINT("tunnel to %s:%d closed\n", data->host, data->port);
+      log_transaction(data, 1);
+      memset(data->marks, 0, sizeof(data->marks));
+      cleanup_and_close(data, epoll_fd);
+      return 0;
+    }
+    if (!progress) {
+      break;
+    }
+    data->active = timer_now();
+  }
+  return 0;
+}
+
+int handle_client(proxy_data_t *data, struct epoll_event *event, int epoll_fd) {
+  state_t *state = &(data->state);
+
+  begin_turn(data);
+
+  if ((*state & TUNNEL) && (*state & RESPONSE_HEADER_RECEIVED)) {
+    if (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      *state &= ~CLIENT_IDLE;
+    }
+    if (event->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+      *state &= ~CLIENT_BLOCKED;
+    }
+    return relay_tunnel(data, epoll_fd);
+  }
+  while (1) {
+    if (*state & REQUEST_NOT_RECEIVED) {
+      // a pipelined request may already be complete in the buffer
+      int parsed = data->req_buf ? http_parse(&data->req_parser, data->req_buf,
+                                              data->req_buf_used)
+                                 : 0;
+      if (parsed != 0) {
+        *state &= ~REQUEST_NOT_RECEIVED;
+        *state |= REQUEST_RECEIVED;
+        data->started = data->phase_start = timer_now();
+        stats_mark(data->marks, MARK_ACCEPT);  // pipelined
+        stats_mark(data->marks, MARK_PARSED);
+        STAT_ADD(proxy_stats.requests, 1);
+        if (parsed < 0) {
+          return respond_bad_request(data);
+        }
+        if (hold_pipelined(data, data->req_buf + data->req_parser.length) <
+            0) {
+          cleanup_and_close(data, epoll_fd);
+          return -1;
+        }
+        if (parse_request(data) < 0) {
+          return respond_bad_request(data);
+        }
+        if (*state & TUNNEL) {
+          return start_tunnel(data);
+        }
+        if (is_stats_request(data)) {
+          return serve_stats(data);
+        }
+        if (serve_from_cache(data) || join_fetch(data)) {
+          return (*state & CLOSED) ? -1 : 0;
+        }
+        lead_fetch(data);
+        return forward_request(data);
+      }
+
+      if (data->req_buf_capacity < data->req_buf_used + DELTA) {
+        // doubling keeps the copies made by realloc linear in the size
+        uint32_t capacity = data->req_buf_capacity
+                                ? data->req_buf_capacity * 2
+                                : REQUEST_BUF_SIZE;
+        char *buf = realloc(data->req_buf, capacity + 1);
+        if (buf == NULL) {
+          perror("realloc");
+          cleanup_and_close(data, epoll_fd);
+          return -1;
+        }
+        data->req_buf = buf;
+        data->req_buf_capacity = capacity;
+      }
+      ssize_t count = recv(data->client_fd, data->req_buf + data->req_buf_used,
+                           data->req_buf_capacity - data->req_buf_used - 1, 0);
+
+      if (count == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        } else {
+          perror("recv");
+          cleanup_and_close(data, epoll_fd);
+          return -1;
+        }
+      } else if (count == 0) {
+        cleanup_and_close(data, epoll_fd);
+        return -1;
+      }
+
+      data->req_buf_used += count;
+      data->req_buf[data->req_buf_used] = '\0';
+      data->active = timer_now();
+      stats_mark(data->marks, MARK_ACCEPT);
+
+      DEBUG_PRINT("Received %d bytes from client: %s\n", data->req_buf_used,
+                  data->req_buf);
+    } else if (*state & (RESPONSE_HEADER_RECEIVED | RESPONSE_RECEIVED)) {
+      if (event != NULL && (event->events & EPOLLOUT)) {
+        *state &= ~CLIENT_BLOCKED;
+      }
+      int ret = relay_response(data, epoll_fd);
+      if (ret < 0 || !(*state & REQUEST_NOT_RECEIVED)) {
+        return ret;
+      }
+      // the response is done and the client may have sent the next request
+    } else
+      break;
+  }
+  return 0;
+}
+
+int handle_server(proxy_data_t *data, struct epoll_event *event, int epoll_fd) {
+  state_t *state = &(data->state);
+  fd_data_t *fd_data = (fd_data_t *)event->data.ptr;
+
+  begin_turn(data);
+
+  if (fd_data != data->server_fd_data) {
+    // a connect attempt, unless it was closed earlier in this batch
+    if (fd_data->fd == -1 || !(*state & CONNECTING)) {
+      return 0;
+    }
+    if (finish_connect(data, fd_data) < 0) {
+      return -1;
+    }
+  }
+  if ((*state & TUNNEL) && (*state & SERVER_OPEN)) {
+    if (!(*state & RESPONSE_HEADER_RECEIVED)) {
+      return open_tunnel(data);
+    }
+    if (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      *state &= ~UPSTREAM_BLOCKED;
+    }
+    if (event->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+      *state &= ~SERVER_BLOCKED;
+    }
+    return relay_tunnel(data, epoll_fd);
+  }
+  while (1) {
+    if ((*state & REQUEST_RECEIVED) && (*state & SERVER_OPEN)) {
+      // send request to server
+      ssize_t count = send(data->server_fd, data->req_buf + data->bytes_sent,
+                           data->req_buf_used - data->bytes_sent, 0);
+      if (count == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        } else if (data->server_reused &&
+                   (errno == EPIPE || errno == ECONNRESET)) {
+          return retry_server(data);
+        } else {
+          perror("send");
+          return fail_upstream(data, "502 Bad Gateway");
+        }
+      } else if (count == 0) {
+        cleanup_and_close(data, epoll_fd);
+        return -1;
+      }
+
+      data->bytes_sent += count;
+
+      if (data->bytes_sent == data->req_buf_used) {
+        data->bytes_sent = 0;
+        *state &= ~REQUEST_RECEIVED;
+        *state |= REQUEST_SENT;
+
+        // request all sent, watch input from server
+        struct epoll_event server_event;
+        server_event.events = EPOLLIN | EPOLLET;
+        server_event.data.ptr = data->server_fd_data;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->server_fd,
+                      &server_event) == -1) {
+          perror("epoll_ctl");
+          cleanup_and_close(data, epoll_fd);
+          return -1;
+        }
+        break;
+      }
+
+      DEBUG_PRINT("Sent %ld bytes to server %s\n", count, data->req_buf);
+    } else if (*state & REQUEST_SENT) {
+      if (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        *state &= ~UPSTREAM_BLOCKED;
+      }
+      int ret = relay_response(data, epoll_fd);
+      if (ret == 0 && (*state & REQUEST_NOT_RECEIVED)) {
+        // a pipelined request sitting in the buffer gets no client event
+        return handle_client(data, NULL, epoll_fd);
+      }
+      return ret;
+    } else
+      break;
+  }
+  return 0;
+}
+
+// complete is 0 when the origin stopped before the framing said it was done
+static void set_response_received(proxy_data_t *data, int complete) {
+  data->state &= ~(REQUEST_SENT | UPSTREAM_PAUSED | UPSTREAM_BLOCKED);
+  data->state |= RESPONSE_RECEIVED;
+  stats_mark(data->marks, MARK_LAST_BYTE);
+  data->response_complete = complete;
+  if (!complete) {
+    // closing on the client is the only way to tell it the body is short
+    data->upstream_keepalive = 0;
+    data->client_keepalive = 0;
+  }
+  prefetch_page_end(data->page);
+  data->page = NULL;
+  compressor_free(data->gzip);
+  data->gzip = NULL;
+
+  if (data->store != NULL) {
+    if (complete) {
+      cache_commit(data->store);
+    } else {
+      cache_abort(data->store);
+    }
+    data->store = NULL;
+    release_followers(data, complete);
+  }
+}
+
+// Start collecting a cacheable response once its header is known.
+static void begin_store(proxy_data_t *data) {
+  time_t expires;
+
+  // a body that ends with the connection cannot be told from a cut one
+  if (!(data->cache_policy & CACHE_STORE) || data->content_type == NONE) {
+    return;
+  }
+  if (!cache_response_policy(data->res_buf, data->header_length, &expires)) {
+    STAT_ADD(cache_stats.uncacheable, 1);
+    return;
+  }
+  // a compressed body has a key of its own, and the lookup may have gone
+  // by the plain one
+  char *key = data->cache_key;
+  int variant = compress_is_key(key);
+  if (data->gzip != NULL && !variant) {
+    key = compress_key(key);
+  } else if (data->gzip == NULL && variant) {
+    key = strndup(key, strlen(key) - strlen(" gzip"));
+  }
+  if (key == NULL) {
+    return;
+  }
+  data->store = cache_begin(key, expires, data->req_buf, data->req_buf_used,
+                            data->res_buf, data->header_length);
+  if (key != data->cache_key) {
+    free(key);
+  }
+  if (data->store != NULL) {
+    data->store->prefetched = data->prefetch;
+  }
+}
+
+// An HTML page from the origin is scanned for the prefetcher as it passes,
+// unless it is compressed or the response is something else.
+static void begin_scan(proxy_data_t *data) {
+  size_t len;
+
+  if (!prefetch_enabled() || data->prefetch || data->status != 200) {
+    return;
+  }
+  const char *type =
+      http_header(&data->res_parser, data->res_buf, "Content-Type", &len);
+  if (type == NULL || len < 9 || strncasecmp(type, "text/html", 9) != 0 ||
+      http_header(&data->res_parser, data->res_buf, "Content-Encoding",
+                  &len) != NULL) {
+    return;
+  }
+  data->page = prefetch_page_begin(data->req_buf, data->req_buf_used,
+                                   data->host, data->port);
+}
+
+// A textual body is compressed on its way to a client that takes gzip,
+// unless it already is encoded or too small to be worth it.
+static void begin_gzip(proxy_data_t *data) {
+  size_t len;
+
+  if (!data->accepts_gzip || data->status != 200 ||
+      (data->content_type == CONTENT_LENGTH &&
+       data->content_length < COMPRESS_MIN_LENGTH)) {
+    return;
+  }
+  const char *type =
+      http_header(&data->res_parser, data->res_buf, "Content-Type", &len);
+  if (type == NULL || !compress_type_ok(type, len) ||
+      http_header(&data->res_parser, data->res_buf, "Content-Encoding",
+                  &len) != NULL) {
+    return;
+  }
+  data->gzip = compressor_new();
+}
+
+// Insert len bytes of text at pos in the response header, moving what
+// follows along. COMPRESS_SLACK keeps the room for it.
+static void insert_header_text(proxy_data_t *data, char *pos,
+                               const char *text, size_t len) {
+  memmove(pos + len, pos, data->res_buf + data->res_buf_used - pos + 1);
+  memcpy(pos, text, len);
+  data->header_length += len;
+  data->res_buf_used += len;
+}
+
+// Announce the compressed body. Its framing has been stripped; an HTTP/1.1
+// client gets it in chunks, and a strong validator of the plain body only
+// holds weakly for this one.
+static void add_gzip_headers(proxy_data_t *data) {
+  char lines[128];
+  size_t len;
+
+  const char *etag =
+      find_header(data->res_buf, data->header_length, "ETag", &len);
+  if (etag != NULL && len > 0 && *etag == '"') {
+    insert_header_text(data, data->res_buf + (etag - data->res_buf), "W/", 2);
+  }
+  int n = snprintf(lines, sizeof(lines),
+                   "Content-Encoding: gzip\r\n%sVary: Accept-Encoding\r\n",
+                   data->client_http11 ? "Transfer-Encoding: chunked\r\n" : "");
+  insert_header_text(data, data->res_buf + data->header_length - 2, lines, n);
+}
+
+static void store_bytes(proxy_data_t *data, const char *buf, size_t len) {
+  if (data->store == NULL) {
+    return;
+  }
+  if (cache_append(data->store, buf, len) < 0) {
+    DEBUG_PRINT("not caching %s\n", data->cache_key);
+    cache_abort(data->store);
+    data->store = NULL;
+    release_followers(data, 0);
+    return;
+  }
+  feed_followers(data);
+}
+
+// Replace the plain body bytes from buf to the end of the relay buffer
+// with their compressed form, a chunk of it for an HTTP/1.1 client, and
+// store that. finish ends the stream. Returns -1 if it did not fit.
+static int compress_body(proxy_data_t *data, char *buf, int finish) {
+  static __thread char out[RELAY_BUF_SIZE + COMPRESS_SLACK];
+  char *end = data->res_buf + data->res_buf_capacity;
+  size_t len = data->res_buf + data->res_buf_used - buf;
+
+  if (len == 0 && !finish) {
+    return 0;
+  }
+  ssize_t n = compressor_run(data->gzip, buf, len, out, sizeof(out), finish);
+  // the chunk's size line and CRLF, and the last chunk
+  if (n < 0 || n + 16 > end - buf) {
+    fprintf(stderr, "gzip: compressed body from %s does not fit\n",
+            data->host);
+    return -1;
+  }
+  char *p = buf;
+  if (data->client_http11 && n > 0) {
+    p += sprintf(p, "%zx\r\n", n);
+  }
+  memcpy(p, out, n);
+  p += n;
+  if (data->client_http11 && n > 0) {
+    memcpy(p, "\r\n", 2);
+    p += 2;
+  }
+  if (data->client_http11 && finish) {
+    memcpy(p, "0\r\n\r\n", 5);
+    p += 5;
+  }
+  data->res_buf_used = p - data->res_buf;
+  data->res_buf[data->res_buf_used] = '\0';
+  store_bytes(data, buf, p - buf);
+  return 0;
+}
+
+// No usable response header came from the origin. Returns what
+// recv_from_server() does.
+static int bad_gateway(proxy_data_t *data) {
+  return fail_upstream(data, "502 Bad Gateway") < 0 ? -1 : 1;
+}
+
+// Read one batch of response bytes from the origin into the relay buffer.
+// Returns 1 on progress, 0 when the origin has nothing to read and -1 once
+// the connection has been closed.
+static int recv_from_server(proxy_data_t *data, int epoll_fd) {
+  state_t *state = &(data->state);
+
+  // keep the free space contiguous at the tail of the buffer
+  if (data->res_buf_start == data->res_buf_used) {
+    data->res_buf_start = 0;
+    data->res_buf_used = 0;
+  } else if (data->res_buf_capacity - data->res_buf_used < DELTA) {
+    memmove(data->res_buf, data->res_buf + data->res_buf_start,
+            data->res_buf_used - data->res_buf_start);
+    data->res_buf_used -= data->res_buf_start;
+    data->res_buf_start = 0;
+  }
+
+  // a body that may be compressed in place needs room to grow
+  uint32_t slack = data->accepts_gzip ? COMPRESS_SLACK : 0;
+  if (data->res_buf_used + slack >= data->res_buf_capacity) {
+    return 0;
+  }
+  ssize_t count = recv(data->server_fd, data->res_buf + data->res_buf_used,
+                       data->res_buf_capacity - slack - data->res_buf_used, 0);
+
+  // a reused connection that fails before answering gets one more try
+  int retry = data->server_reused && data->res_buf_used == 0 &&
+              !(*state & RESPONSE_HEADER_RECEIVED);
+
+  if (count == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      *state |= UPSTREAM_BLOCKED;
+      return 0;
+    }
+    if (retry && errno == ECONNRESET) {
+      return retry_server(data);
+    }
+    perror("recv");
+    if (!(*state & RESPONSE_HEADER_RECEIVED)) {
+      return bad_gateway(data);
+    }
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  } else if (count == 0) {
+    if (retry) {
+      return retry_server(data);
+    }
+    if (!(*state & RESPONSE_HEADER_RECEIVED)) {
+      return bad_gateway(data);
+    }
+    // origin closed, the response ends here
+    if (data->gzip != NULL && data->content_type == NONE &&
+        compress_body(data, data->res_buf + data->res_buf_used, 1) < 0) {
+      cleanup_and_close(data, epoll_fd);
+      return -1;
+    }
+    set_response_received(data, data->content_type == NONE);
+    return 1;
+  }
+
+  char *received = data->res_buf + data->res_buf_used;
+  data->res_buf_used += count;
+  stats_mark(data->marks, MARK_FIRST_BYTE);
+  STAT_ADD(proxy_stats.bytes_upstream, count);
+  data->res_buf[data->res_buf_used] = '\0';
+  DEBUG_PRINT("Received %ld bytes from server\n", count);
+
+  if (!(*state & RESPONSE_HEADER_RECEIVED)) {
+    int parsed =
+        http_parse(&data->res_parser, data->res_buf, data->res_buf_used);
+    if (parsed == 0) {
+      if (data->res_buf_used + slack == data->res_buf_capacity) {
+        DEBUG_PRINT("response header larger than %d bytes\n",
+                    data->res_buf_capacity);
+        return bad_gateway(data);
+      }
+      return 1;
+    }
+    if (parsed < 0 || parse_response_header(data) < 0) {
+      DEBUG_PRINT("malformed response header from %s\n", data->host);
+      return bad_gateway(data);
+    }
+    begin_scan(data);
+    begin_gzip(data);
+    // an HTTP/1.0 client cannot read chunked framing; it gets the bare
+    // body, ended by the close. A body to compress is decoded first too.
+    data->dechunk = data->content_type == CHUNKED &&
+                    (!data->client_http11 || data->gzip != NULL);
+    uint32_t removed =
+        strip_hop_by_hop(data->res_buf, data->res_buf + data->res_buf_used,
+                         data->dechunk || data->gzip != NULL);
+    data->header_length -= removed;
+    data->res_buf_used -= removed;
+    // whether the body as the client gets it carries its own end
+    int framed = data->gzip != NULL ? data->client_http11 : !data->dechunk;
+    if (data->content_type == NONE || !framed) {
+      // the client can only see the end of this body by the close
+      data->client_keepalive = 0;
+    } else if (data->client_keepalive) {
+      // a proxy speaks its own version; a 1.0 status line would make the
+      // client close a connection that is meant to stay
+      data->res_buf[7] = '1';
+    }
+    *state |= RESPONSE_HEADER_RECEIVED;
+    if (framed) {
+      begin_store(data);
+    }
+    // after the store has taken the origin's Vary: the gzip variant has a
+    // key of its own, and other ways to write Accept-Encoding still match it
+    if (data->gzip != NULL) {
+      add_gzip_headers(data);
+    }
+    if (data->store != NULL) {
+      proxy_data_t *follower = data->followers;
+      while (follower != NULL) {
+        proxy_data_t *next = follower->next_follower;
+        follow_store(follower);
+        follower = next;
+      }
+    } else {
+      release_followers(data, 0);
+    }
+    store_bytes(data, data->res_buf, data->header_length);
+
+    http_chunked_init(&data->chunked);
+    received = data->res_buf + data->header_length;
+    count = data->res_buf_used - data->header_length;
+
+    // start streaming, watch output readiness from client
+    struct epoll_event client_event;
+    client_event.events = EPOLLOUT | EPOLLET;
+    client_event.data.ptr = data->client_fd_data;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->client_fd, &client_event) ==
+        -1) {
+      perror("epoll_ctl");
+      cleanup_and_close(data, epoll_fd);
+      return -1;
+    }
+  }
+
+  ssize_t used = count;
+  if (data->content_type & CHUNKED) {
+    size_t decoded;
+    used = http_chunked_feed(&data->chunked, received, count,
+                             data->dechunk ? &decoded : NULL);
+    if (used < 0) {
+      DEBUG_PRINT("malformed chunked body from %s\n", data->host);
+      cleanup_and_close(data, epoll_fd);
+      return -1;
+    }
+    if (data->gzip == NULL) {
+      store_bytes(data, received, used);
+    }
+    // framing left in is rarely inside a link, and makes it unusable if so
+    prefetch_page_scan(data->page, received, data->dechunk ? decoded : used);
+    data->res_buf_used = received - data->res_buf;
+    data->res_buf_used += data->dechunk ? decoded : used;
+  } else {
+    if ((data->content_type & CONTENT_LENGTH) &&
+        data->body_received + used > data->content_length) {
+      used = data->content_length - data->body_received;
+      data->res_buf_used -= count - used;
+    }
+    if (data->gzip == NULL) {
+      store_bytes(data, received, used);
+    }
+    prefetch_page_scan(data->page, received, used);
+  }
+  data->body_received += used;
+
+  int done = 0;
+  if (data->content_type & CHUNKED) {
+    done = data->chunked.state == CHUNK_DONE;
+  } else if (data->content_type & CONTENT_LENGTH) {
+    done = data->body_received >= data->content_length;
+    if (!done) {
+      DEBUG_PRINT("content_length: %lu, body_received: %lu\n",
+                  data->content_length, data->body_received);
+    }
+  }
+  if (data->gzip != NULL && compress_body(data, received, done) < 0) {
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  }
+  if (done) {
+    set_response_received(data, 1);
+  }
+  if (used < count) {
+    // bytes past the end of the response; the connection is out of step
+    DEBUG_PRINT("dropping %ld bytes after the response from %s\n",
+                count - used, data->host);
+    data->upstream_keepalive = 0;
+  }
+  return 1;
 }
 
-void cleanup_and_close(proxy_data_t *data, int epoll_fd) {
-  // close file descriptors as needed
-  if (data->state & CLIENT_OPEN) {
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->client_fd, NULL);
-    close(data->client_fd);
-    DEBUG_PRINT("client disconnected: %d\n", data->client_fd);
+// Send the next part of an object from the disk tier; the bytes go from the
+// page cache to the socket without a user-space copy.
+static int send_disk_cached(proxy_data_t *data, int epoll_fd) {
+  disk_hit_t *hit = &data->disk_hit;
+
+  if (hit->size == 0) {
+    data->state &= ~CACHE_HIT;
+    return 1;
   }
-  if (data->state & SERVER_OPEN) {
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->server_fd, NULL);
-    close(data->server_fd);
-    DEBUG_PRINT("server disconnected: %d\n", data->server_fd);
+
+  uint64_t len = send_allowance(data);
+  if (len == 0) {
+    return 0;
+  }
+  len = len < hit->size ? len : hit->size;
+  len = len > 0x7ffff000 ? 0x7ffff000 : len;
+  ssize_t count =
+      sendfile(data->client_fd, hit->segment->fd, &hit->offset, len);
+  if (count == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      data->state |= CLIENT_BLOCKED;
+      return 0;
+    }
+    perror("sendfile");
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  } else if (count == 0) {
+    // the segment is shorter than its index entry says
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  }
+
+  hit->size -= count;
+  STAT_ADD(cache_stats.bytes_served, count);
+  data->served += count;
+  STAT_ADD(cache_stats.bytes_hit, count);
+  if (hit->size == 0) {
+    data->state &= ~CACHE_HIT;
   }
-  reset_proxy_data(data);
+  return 1;
 }
 
-int handle_client(proxy_data_t *data, struct epoll_event *event, int epoll_fd) {
-  state_t *state = &(data->state);
+// Send what has been stored so far of an object that a leader may still be
+// fetching; from the staging file once it outgrew the memory tier.
+static int send_followed(proxy_data_t *data, int epoll_fd) {
+  cache_object_t *obj = data->hit;
+  struct iovec iov[16];
+  ssize_t count;
 
-  while (1) {
-    if (*state & REQUEST_NOT_RECEIVED) {
-      if (data->req_buf_capacity < data->req_buf_used + DELTA) {
-        data->req_buf_capacity += CHUNK_SIZE;
-        data->req_buf = realloc(data->req_buf, data->req_buf_capacity + 1);
-        if (data->req_buf == NULL) {
-          perror("realloc");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
-      }
-      ssize_t count = recv(data->client_fd, data->req_buf + data->req_buf_used,
-                           data->req_buf_capacity - data->req_buf_used - 1, 0);
+  if (data->hit_offset == obj->size) {
+    if (data->leader != NULL) {
+      return 0;  // fed again once more arrives
+    }
+    data->state &= ~CACHE_HIT;
+    return 1;
+  }
 
-      if (count == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          break;
-        } else {
-          perror("recv");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
-      } else if (count == 0) {
-        cleanup_and_close(data, epoll_fd);
-        return -1;
-      }
+  uint64_t len = send_allowance(data);
+  if (len == 0) {
+    return 0;
+  }
+  len = len < obj->size - data->hit_offset ? len : obj->size - data->hit_offset;
+  if (obj->spill_fd >= 0) {
+    off_t offset = data->hit_offset;
+    count = sendfile(data->client_fd, obj->spill_fd, &offset, len);
+  } else {
+    int n = cache_read_iov_at(obj, data->hit_offset, iov, 16);
+    count = writev(data->client_fd, iov, trim_iov(iov, n, len));
+  }
+  if (count == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      data->state |= CLIENT_BLOCKED;
+      return 0;
+    }
+    perror("send followed");
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  } else if (count == 0) {
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  }
 
-      data->req_buf_used += count;
-      data->req_buf[data->req_buf_used] = '\0';
+  data->hit_offset += count;
+  STAT_ADD(cache_stats.bytes_served, count);
+  data->served += count;
+  STAT_ADD(cache_stats.bytes_hit, count);
+  return 1;
+}
 
-      DEBUG_PRINT("Received %d bytes from client: %s\n", data->req_buf_used,
-                  data->req_buf);
-      if (strstr(data->req_buf, "\r\n\r\n") != NULL) {
-        *state &= ~REQUEST_NOT_RECEIVED;
-        *state |= REQUEST_RECEIVED;
-        parse_request(data);
-      }
-    } else if ((*state & REQUEST_RECEIVED) && !(*state & SERVER_OPEN)) {
-      if (!(data->host_entry)) {
-        // send 400 Bad Request
-        char *res = "HTTP/1.0 400 Bad Request\r\n";
-        data->res_buf = malloc(strlen(res) + 1);
-        strcpy(data->res_buf, res);
-        data->res_buf_used = strlen(res);
-        *state &= ~REQUEST_RECEIVED;
-        *state |= RESPONSE_RECEIVED;
+// Send the next piece of a hit answered in ranges: header text from the
+// relay buffer, then object bytes, from the disk tier at their offset with
+// sendfile.
+static int send_range(proxy_data_t *data, int epoll_fd) {
+  range_part_t *part = &data->parts[data->part_next];
+  struct iovec iov[16];
+  ssize_t count;
+  int text = data->res_buf_start < part->text_end;
 
-        // Modify the event to monitor for output readiness
-        event->events = EPOLLOUT | EPOLLET;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->client_fd, event) == -1) {
-          perror("epoll_ctl change mode to out");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
-        break;
-      } else {
-        // connect to the server
-        data->server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        setnonblocking(data->server_fd);
-        if (data->server_fd == -1) {
-          perror("socket");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
+  if (!text && part->start == part->end) {
+    if (++data->part_next == data->part_count) {
+      data->state &= ~CACHE_HIT;
+    }
+    return 1;
+  }
+  uint64_t len = send_allowance(data);
+  if (len == 0) {
+    return 0;
+  }
+  if (text) {
+    uint64_t left = part->text_end - data->res_buf_start;
+    count = send(data->client_fd, data->res_buf + data->res_buf_start,
+                 len < left ? len : left, 0);
+  } else if (data->disk_hit.segment != NULL) {
+    len = len < part->end - part->start ? len : part->end - part->start;
+    off_t offset = data->disk_hit.offset + part->start;
+    count = sendfile(data->client_fd, data->disk_hit.segment->fd, &offset,
+                     len > 0x7ffff000 ? 0x7ffff000 : len);
+  } else {
+    // not past the range
+    len = len < part->end - part->start ? len : part->end - part->start;
+    int n = cache_read_iov_at(data->hit, part->start, iov, 16);
+    count = writev(data->client_fd, iov, trim_iov(iov, n, len));
+  }
+  if (count == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      data->state |= CLIENT_BLOCKED;
+      return 0;
+    }
+    perror("send range");
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  } else if (count == 0) {
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  }
 
-        struct sockaddr_in server_addr;
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(data->port);
-        memcpy(&(server_addr.sin_addr), data->host_entry->h_addr_list[0],
-               data->host_entry->h_length);
-        if (connect(data->server_fd, (struct sockaddr *)&server_addr,
-                    sizeof(server_addr)) == -1) {
-          if (errno != EINPROGRESS) {
-            perror("connect");
-            cleanup_and_close(data, epoll_fd);
-            return -1;
-          }
-        }
+  if (text) {
+    data->res_buf_start += count;
+  } else {
+    part->start += count;
+    STAT_ADD(cache_stats.bytes_hit, count);
+  }
+  STAT_ADD(cache_stats.bytes_served, count);
+  data->served += count;
+  return 1;
+}
 
-        // change state for data
-        *state |= SERVER_OPEN;
+// Send the next part of a cached object straight from its slab chunks.
+static int send_cached(proxy_data_t *data, int epoll_fd) {
+  struct iovec iov[16];
 
-        // register to epoll
-        fd_data_t *server_fd_data = calloc(1, sizeof(fd_data_t));
-        data->server_fd_data = server_fd_data;
-        server_fd_data->fd = data->server_fd;
-        server_fd_data->data = data;
+  if (data->parts != NULL) {
+    return send_range(data, epoll_fd);
+  }
+  if (data->following) {
+    return send_followed(data, epoll_fd);
+  }
+  if (data->disk_hit.segment != NULL) {
+    return send_disk_cached(data, epoll_fd);
+  }
 
-        struct epoll_event server_event;
-        server_event.events = EPOLLOUT | EPOLLET;
-        server_event.data.ptr = server_fd_data;
+  int n = cache_read_iov(&data->hit_cursor, iov, 16);
+  if (n == 0) {
+    data->state &= ~CACHE_HIT;
+    return 1;
+  }
+  uint64_t allowance = send_allowance(data);
+  if (allowance == 0) {
+    return 0;
+  }
 
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->server_fd,
-                      &server_event) == -1) {
-          perror("epoll_ctl");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
+  ssize_t count = writev(data->client_fd, iov, trim_iov(iov, n, allowance));
+  if (count == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      data->state |= CLIENT_BLOCKED;
+      return 0;
+    }
+    perror("writev");
+    cleanup_and_close(data, epoll_fd);
+    return -1;
+  }
 
-        DEBUG_PRINT("Connected to server of fd %d with host %s:%d\n",
-                    data->server_fd, data->host_entry->h_name, data->port);
-        break;
-      }
-    } else if (*state & RESPONSE_RECEIVED) {
-      // send response to client
-      ssize_t count = send(data->client_fd, data->res_buf + data->bytes_sent,
-                           data->res_buf_used - data->bytes_sent, 0);
-      if (count == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          break;
-        } else {
-          perror("send");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
-      } else if (count == 0) {
+  cache_advance(&data->hit_cursor, count);
+  STAT_ADD(cache_stats.bytes_served, count);
+  data->served += count;
+  STAT_ADD(cache_stats.bytes_hit, count);
+  if (data->hit_cursor.block == NULL) {
+    data->state &= ~CACHE_HIT;
+  }
+  return 1;
+}
+
+// Once the header has gone out, a body that is neither stored nor decoded
+// can go from socket to socket through a pipe without entering user memory.
+static int start_splice(proxy_data_t *data) {
+  state_t state = data->state;
+
+  if (!(state & RESPONSE_HEADER_RECEIVED) ||
+      (state & (RESPONSE_RECEIVED | CACHE_HIT)) || data->store != NULL ||
+      data->page != NULL || data->gzip != NULL ||
+      data->content_type == CHUNKED ||
+      data->res_buf_start != data->res_buf_used) {
+    return 0;
+  }
+  if (data->content_type == CONTENT_LENGTH &&
+      data->content_length - data->body_received < SPLICE_MIN_BODY) {
+    return 0;
+  }
+  data->pipe = pipe_pool_get();
+  if (data->pipe == NULL) {
+    return 0;
+  }
+  DEBUG_PRINT("splicing the body from %s\n", data->host);
+  return 1;
+}
+
+// Fill the pipe from the origin and drain it into the client. Returns 1 on
+// progress, 0 when neither side is ready and -1 once the connection has
+// been closed.
+static int splice_body(proxy_data_t *data, int epoll_fd) {
+  state_t *state = &(data->state);
+  relay_pipe_t *pipe = data->pipe;
+  int progress = 0;
+
+  if ((*state & REQUEST_SENT) && !(*state & UPSTREAM_BLOCKED) &&
+      data->piped < pipe->capacity) {
+    // never past the body, the next response may follow on the connection
+    size_t len = pipe->capacity - data->piped;
+    if (data->content_type == CONTENT_LENGTH &&
+        len > data->content_length - data->body_received) {
+      len = data->content_length - data->body_received;
+    }
+    ssize_t count = splice(data->server_fd, NULL, pipe->fds[1], NULL, len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (count == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        *state |= UPSTREAM_BLOCKED;
+      } else {
+        perror("splice from server");
         cleanup_and_close(data, epoll_fd);
         return -1;
       }
+    } else if (count == 0) {
+      set_response_received(data, data->content_type == NONE);
+      progress = 1;
+    } else {
+      data->piped += count;
+      data->body_received += count;
+      STAT_ADD(proxy_stats.bytes_upstream, count);
+      if (data->content_type == CONTENT_LENGTH &&
+          data->body_received >= data->content_length) {
+        set_response_received(data, 1);
+      }
+      progress = 1;
+    }
+  }
 
-      data->bytes_sent += count;
-
-      if (data->bytes_sent == data->res_buf_used) {
-        data->bytes_sent = 0;
-        *state &= ~RESPONSE_RECEIVED;
-        *state |= RESPONSE_SENT;
+  uint64_t len = 0;
+  if (data->piped > 0 && !(*state & CLIENT_BLOCKED)) {
+    len = send_allowance(data);
+    len = len < data->piped ? len : data->piped;
+  }
+  if (len > 0) {
+    ssize_t count = splice(pipe->fds[0], NULL, data->client_fd, NULL, len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (count == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        *state |= CLIENT_BLOCKED;
+      } else {
+        perror("splice to client");
         cleanup_and_close(data, epoll_fd);
-        break;
+        return -1;
       }
-
-      DEBUG_PRINT("Sent %ld bytes to client\n", count);
-    } else
-      break;
+    } else {
+      data->piped -= count;
+      STAT_ADD(cache_stats.bytes_served, count);
+      data->served += count;
+      // a pipe left with partly drained pages also refuses with EAGAIN
+      *state &= ~UPSTREAM_BLOCKED;
+      progress = 1;
+    }
   }
-  return 0;
+  return progress;
 }
 
-int handle_server(proxy_data_t *data, struct epoll_event *event, int epoll_fd) {
+// Move the response from the origin to the client until neither side can
+// make progress. Only a bounded window of the response is held in memory.
+int relay_response(proxy_data_t *data, int epoll_fd) {
   state_t *state = &(data->state);
 
-  while (1) {
-    if ((*state & REQUEST_RECEIVED) && (*state & SERVER_OPEN)) {
-      // send request to server
-      ssize_t count = send(data->server_fd, data->req_buf + data->bytes_sent,
-                           data->req_buf_used - data->bytes_sent, 0);
-      if (count == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          break;
-        } else {
-          perror("send");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
-      } else if (count == 0) {
-        cleanup_and_close(data, epoll_fd);
-        return -1;
-      }
+  if (!(*state & CACHE_HIT) && alloc_relay_buf(data) < 0) {
+    return -1;
+  }
 
-      data->bytes_sent += count;
+  while (1) {
+    int progress = 0;
+    uint32_t buffered = data->res_buf_used - data->res_buf_start;
+    uint64_t served = data->served;
 
-      if (data->bytes_sent == data->req_buf_used) {
-        data->bytes_sent = 0;
-        *state &= ~REQUEST_RECEIVED;
-        *state |= REQUEST_SENT;
+    if (buffered >= RELAY_HIGH_WATERMARK) {
+      *state |= UPSTREAM_PAUSED;
+    } else if (buffered <= RELAY_LOW_WATERMARK) {
+      *state &= ~UPSTREAM_PAUSED;
+    }
 
-        // request all sent, watch input from server
-        struct epoll_event server_event;
-        server_event.events = EPOLLIN | EPOLLET;
-        server_event.data.ptr = data->server_fd_data;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->server_fd,
-                      &server_event) == -1) {
-          perror("epoll_ctl");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
-        break;
+    if (data->pipe != NULL || start_splice(data)) {
+      int ret = splice_body(data, epoll_fd);
+      if (ret < 0) {
+        return -1;
       }
-
-      DEBUG_PRINT("Sent %ld bytes to server %s\n", count, data->req_buf);
-    } else if ((*state & REQUEST_SENT)) {
-      // receive response from server
-      if (data->res_buf_capacity < data->res_buf_used + DELTA) {
-        data->res_buf_capacity += CHUNK_SIZE;
-        data->res_buf = realloc(data->res_buf, data->res_buf_capacity + 1);
-        if (data->res_buf == NULL) {
-          perror("realloc");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
+      progress |= ret;
+    } else if ((*state & REQUEST_SENT) &&
+               !(*state & (UPSTREAM_PAUSED | UPSTREAM_BLOCKED))) {
+      int ret = recv_from_server(data, epoll_fd);
+      if (ret < 0) {
+        return -1;
       }
-      ssize_t count = recv(data->server_fd, data->res_buf + data->res_buf_used,
-                           data->res_buf_capacity - data->res_buf_used - 1, 0);
+      progress |= ret;
+    }
 
+    uint64_t allowance;
+    if ((*state & CACHE_HIT) && !(*state & CLIENT_BLOCKED)) {
+      int ret = send_cached(data, epoll_fd);
+      if (ret < 0) {
+        return -1;
+      }
+      progress |= ret;
+    } else if ((*state & (RESPONSE_HEADER_RECEIVED | RESPONSE_RECEIVED)) &&
+               !(*state & CLIENT_BLOCKED) &&
+               data->res_buf_start < data->res_buf_used &&
+               (allowance = send_allowance(data)) > 0) {
+      uint64_t len = data->res_buf_used - data->res_buf_start;
+      ssize_t count = send(data->client_fd, data->res_buf + data->res_buf_start,
+                           allowance < len ? allowance : len, 0);
       if (count == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          break;
+          *state |= CLIENT_BLOCKED;
         } else {
-          perror("recv");
+          perror("send");
           cleanup_and_close(data, epoll_fd);
           return -1;
         }
       } else if (count == 0) {
         cleanup_and_close(data, epoll_fd);
         return -1;
+      } else {
+        data->res_buf_start += count;
+        STAT_ADD(cache_stats.bytes_served, count);
+        data->served += count;
+        progress = 1;
+        DEBUG_PRINT("Sent %ld bytes to client\n", count);
       }
+    }
+    charge_send(data, data->served - served);
 
-      data->res_buf_used += count;
-      data->res_buf[data->res_buf_used] = '\0';
-
-      if (!(*state & RESPONSE_HEADER_RECEIVED) &&
-          (strstr(data->res_buf, "\r\n\r\n") != NULL)) {
-        if (parse_response_header(data) < 0) {
-          perror("parse_response_header");
-          cleanup_and_close(data, epoll_fd);
-          return -1;
-        }
-        *state |= RESPONSE_HEADER_RECEIVED;
-      }
-      if (*state & RESPONSE_HEADER_RECEIVED) {
-        if (data->content_type & CHUNKED) {
-          if (strstr(data->res_buf, "\r\n0\r\n\r\n") != NULL) {
-            *state &= ~REQUEST_SENT;
-            *state |= RESPONSE_RECEIVED;
-          }
-        } else if (data->content_type & CONTENT_LENGTH) {
-          if (data->res_buf_used ==
-              (data->content_length + data->header_length)) {
-            *state &= ~REQUEST_SENT;
-            *state |= RESPONSE_RECEIVED;
-          } else {
-            DEBUG_PRINT(
-                "content_length: %i, header_length: %i, res_buf_used: %i\n",
-                data->content_length, data->header_length, data->res_buf_used);
-          }
-        } else {
-          *state &= ~REQUEST_SENT;
-          *state |= RESPONSE_RECEIVED;
-        }
-
-        if (*state & RESPONSE_RECEIVED) {
-          // response all recved, watch output readiness from client
-          struct epoll_event client_event;
-          client_event.events = EPOLLOUT | EPOLLET;
-          client_event.data.ptr = data->client_fd_data;
-          if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->client_fd,
-                        &client_event) == -1) {
-            perror("epoll_ctl");
-            cleanup_and_close(data, epoll_fd);
-            return -1;
-          }
-          break;
-        }
+    if ((*state & RESPONSE_RECEIVED) && !(*state & CACHE_HIT) &&
+        data->res_buf_start == data->res_buf_used && data->piped == 0) {
+      *state &= ~RESPONSE_RECEIVED;
+      *state |= RESPONSE_SENT;
+      log_transaction(data, data->response_complete);
+      if (data->response_complete) {
+        stats_record(data->marks);
+      } else {
+        memset(data->marks, 0, sizeof(data->marks));
       }
-      DEBUG_PRINT("Received %ld bytes from server\n", count);
-    } else
+      release_pipe(data);
+      release_server(data);
+      if (data->client_keepalive) {
+        return next_transaction(data);
+      }
+      cleanup_and_close(data, epoll_fd);
+      return 0;
+    }
+
+    if (!progress) {
       break;
+    }
+    data->active = timer_now();
   }
   return 0;
 }
 
-void parse_request(proxy_data_t *data) {
-  // check if the request is GET
-  // check if the request is HTTP/1.0
-  if (strncmp(data->req_buf, "GET", 3) != 0 ||
-      strstr(data->req_buf, "HTTP/1.0") == NULL) {
-    data->host_entry = NULL;
-    return;
+// An IPv6 literal comes in brackets, which the resolver does not take.
+static void strip_brackets(char *host) {
+  size_t len = strlen(host);
+  if (len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+    memmove(host, host + 1, len - 2);
+    host[len - 2] = '\0';
   }
+}
 
-  // check if the request has Host header
-  char *host = strstr(data->req_buf, "Host: ");
-  if (host == NULL) {
-    data->host_entry = NULL;
-    return;
+// The target of a CONNECT is the origin itself, host and port, and the
+// tunnel ends the client connection.
+static int parse_authority(proxy_data_t *data, const char *target,
+                           uint32_t len) {
+  const char *colon = memrchr(target, ':', len);
+  if (colon == NULL || colon == target || colon - target >= RESOLVER_HOST_MAX ||
+      memchr(target, '/', len) != NULL) {
+    return -1;
+  }
+  char *end;
+  long port = strtol(colon + 1, &end, 10);
+  if (end != target + len || colon + 1 == end || port <= 0 || port > 65535) {
+    return -1;
+  }
+  memcpy(data->host, target, colon - target);
+  data->host[colon - target] = '\0';
+  strip_brackets(data->host);
+  data->port = port;
+  data->client_http11 = data->req_buf[data->req_parser.start_line_len - 1] ==
+                        '1';
+  data->client_keepalive = 0;
+  data->state |= TUNNEL;
+  return 0;
+}
+
+int parse_request(proxy_data_t *data) {
+  http_parser_t *parser = &data->req_parser;
+  const char *line = data->req_buf;
+  uint32_t line_len = parser->start_line_len;
+
+  // check if the request is GET, or CONNECT for a tunnel
+  // check if the request is HTTP/1.0 or HTTP/1.1
+  int tunnel = line_len >= 18 && memcmp(line, "CONNECT ", 8) == 0;
+  if (line_len < 14 || (!tunnel && memcmp(line, "GET ", 4) != 0) ||
+      memcmp(line + line_len - 9, " HTTP/1.", 8) != 0 ||
+      (line[line_len - 1] != '0' && line[line_len - 1] != '1')) {
+    return -1;
+  }
+  const char *target = line + (tunnel ? 8 : 4);
+  uint32_t target_len = line_len - (tunnel ? 17 : 13);
+  data->target_len = target_len;
+  if (tunnel) {
+    return parse_authority(data, target, target_len);
   }
 
-  // check if the host is valid
-  host += 6;
-  char *end = strstr(host, "\r\n");
-  if (end == NULL) {
-    data->host_entry = NULL;
-    return;
+  // only HTTP/1.1 clients keep the connection; a 1.0 client would need
+  // every response rewritten to announce it
+  size_t len;
+  const char *connection =
+      http_header(parser, data->req_buf, "Connection", &len);
+  if (connection == NULL) {
+    connection = http_header(parser, data->req_buf, "Proxy-Connection", &len);
+  }
+  data->client_http11 = line[line_len - 1] == '1';
+  data->client_keepalive = data->client_http11 &&
+                           (connection == NULL ||
+                            !has_token(connection, len, "close"));
+
+  // check if the request has exactly one valid Host header
+  const char *host = http_header(parser, data->req_buf, "Host", &len);
+  if (host == NULL || len == 0 || len >= RESOLVER_HOST_MAX ||
+      http_header_count(parser, data->req_buf, "Host") > 1) {
+    return -1;
   }
-  *end = '\0';
+  memcpy(data->host, host, len);
+  data->host[len] = '\0';
+  host = data->host;
 
-  char *uri_host_start = strstr(data->req_buf, "http://");
-  if (uri_host_start != NULL) {
-    uri_host_start += 7;
-    char *uri_host_end = strchr(uri_host_start, ' ');
-    char *uri_host_end_tmp = strchr(uri_host_start, '/');
-    if (uri_host_end_tmp != NULL && uri_host_end_tmp < uri_host_end)
-      uri_host_end = uri_host_end_tmp;
+  if (target_len > 7 && strncasecmp(target, "http://", 7) == 0) {
+    const char *uri_host_start = target + 7;
+    const char *uri_host_end = target + target_len;
+    const char *slash =
+        memchr(uri_host_start, '/', uri_host_end - uri_host_start);
+    if (slash != NULL) uri_host_end = slash;
 
     int uri_host_len = uri_host_end - uri_host_start;
-    char uri_host[uri_host_len + 1];
-    uri_host[uri_host_len] = '\0';
-    strncpy(uri_host, uri_host_start, uri_host_len);
-    if (strcmp(uri_host, host) != 0) {
-      DEBUG_PRINT("uri_host: %s, host: %s\n", uri_host, host);
-      data->host_entry = NULL;
-      return;
+    if ((size_t)uri_host_len != strlen(host) ||
+        strncasecmp(uri_host_start, host, uri_host_len) != 0) {
+      DEBUG_PRINT("uri_host: %.*s, host: %s\n", uri_host_len, uri_host_start,
+                  host);
+      return -1;
     }
 
     // if host is in blacklist, then change the whole request message to
     // www.warning.or.kr
-    uri_host_start -= 7;
-    int uri_len = uri_host_end - uri_host_start;
-    char uri[uri_len + 1];
-    uri[uri_len] = '\0';
-    strncpy(uri, uri_host_start, uri_len);
-    if (is_blacklisted(uri, data->black_urls, data->black_urls_count)) {
+    if (blacklist_match(target, uri_host_end - target)) {
+      STAT_ADD(proxy_stats.blacklisted, 1);
       char *warning =
           "GET / HTTP/1.0\r\nHost: "
           "www.warning.or.kr\r\n\r\n";
-      char *host = "www.warning.or.kr";
       int warning_len = strlen(warning);
       if (warning_len > data->req_buf_capacity) {
-        data->req_buf = realloc(data->req_buf, warning_len + 1);
+        char *buf = realloc(data->req_buf, warning_len + 1);
+        if (buf == NULL) {
+          perror("realloc");
+          return -1;
+        }
+        data->req_buf = buf;
         data->req_buf_capacity = warning_len;
       }
       strncpy(data->req_buf, warning, warning_len);
       data->req_buf[warning_len] = '\0';
-      struct hostent *host_entry = gethostbyname(host);
-      data->host_entry = host_entry;
+      data->req_buf_used = warning_len;
+      // the parser's offsets and the target still describe the old request
+      http_parser_init(parser);
+      if (http_parse(parser, data->req_buf, data->req_buf_used) != 1) {
+        return -1;
+      }
+      data->target_len = parser->start_line_len - 13;
+      strcpy(data->host, "www.warning.or.kr");
       data->port = 80;
-      return;
+      return 0;
     }
   }
 
-  // find port
-  char *port = strstr(host, ":");
+  // find port, past the colons of an IPv6 literal
+  char *port = data->host;
+  if (*port == '[' && (port = strchr(port, ']')) == NULL) {
+    return -1;
+  }
+  port = strchr(port, ':');
   if (port != NULL) {
     *port = '\0';
     port++;
@@ -364,52 +2681,69 @@ void parse_request(proxy_data_t *data) {
   } else {
     data->port = 80;
   }
+  strip_brackets(data->host);
 
-  struct hostent *host_entry = gethostbyname(host);
-  *end = '\r';
-  data->host_entry = host_entry;
-
-  return;
+  return 0;
 }
 
 int parse_response_header(proxy_data_t *data) {
-  char *header_end = strstr(data->res_buf, "\r\n\r\n") + 4;
+  http_parser_t *parser = &data->res_parser;
+  const char *buf = data->res_buf;
+  size_t len;
+
   data->content_type = NONE;
+  data->header_length = parser->length;
+  if (parser->start_line_len < 12 || memcmp(buf, "HTTP/1.", 7) != 0) {
+    return -1;
+  }
 
-  char *content_length_header = strstr(data->res_buf, "Content-Length:");
-  if (content_length_header != NULL) {
-    if (content_length_header != NULL) {
-      char *start = content_length_header + strlen("Content-Length:");
-      char *end;
-      data->content_length = strtol(start, &end, 10);
-      if (start == end) {
-        // Error: Content-Length value is missing or invalid
-        return -1;
-      }
+  // a second length could frame the body differently for someone else
+  const char *value = http_header(parser, buf, "Content-Length", &len);
+  if (value != NULL) {
+    char *end;
+    if (*value < '0' || *value > '9' ||
+        http_header_count(parser, buf, "Content-Length") > 1) {
+      return -1;
+    }
+    data->content_length = strtoull(value, &end, 10);
+    if (end != value + len) {
+      // Error: Content-Length value is missing or invalid
+      return -1;
     }
     data->content_type = CONTENT_LENGTH;
-    DEBUG_PRINT("Content-Length: %i\n", data->content_length);
+    DEBUG_PRINT("Content-Length: %lu\n", data->content_length);
   }
 
-  char *transfer_encoding_header = strstr(data->res_buf, "Transfer-Encoding:");
-  if (transfer_encoding_header != NULL &&
-      strstr(transfer_encoding_header, "chunked") != NULL) {
+  value = http_header(parser, buf, "Transfer-Encoding", &len);
+  if (value != NULL && has_token(value, len, "chunked")) {
     data->content_type = CHUNKED;
   }
 
+  // these never carry a body, whatever their headers say
+  int status = atoi(buf + 9);
+  data->status = status;
+  if (status == 204 || status == 304) {
+    data->content_type = CONTENT_LENGTH;
+    data->content_length = 0;
+  }
+
   DEBUG_PRINT("Content Type : %i\n", data->content_type);
 
-  data->header_length = header_end - data->res_buf;
+  // the connection outlives the response only if the end of the body can
+  // be told without the origin closing it
+  const char *connection = http_header(parser, buf, "Connection", &len);
+  if (buf[7] == '1') {
+    data->upstream_keepalive =
+        connection == NULL || !has_token(connection, len, "close");
+  } else {
+    data->upstream_keepalive =
+        connection != NULL && has_token(connection, len, "keep-alive");
+  }
+  if (data->content_type == NONE ||
+      (data->content_type == CHUNKED &&
+       http_header(parser, buf, "Content-Length", &len) != NULL)) {
+    data->upstream_keepalive = 0;
+  }
 
   return 0;
 }
-
-int is_blacklisted(char *url, char **black_urls, int black_urls_count) {
-  for (int i = 0; i < black_urls_count; i++) {
-    DEBUG_PRINT("url: %s, black_url: %s\n", url, black_urls[i]);
-    if (strstr(url, black_urls[i]) != NULL) {
-      return 1;
-    }
-  }
-  return 0;
-}
\ No newline at end of file
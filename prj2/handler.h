@@ -5,11 +5,44 @@
 #include <string.h>
 #include <sys/epoll.h>
 
+#include "access_log.h"
+#include "blacklist.h"
+#include "cache.h"
+#include "collapse.h"
 #include "common.h"
+#include "disk_cache.h"
+#include "http.h"
+#include "pipe_pool.h"
+#include "pool.h"
+#include "resolver.h"
+#include "stats.h"
+#include "timer.h"
 #include "utils.h"
 
 #define DELTA 1024
-#define CHUNK_SIZE 4096 * 2
+#define REQUEST_BUF_SIZE (8 * 1024)  // initial size, doubled as needed
+#define CONN_BLOCKS_PER_PAGE 64
+
+// responses are relayed through a fixed buffer; upstream reads pause at the
+// high watermark and resume once the client has drained to the low one
+#define RELAY_BUF_SIZE (64 * 1024)
+#define RELAY_HIGH_WATERMARK (48 * 1024)
+#define RELAY_LOW_WATERMARK (16 * 1024)
+
+// bodies the cache does not keep go through a pipe instead, unless they are
+// known to be too small to be worth the extra system calls
+#define SPLICE_MIN_BODY (64 * 1024)
+
+// deadlines, in milliseconds
+#define CONNECT_TIMEOUT 5000  // resolving the origin and connecting to it
+#define HEADER_TIMEOUT 30000  // from then until the response header is in
+#define IDLE_TIMEOUT 30000    // no bytes moving, or no request yet
+#define TRANSFER_TIMEOUT (10 * 60 * 1000)  // one whole transaction
+#define TUNNEL_IDLE_TIMEOUT (5 * 60 * 1000)  // an established CONNECT tunnel
+
+// the next origin address is tried this long after the last attempt started,
+// unless that one fails sooner (RFC 8305 recommends 250 ms)
+#define CONNECT_ATTEMPT_DELAY 250
 
 typedef enum {
   REQUEST_NOT_RECEIVED = 0x001,
@@ -18,8 +51,21 @@ typedef enum {
   RESPONSE_RECEIVED = 0x008,
   RESPONSE_HEADER_RECEIVED = 0x010,
   RESPONSE_SENT = 0x020,
+  UPSTREAM_PAUSED = 0x040,
+  UPSTREAM_BLOCKED = 0x080,
   CLIENT_OPEN = 0x100,
   SERVER_OPEN = 0x200,
+  CLIENT_BLOCKED = 0x400,
+  CLOSED = 0x800,
+  RESOLVING = 0x1000,
+  CACHE_HIT = 0x2000,
+  CONNECTING = 0x4000,
+  // a CONNECT request, relayed both ways without parsing once established
+  TUNNEL = 0x8000,
+  CLIENT_IDLE = 0x10000,     // nothing to read from the client for now
+  SERVER_BLOCKED = 0x20000,  // the origin takes no more for now
+  CLIENT_EOF = 0x40000,      // the client is done sending
+  SERVER_EOF = 0x80000,      // the origin is done sending
 } state_t;
 
 typedef enum {
@@ -29,38 +75,115 @@ typedef enum {
 } content_type_t;
 
 typedef struct fd_data_t fd_data_t;
+typedef struct proxy_data_t proxy_data_t;
 
+// One piece of a hit sent in ranges: its header text in the relay buffer,
+// then a span of the stored object.
 typedef struct {
+  uint32_t text_end;  // the text runs up to here
+  uint64_t start;     // object bytes still to send
+  uint64_t end;
+} range_part_t;
+
+struct fd_data_t {
+  int fd;
+  proxy_data_t *data;
+};
+
+struct proxy_data_t {
   int client_fd;
   int server_fd;
-  char **black_urls;
-  int black_urls_count;
   fd_data_t *client_fd_data;
   fd_data_t *server_fd_data;
   state_t state;
   content_type_t content_type;
-  struct hostent *host_entry;
+  int epoll_fd;
+  struct sockaddr_in client_addr;
+  char host[RESOLVER_HOST_MAX];
   int port;
+  resolve_result_t origin_addrs;  // with the port, in the order to try them
+  int next_addr;                  // the first one no attempt went to yet
+  fd_data_t attempts[RESOLVER_MAX_ADDRS];  // connects racing, by address
+  int attempts_open;
+  uint64_t attempt_start;     // of the latest one
+  resolve_addr_t server_addr;  // the one connected to
+  int server_reused;       // the upstream connection came from the pool
+  int upstream_keepalive;  // it can go back there once the response is done
+  int client_keepalive;    // the client connection outlives this transaction
+  int response_complete;  // the origin sent all its framing promised
+  int client_http11;
+  uint32_t target_len;  // of the request target, after the method
+  int status;           // of the response, once known
+  uint64_t served;      // response bytes sent to the client
+  access_result_t result;
   uint32_t bytes_sent;
   uint32_t header_length;
-  uint32_t content_length;
+  uint64_t content_length;
+  uint64_t body_received;
+  http_chunked_t chunked;
+  int dechunk;  // chunked framing is removed for the client
   char *req_buf;
   uint32_t req_buf_used;
   uint32_t req_buf_capacity;
+  char *pipelined;  // requests that arrived behind the current one
+  uint32_t pipelined_used;
+  http_parser_t req_parser;
   char *res_buf;
   uint32_t res_buf_used;
   uint32_t res_buf_capacity;
-} proxy_data_t;
-
-struct fd_data_t {
-  int fd;
-  proxy_data_t *data;
+  uint32_t res_buf_start;
+  http_parser_t res_parser;
+  relay_pipe_t *pipe;  // the body is being spliced through it
+  uint32_t piped;      // bytes in the pipe not yet sent to the client
+  relay_pipe_t *up_pipe;  // a tunnel's other direction, client to origin
+  uint32_t up_piped;
+  struct prefetch_page_t *page;  // an HTML page scanned for its links
+  int prefetch;                  // the request is the prefetcher's
+  struct compressor_t *gzip;     // the body is gzip encoded on its way
+  int accepts_gzip;              // the client takes a gzip encoded body
+  char *cache_key;
+  int cache_policy;
+  cache_object_t *hit;
+  cache_cursor_t hit_cursor;
+  disk_hit_t disk_hit;
+  range_part_t *parts;  // a Range request is answered from hit in these
+  int part_count;
+  int part_next;  // the one being sent
+  cache_object_t *store;
+  // collapsed forwarding: a request for an object another client is
+  // fetching waits on that fetch and streams the object it stores
+  int leading;                // registered as the fetch for cache_key
+  proxy_data_t *followers;    // requests waiting on this fetch
+  proxy_data_t *leader;       // the fetch this request waits on
+  proxy_data_t *next_follower;
+  int following;        // hit is the leader's object, read by offset
+  uint64_t hit_offset;  // bytes of it sent so far
+  wheel_timer_t timer;
+  uint64_t started;      // the request came in
+  uint64_t phase_start;  // the wait on the origin began
+  uint64_t active;       // bytes last moved
+  uint64_t marks[MARK_COUNT];
+  // turns at sending to the client, taken in rounds with the worker's
+  // other connections
+  uint64_t deficit;          // bytes left of this one
+  uint64_t send_round;       // queued for this round
+  proxy_data_t *send_next;
+  proxy_data_t **send_pprev;  // NULL while not queued
+  uint64_t throttled_until;  // the address is out of tokens until then
+  proxy_data_t *next_closed;
 };
 
+proxy_data_t *alloc_proxy_data();
+proxy_data_t *open_client(int fd, const struct sockaddr_in *addr,
+                          int epoll_fd);
 void reset_proxy_data(proxy_data_t *fd_data);
 void cleanup_and_close(proxy_data_t *fd_data, int epoll_fd);
+void release_closed();
+void run_send_round();
+int send_round_pending();
+int next_transaction(proxy_data_t *data);
 int handle_client(proxy_data_t *data, struct epoll_event *event, int epoll_fd);
 int handle_server(proxy_data_t *data, struct epoll_event *event, int epoll_fd);
-void parse_request(proxy_data_t *data);
+int relay_response(proxy_data_t *data, int epoll_fd);
+int parse_request(proxy_data_t *data);
 int parse_response_header(proxy_data_t *data);
-int is_blacklisted(char *host, char **black_urls, int black_urls_count);
\ No newline at end of file
@@ -0,0 +1,301 @@
+#include "http.h"
+
+#include <string.h>
+#include <strings.h>
+
+// Lines are found with memchr, which glibc vectorizes, and the colon of a
+// header with a second memchr bounded by the line; nothing is rescanned
+// when more data arrives.
+
+void http_parser_init(http_parser_t *parser) {
+  parser->pos = 0;
+  parser->line_start = 0;
+  parser->start_line_len = 0;
+  parser->length = 0;
+  parser->count = 0;
+}
+
+static int is_token_char(char c) {
+  return c > ' ' && c < 0x7f && !strchr("\"(),/:;<=>?@[\\]{}", c);
+}
+
+// Record one header line; line excludes the CRLF.
+static int add_header(http_parser_t *parser, const char *buf, uint32_t line,
+                      uint32_t line_len) {
+  const char *start = buf + line;
+  const char *colon = memchr(start, ':', line_len);
+
+  // no name, whitespace before the colon or folded continuation lines
+  if (colon == NULL || colon == start) {
+    return -1;
+  }
+  for (const char *p = start; p < colon; p++) {
+    if (!is_token_char(*p)) {
+      return -1;
+    }
+  }
+  if (parser->count == HTTP_MAX_HEADERS) {
+    return -1;
+  }
+
+  const char *value = colon + 1;
+  const char *end = start + line_len;
+  while (value < end && (*value == ' ' || *value == '\t')) value++;
+  while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+
+  http_header_t *header = &parser->headers[parser->count++];
+  header->name = line;
+  header->name_len = colon - start;
+  header->value = value - buf;
+  header->value_len = end - value;
+  return 0;
+}
+
+// Scan buf[0, len) from where the last call stopped. Returns 1 once the
+// empty line ending the header block has been seen, 0 when more data is
+// needed and -1 for a malformed or oversized block.
+int http_parse(http_parser_t *parser, const char *buf, uint32_t len) {
+  if (parser->length > 0) {
+    return 1;
+  }
+
+  while (parser->pos < len) {
+    const char *nl = memchr(buf + parser->pos, '\n', len - parser->pos);
+    if (nl == NULL) {
+      parser->pos = len;
+      break;
+    }
+
+    uint32_t line = parser->line_start;
+    uint32_t next = nl - buf + 1;
+    if (next - line < 2 || nl[-1] != '\r') {
+      return -1;
+    }
+    uint32_t line_len = next - line - 2;
+
+    if (line == 0) {
+      if (line_len == 0) {
+        return -1;
+      }
+      parser->start_line_len = line_len;
+    } else if (line_len == 0) {
+      parser->length = next;
+      parser->pos = next;
+      return 1;
+    } else if (add_header(parser, buf, line, line_len) < 0) {
+      return -1;
+    }
+    parser->line_start = next;
+    parser->pos = next;
+  }
+
+  return parser->pos >= HTTP_MAX_HEADER_BYTES ? -1 : 0;
+}
+
+// Value of the first header called name, compared without regard to case.
+const char *http_header(const http_parser_t *parser, const char *buf,
+                        const char *name, size_t *value_len) {
+  size_t name_len = strlen(name);
+
+  for (int i = 0; i < parser->count; i++) {
+    const http_header_t *header = &parser->headers[i];
+    if (header->name_len == name_len &&
+        strncasecmp(buf + header->name, name, name_len) == 0) {
+      *value_len = header->value_len;
+      return buf + header->value;
+    }
+  }
+  return NULL;
+}
+
+int http_header_count(const http_parser_t *parser, const char *buf,
+                      const char *name) {
+  size_t name_len = strlen(name);
+  int n = 0;
+
+  for (int i = 0; i < parser->count; i++) {
+    const http_header_t *header = &parser->headers[i];
+    if (header->name_len == name_len &&
+        strncasecmp(buf + header->name, name, name_len) == 0) {
+      n++;
+    }
+  }
+  return n;
+}
+
+void http_chunked_init(http_chunked_t *chunked) {
+  chunked->state = CHUNK_SIZE;
+  chunked->digits = 0;
+  chunked->remaining = 0;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Run buf[0, len) through the chunk framing. Returns the number of bytes
+// that belong to the message, which is short of len only once the last
+// chunk and trailers are complete, or -1 if the framing is broken. With
+// decoded set, the chunk data is also moved to the front of buf and its
+// length stored there; framing and trailers are dropped.
+long http_chunked_feed(http_chunked_t *chunked, char *buf, size_t len,
+                       size_t *decoded) {
+  size_t i = 0, out = 0;
+
+  while (i < len && chunked->state != CHUNK_DONE) {
+    char c = buf[i];
+
+    switch (chunked->state) {
+      case CHUNK_SIZE:
+        if (hex_value(c) >= 0) {
+          // 15 digits keep the size well inside 64 bits
+          if (++chunked->digits > 15) return -1;
+          chunked->remaining = chunked->remaining * 16 + hex_value(c);
+        } else if (chunked->digits == 0) {
+          return -1;
+        } else if (c == '\r') {
+          chunked->state = CHUNK_SIZE_LF;
+        } else if (c == ';' || c == ' ' || c == '\t') {
+          chunked->state = CHUNK_EXTENSION;
+        } else {
+          return -1;
+        }
+        break;
+      case CHUNK_EXTENSION:
+        if (c == '\r') chunked->state = CHUNK_SIZE_LF;
+        break;
+      case CHUNK_SIZE_LF:
+        if (c != '\n') return -1;
+        chunked->state =
+            chunked->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        break;
+      case CHUNK_DATA: {
+        // the data itself is skipped, not scanned
+        size_t n = len - i;
+        if (n > chunked->remaining) n = chunked->remaining;
+        if (decoded != NULL) {
+          memmove(buf + out, buf + i, n);
+          out += n;
+        }
+        chunked->remaining -= n;
+        i += n;
+        if (chunked->remaining == 0) chunked->state = CHUNK_DATA_CR;
+        continue;
+      }
+      case CHUNK_DATA_CR:
+        if (c != '\r') return -1;
+        chunked->state = CHUNK_DATA_LF;
+        break;
+      case CHUNK_DATA_LF:
+        if (c != '\n') return -1;
+        chunked->state = CHUNK_SIZE;
+        chunked->digits = 0;
+        break;
+      case CHUNK_TRAILER:
+        chunked->state = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+        break;
+      case CHUNK_TRAILER_LINE:
+        if (c == '\r') chunked->state = CHUNK_TRAILER_LF;
+        break;
+      case CHUNK_TRAILER_LF:
+        if (c != '\n') return -1;
+        chunked->state = CHUNK_TRAILER;
+        break;
+      case CHUNK_END_LF:
+        if (c != '\n') return -1;
+        chunked->state = CHUNK_DONE;
+        break;
+      case CHUNK_DONE:
+        break;
+    }
+    i++;
+  }
+
+  if (decoded != NULL) {
+    *decoded = out;
+  }
+  return i;
+}
+
+// Read the decimal number at *p, if there is one. Returns -1 if not.
+static int range_number(const char **p, const char *end, uint64_t *n) {
+  const char *start = *p;
+  *n = 0;
+  while (*p < end && **p >= '0' && **p <= '9') {
+    // 18 digits keep the number well inside 64 bits
+    if (*p - start == 18) return -1;
+    *n = *n * 10 + (**p - '0');
+    (*p)++;
+  }
+  return *p == start ? -1 : 0;
+}
+
+// Resolve a Range header value against a representation of size bytes.
+// Overlapping and adjacent ranges are merged, in order of position.
+// Returns how many are left in ranges, 0 if the header is malformed or
+// asks for more than max pieces and so is ignored, and -1 if none of the
+// ranges it names overlaps the representation.
+int http_parse_range(const char *value, size_t len, uint64_t size,
+                     http_range_t *ranges, int max) {
+  const char *p = value, *end = value + len;
+  int specs = 0, n = 0;
+
+  if (len < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+    return 0;
+  }
+  p += 6;
+  while (p < end) {
+    uint64_t first, last;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    if (p == end) break;
+    if (++specs > max) return 0;
+
+    if (*p == '-') {
+      // the final so many bytes
+      p++;
+      if (range_number(&p, end, &last) < 0) return 0;
+      if (last == 0 || size == 0) continue;
+      first = last >= size ? 0 : size - last;
+      last = size - 1;
+    } else {
+      if (range_number(&p, end, &first) < 0 || p == end || *p++ != '-') {
+        return 0;
+      }
+      last = UINT64_MAX;
+      if (p < end && *p >= '0' && *p <= '9' &&
+          (range_number(&p, end, &last) < 0 || last < first)) {
+        return 0;
+      }
+      if (first >= size) continue;
+      if (last >= size) last = size - 1;
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p < end && *p != ',') return 0;
+
+    // insertion by position, merging with what it touches
+    int i = n;
+    while (i > 0 && ranges[i - 1].first > first) i--;
+    memmove(ranges + i + 1, ranges + i, (n - i) * sizeof(http_range_t));
+    ranges[i].first = first;
+    ranges[i].last = last;
+    n++;
+    if (i > 0) i--;
+    while (i + 1 < n) {
+      if (ranges[i + 1].first > ranges[i].last + 1) {
+        i++;
+        continue;
+      }
+      if (ranges[i + 1].last > ranges[i].last) {
+        ranges[i].last = ranges[i + 1].last;
+      }
+      memmove(ranges + i + 1, ranges + i + 2,
+              (n - i - 2) * sizeof(http_range_t));
+      n--;
+    }
+  }
+  if (specs == 0) return 0;
+  return n > 0 ? n : -1;
+}
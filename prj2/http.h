@@ -0,0 +1,66 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Resumable parser for the header block of an HTTP/1.x message. Each call
+// picks up where the previous one stopped, so every byte is looked at once
+// however the block is split across reads. Fields are kept as offsets into
+// the caller's buffer, which may be reallocated between calls.
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_HEADER_BYTES (64 * 1024)
+
+typedef struct {
+  uint32_t name;
+  uint32_t name_len;
+  uint32_t value;  // surrounding whitespace trimmed
+  uint32_t value_len;
+} http_header_t;
+
+typedef struct {
+  uint32_t pos;         // first byte not yet scanned
+  uint32_t line_start;  // start of the line being scanned
+  uint32_t start_line_len;
+  uint32_t length;  // size of the whole block once complete
+  int count;
+  http_header_t headers[HTTP_MAX_HEADERS];
+} http_parser_t;
+
+// Chunked transfer coding, decoded one buffer at a time.
+typedef enum {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_SIZE_LF,
+  CHUNK_DATA,
+  CHUNK_DATA_CR,
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER,
+  CHUNK_TRAILER_LINE,
+  CHUNK_TRAILER_LF,
+  CHUNK_END_LF,
+  CHUNK_DONE,
+} chunk_state_t;
+
+typedef struct {
+  chunk_state_t state;
+  int digits;
+  uint64_t remaining;  // data bytes left in the current chunk
+} http_chunked_t;
+
+// One byte range of a representation, both ends included.
+#define HTTP_MAX_RANGES 16
+typedef struct {
+  uint64_t first;
+  uint64_t last;
+} http_range_t;
+
+void http_parser_init(http_parser_t *parser);
+int http_parse(http_parser_t *parser, const char *buf, uint32_t len);
+const char *http_header(const http_parser_t *parser, const char *buf,
+                        const char *name, size_t *value_len);
+int http_header_count(const http_parser_t *parser, const char *buf,
+                      const char *name);
+void http_chunked_init(http_chunked_t *chunked);
+long http_chunked_feed(http_chunked_t *chunked, char *buf, size_t len,
+                       size_t *decoded);
+int http_parse_range(const char *value, size_t len, uint64_t size,
+                     http_range_t *ranges, int max);
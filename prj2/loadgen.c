@@ -0,0 +1,545 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "utils.h"
+
+// HTTP load generator. Keeps a number of connections busy with GET requests
+// for one URL, straight to the origin or through a proxy, and reports the
+// request rate, throughput and latency percentiles. With -b it runs the
+// same load both ways, one after the other, so the proxy's cost shows.
+
+#define LOADGEN_MAX_EVENTS 256
+#define LOADGEN_MAX_THREADS 64
+#define LOADGEN_BUF_SIZE (64 * 1024)
+
+typedef enum {
+  FRAMING_LENGTH,
+  FRAMING_CHUNKED,
+  FRAMING_CLOSE,  // the body ends with the connection
+} framing_t;
+
+typedef struct {
+  int fd;
+  int connecting;
+  uint32_t sent;     // bytes of the request
+  uint64_t started;  // microseconds, when the request began
+  int header_done;
+  int reusable;  // the connection can carry the next request
+  framing_t framing;
+  uint64_t body_left;
+  http_chunked_t chunked;
+  http_parser_t parser;
+  uint32_t used;  // header bytes collected so far
+  char buf[LOADGEN_BUF_SIZE];
+} client_t;
+
+// what one thread measured
+typedef struct {
+  uint64_t requests;
+  uint64_t errors;   // failed connections and non-2xx/3xx answers
+  uint64_t bytes;
+  uint32_t *latencies;  // microseconds, one per request
+  uint64_t capacity;
+} result_t;
+
+typedef struct {
+  int conns;
+  result_t result;
+} worker_t;
+
+// every thread's results together, latencies sorted
+typedef struct {
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t bytes;
+  double elapsed;  // seconds
+  uint32_t *latencies;
+} summary_t;
+
+typedef struct {
+  struct sockaddr_in addr;  // the proxy or the origin
+  char request[2048];
+  size_t request_len;
+} target_t;
+
+static int connections = 16;
+static int threads = 1;
+static long long total = 10000;
+static double duration = 0;  // seconds; when set it bounds the run instead
+static int new_conn_each = 0;
+
+static const target_t *target;
+static long long issued;  // requests started so far, across threads
+static uint64_t deadline;
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int resolve(const char *host, int port, struct sockaddr_in *addr) {
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+    return -1;
+  }
+  *addr = *(struct sockaddr_in *)res->ai_addr;
+  addr->sin_port = htons(port);
+  freeaddrinfo(res);
+  return 0;
+}
+
+// Split host[:port] at the colon; port is left alone when there is none.
+static void split_host(char *host, int *port) {
+  char *colon = strchr(host, ':');
+  if (colon != NULL) {
+    *colon = '\0';
+    *port = atoi(colon + 1);
+  }
+}
+
+static int claim_request() {
+  if (duration > 0) {
+    return now_us() < deadline;
+  }
+  return __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED) < total;
+}
+
+static void add_latency(result_t *result, uint64_t us) {
+  if (result->requests == result->capacity) {
+    uint64_t capacity = result->capacity ? result->capacity * 2 : 65536;
+    uint32_t *latencies =
+        realloc(result->latencies, capacity * sizeof(uint32_t));
+    if (latencies == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    result->latencies = latencies;
+    result->capacity = capacity;
+  }
+  result->latencies[result->requests++] = us;
+}
+
+// Open a connection for the client, or -1 when none is wanted any more.
+static int open_conn(int epollfd, client_t *client) {
+  client->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (client->fd == -1) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  setnonblocking(client->fd);
+  int yes = 1;
+  setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  client->connecting = 1;
+  if (connect(client->fd, (struct sockaddr *)&target->addr,
+              sizeof(target->addr)) == 0) {
+    client->connecting = 0;
+  } else if (errno != EINPROGRESS) {
+    close(client->fd);
+    return -1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = client;
+  epoll_ctl(epollfd, EPOLL_CTL_ADD, client->fd, &ev);
+  return 0;
+}
+
+static void close_conn(int epollfd, client_t *client) {
+  epoll_ctl(epollfd, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+  client->fd = -1;
+}
+
+// Begin the next request on the client, over a new connection unless the
+// last one can be reused. Returns 0 once the run needs no more from it.
+static int next_request(int epollfd, client_t *client, result_t *result) {
+  if (!claim_request()) {
+    if (client->fd != -1) {
+      close_conn(epollfd, client);
+    }
+    return 0;
+  }
+  client->started = now_us();
+  client->sent = 0;
+  client->used = 0;
+  client->header_done = 0;
+  http_parser_init(&client->parser);
+  if (client->fd == -1) {
+    while (open_conn(epollfd, client) < 0) {
+      result->errors++;
+      if (!claim_request()) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// The response just ended. Returns 0 once the client is done.
+static int finish_request(int epollfd, client_t *client, result_t *result,
+                          int ok) {
+  if (ok) {
+    add_latency(result, now_us() - client->started);
+  } else {
+    result->errors++;
+  }
+  if (!ok || !client->reusable || new_conn_each) {
+    close_conn(epollfd, client);
+  }
+  return next_request(epollfd, client, result);
+}
+
+static int read_header(client_t *client) {
+  int parsed = http_parse(&client->parser, client->buf, client->used);
+  if (parsed <= 0) {
+    return parsed;
+  }
+  const char *buf = client->buf;
+  const http_parser_t *parser = &client->parser;
+  size_t len;
+
+  client->header_done = 1;
+  int status = atoi(buf + 9);
+  const char *connection = http_header(parser, buf, "Connection", &len);
+  client->reusable = buf[7] == '1' ? connection == NULL ||
+                                         !has_token(connection, len, "close")
+                                   : connection != NULL &&
+                                         has_token(connection, len,
+                                                   "keep-alive");
+  const char *value = http_header(parser, buf, "Transfer-Encoding", &len);
+  if (value != NULL && has_token(value, len, "chunked")) {
+    client->framing = FRAMING_CHUNKED;
+    http_chunked_init(&client->chunked);
+  } else if ((value = http_header(parser, buf, "Content-Length", &len)) !=
+             NULL) {
+    client->framing = FRAMING_LENGTH;
+    client->body_left = strtoull(value, NULL, 10);
+  } else {
+    client->framing = FRAMING_CLOSE;
+    client->reusable = 0;
+  }
+  return status >= 200 && status < 400 ? 1 : -1;
+}
+
+// Account for body bytes; returns 1 once the body is complete.
+static int read_body(client_t *client, char *buf, size_t len) {
+  if (client->framing == FRAMING_LENGTH) {
+    client->body_left -= len < client->body_left ? len : client->body_left;
+    return client->body_left == 0;
+  }
+  if (client->framing == FRAMING_CHUNKED) {
+    if (http_chunked_feed(&client->chunked, buf, len, NULL) < 0) {
+      return -1;
+    }
+    return client->chunked.state == CHUNK_DONE;
+  }
+  return 0;
+}
+
+// Drive the client as far as its socket allows, given the events epoll
+// reported for it. Returns 0 once it is done.
+static int handle_client(int epollfd, client_t *client, uint32_t events,
+                         result_t *result) {
+  int fd = client->fd;
+  while (1) {
+    if (client->fd != fd) {
+      // a connection opened for the next request has had no events yet
+      fd = client->fd;
+      events = 0;
+    }
+    if (client->connecting) {
+      // SO_ERROR reads 0 while the connect is still going, so only its
+      // first writable (or failed) event says it has finished
+      if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        return 1;
+      }
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err != 0) {
+        return finish_request(epollfd, client, result, 0);
+      }
+      client->connecting = 0;
+    }
+
+    if (client->sent < target->request_len) {
+      ssize_t count = send(client->fd, target->request + client->sent,
+                           target->request_len - client->sent, MSG_NOSIGNAL);
+      if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+      }
+      if (count <= 0) {
+        return finish_request(epollfd, client, result, 0);
+      }
+      client->sent += count;
+      continue;
+    }
+
+    uint32_t at = client->header_done ? 0 : client->used;
+    char *buf = client->buf + at;
+    size_t room = LOADGEN_BUF_SIZE - at;
+    if (room == 0) {
+      return finish_request(epollfd, client, result, 0);  // header too big
+    }
+    ssize_t count = recv(client->fd, buf, room, 0);
+    if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 1;
+    }
+    if (count <= 0) {
+      int ended = count == 0 && client->header_done &&
+                  client->framing == FRAMING_CLOSE;
+      client->reusable = 0;
+      return finish_request(epollfd, client, result, ended);
+    }
+    result->bytes += count;
+
+    int done;
+    if (client->header_done) {
+      done = read_body(client, buf, count);
+    } else {
+      client->used += count;
+      int header = read_header(client);
+      if (header == 0) {
+        continue;
+      }
+      done = read_body(client, client->buf + client->parser.length,
+                       client->used - client->parser.length);
+      if (header < 0 && done >= 0) {
+        done = -1;  // counted as an error once read
+        client->reusable = 0;
+      }
+    }
+    if (done != 0) {
+      if (!finish_request(epollfd, client, result, done > 0)) {
+        return 0;
+      }
+    }
+  }
+}
+
+static void *run_thread(void *arg) {
+  worker_t *worker = arg;
+  result_t *result = &worker->result;
+  int epollfd = epoll_create1(0);
+  client_t *clients = calloc(worker->conns, sizeof(client_t));
+  if (epollfd == -1 || clients == NULL) {
+    perror("loadgen");
+    exit(EXIT_FAILURE);
+  }
+
+  int active = 0;
+  for (int i = 0; i < worker->conns; i++) {
+    clients[i].fd = -1;
+    active += next_request(epollfd, &clients[i], result);
+  }
+  struct epoll_event events[LOADGEN_MAX_EVENTS];
+  while (active > 0) {
+    int n = epoll_wait(epollfd, events, LOADGEN_MAX_EVENTS, -1);
+    for (int i = 0; i < n; i++) {
+      client_t *client = events[i].data.ptr;
+      // a client finished earlier in the batch has nothing left to do
+      if (client->fd != -1 &&
+          !handle_client(epollfd, client, events[i].events, result)) {
+        active--;
+      }
+    }
+  }
+  close(epollfd);
+  free(clients);
+  return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const summary_t *summary, double p) {
+  if (summary->requests == 0) {
+    return 0;
+  }
+  uint64_t i = (uint64_t)(p * (summary->requests - 1) + 0.5);
+  return summary->latencies[i] / 1000.0;
+}
+
+// Run the whole load against one target and gather every thread's share.
+static void run_load(const target_t *t, summary_t *summary) {
+  worker_t workers[LOADGEN_MAX_THREADS];
+  pthread_t tids[LOADGEN_MAX_THREADS];
+
+  target = t;
+  issued = 0;
+  uint64_t start = now_us();
+  deadline = start + (uint64_t)(duration * 1000000);
+  for (int i = 0; i < threads; i++) {
+    memset(&workers[i], 0, sizeof(worker_t));
+    workers[i].conns = connections / threads + (i < connections % threads);
+    if (pthread_create(&tids[i], NULL, run_thread, &workers[i]) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memset(summary, 0, sizeof(summary_t));
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+    summary->requests += workers[i].result.requests;
+    summary->errors += workers[i].result.errors;
+    summary->bytes += workers[i].result.bytes;
+  }
+  summary->elapsed = (now_us() - start) / 1000000.0;
+
+  summary->latencies = malloc((summary->requests + 1) * sizeof(uint32_t));
+  if (summary->latencies == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t at = 0;
+  for (int i = 0; i < threads; i++) {
+    result_t *result = &workers[i].result;
+    memcpy(summary->latencies + at, result->latencies,
+           result->requests * sizeof(uint32_t));
+    at += result->requests;
+    free(result->latencies);
+  }
+  qsort(summary->latencies, summary->requests, sizeof(uint32_t),
+        compare_latency);
+}
+
+static void print_summary(const char *label, const summary_t *summary) {
+  printf("%s: %lu requests in %.2f s, %lu errors\n", label, summary->requests,
+         summary->elapsed, summary->errors);
+  printf("  %.1f req/s, %.2f MB/s\n", summary->requests / summary->elapsed,
+         summary->bytes / summary->elapsed / (1024 * 1024));
+  printf("  latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+         percentile(summary, 0.5), percentile(summary, 0.9),
+         percentile(summary, 0.99), percentile(summary, 1));
+}
+
+// The request for url, in origin form for a direct target and in absolute
+// form for a proxy.
+static void build_target(const char *url, const char *proxy, target_t *t) {
+  char host[256];
+  const char *rest = url;
+  if (strncasecmp(rest, "http://", 7) == 0) {
+    rest += 7;
+  }
+  size_t host_len = strcspn(rest, "/");
+  if (host_len == 0 || host_len >= sizeof(host)) {
+    fprintf(stderr, "Invalid URL %s\n", url);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(host, rest, host_len);
+  host[host_len] = '\0';
+  const char *path = rest[host_len] != '\0' ? rest + host_len : "/";
+
+  int len = snprintf(t->request, sizeof(t->request),
+                     "GET %s%s%s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                     proxy != NULL ? "http://" : "", proxy != NULL ? host : "",
+                     path, host, new_conn_each ? "Connection: close\r\n" : "");
+  if (len >= (int)sizeof(t->request)) {
+    fprintf(stderr, "URL too long\n");
+    exit(EXIT_FAILURE);
+  }
+  t->request_len = len;
+
+  char name[256];
+  int port = 80;
+  snprintf(name, sizeof(name), "%s", proxy != NULL ? proxy : host);
+  split_host(name, &port);
+  if (resolve(name, port, &t->addr) < 0) {
+    fprintf(stderr, "Cannot resolve %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  const char *proxy = NULL;
+  int both = 0;
+  const char *usage =
+      "usage: %s [-c connections] [-n requests | -d seconds] "
+      "[-t threads] [-x proxy_host:port [-b]] [-k] <url>\n"
+      "  -b run direct and then through the proxy, -k a new connection "
+      "per request\n";
+
+  while ((opt = getopt(argc, argv, "c:n:d:t:x:bk")) != -1) {
+    switch (opt) {
+      case 'c':
+        connections = atoi(optarg);
+        break;
+      case 'n':
+        total = atoll(optarg);
+        break;
+      case 'd':
+        duration = atof(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        if (threads <= 0 || threads > LOADGEN_MAX_THREADS) {
+          fprintf(stderr, "Invalid number of threads\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'x':
+        proxy = optarg;
+        break;
+      case 'b':
+        both = 1;
+        break;
+      case 'k':
+        new_conn_each = 1;
+        break;
+      default:
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1 || connections < threads || (both && !proxy)) {
+    fprintf(stderr, usage, argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  target_t direct, proxied;
+  summary_t first = {0}, second = {0};
+  if (proxy == NULL || both) {
+    build_target(argv[optind], NULL, &direct);
+    run_load(&direct, &first);
+    print_summary("direct", &first);
+  }
+  if (proxy != NULL) {
+    build_target(argv[optind], proxy, &proxied);
+    run_load(&proxied, &second);
+    print_summary("proxy", &second);
+  }
+  if (both) {
+    printf("proxy adds: p50 %+.3f ms  p99 %+.3f ms",
+           percentile(&second, 0.5) - percentile(&first, 0.5),
+           percentile(&second, 0.99) - percentile(&first, 0.99));
+    // no rate to compare with when nothing went through direct
+    if (first.requests > 0) {
+      printf(", %+.1f%% req/s", 100.0 * (second.requests / second.elapsed) /
+                                        (first.requests / first.elapsed) -
+                                    100.0);
+    }
+    printf("\n");
+  }
+  return first.errors + second.errors != 0;
+}
@@ -0,0 +1,477 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "utils.h"
+
+// Origin server for measuring the proxy without the internet. Every
+// response body is generated, shaped by the query of the request target:
+//
+//   GET /anything?size=65536&delay=20&chunked=1&close=1&max_age=60
+//
+// size is the body length, delay milliseconds before the response starts,
+// chunked sends the body in chunks of ORIGIN_CHUNK bytes, close ends the
+// connection after the response instead of keeping it and max_age makes
+// the response cacheable. Missing ones take the command line defaults.
+
+#define ORIGIN_MAX_EVENTS 256
+#define ORIGIN_BACKLOG 1024
+#define ORIGIN_MAX_WORKERS 64
+#define ORIGIN_REQUEST_MAX 8192
+#define ORIGIN_CHUNK (16 * 1024)
+#define ORIGIN_PATTERN_SIZE (256 * 1024)
+#define ORIGIN_PATTERN_PERIOD 832  // 26 letters in lines of 64
+
+typedef struct {
+  uint64_t size;
+  long delay;
+  int chunked;
+  int close;
+  long max_age;
+  int unframed;  // chunked for HTTP/1.0: the body ends with the connection
+} shape_t;
+
+typedef enum {
+  READING,
+  WAITING,  // the delay before the response is running
+  WRITING,
+} conn_state_t;
+
+typedef struct conn_t {
+  int fd;
+  conn_state_t state;
+  shape_t shape;
+  char req[ORIGIN_REQUEST_MAX + 1];
+  uint32_t req_used;
+  http_parser_t parser;
+  uint64_t due;        // when a waiting response starts, in milliseconds
+  char head[256];      // status and header, or the framing of a chunk
+  uint32_t head_len;
+  uint32_t head_sent;
+  uint64_t data_left;  // body bytes of the current piece still to send
+  uint64_t body_left;  // body bytes not yet in a piece
+  int last_chunk;      // the terminating chunk has been queued
+  struct conn_t *prev_waiting;
+  struct conn_t *next_waiting;
+} conn_t;
+
+static shape_t defaults = {1024, 0, 0, 0, 0, 0};
+static int port;
+static int workers = 1;
+static char pattern[ORIGIN_PATTERN_SIZE];
+
+static __thread conn_t *waiting = NULL;
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Read name=value from the query of the request target, if it is there.
+static int query_value(const char *target, size_t len, const char *name,
+                       long long *value) {
+  const char *query = memchr(target, '?', len);
+  size_t name_len = strlen(name);
+
+  if (query == NULL) {
+    return 0;
+  }
+  const char *end = target + len;
+  const char *p = query + 1;
+  while (p < end) {
+    const char *amp = memchr(p, '&', end - p);
+    const char *stop = amp ? amp : end;
+    if ((size_t)(stop - p) > name_len && memcmp(p, name, name_len) == 0 &&
+        p[name_len] == '=') {
+      *value = strtoll(p + name_len + 1, NULL, 10);
+      return 1;
+    }
+    p = stop + 1;
+  }
+  return 0;
+}
+
+static void parse_shape(conn_t *conn) {
+  const char *line = conn->req;
+  const char *target = memchr(line, ' ', conn->parser.start_line_len);
+  size_t len = 0;
+  long long value;
+
+  conn->shape = defaults;
+  if (target == NULL) {
+    return;
+  }
+  target++;
+  const char *space =
+      memchr(target, ' ', conn->parser.start_line_len - (target - line));
+  len = space ? (size_t)(space - target) : 0;
+
+  if (query_value(target, len, "size", &value) && value >= 0) {
+    conn->shape.size = value;
+  }
+  if (query_value(target, len, "delay", &value) && value >= 0) {
+    conn->shape.delay = value;
+  }
+  if (query_value(target, len, "chunked", &value)) {
+    conn->shape.chunked = value != 0;
+  }
+  if (query_value(target, len, "close", &value)) {
+    conn->shape.close = value != 0;
+  }
+  if (query_value(target, len, "max_age", &value) && value >= 0) {
+    conn->shape.max_age = value;
+  }
+
+  // a client that asks to close is obliged
+  size_t value_len;
+  const char *connection =
+      http_header(&conn->parser, conn->req, "Connection", &value_len);
+  if (connection != NULL && has_token(connection, value_len, "close")) {
+    conn->shape.close = 1;
+  }
+  if (line[conn->parser.start_line_len - 1] == '0') {
+    conn->shape.close = 1;  // HTTP/1.0, which knows no chunks either
+    conn->shape.unframed = conn->shape.chunked;
+    conn->shape.chunked = 0;
+  }
+}
+
+static void start_response(conn_t *conn) {
+  shape_t *shape = &conn->shape;
+  char framing[64], cache[64];
+
+  if (shape->chunked) {
+    strcpy(framing, "Transfer-Encoding: chunked\r\n");
+  } else if (shape->unframed) {
+    framing[0] = '\0';
+  } else {
+    snprintf(framing, sizeof(framing), "Content-Length: %lu\r\n",
+             shape->size);
+  }
+  if (shape->max_age > 0) {
+    snprintf(cache, sizeof(cache), "Cache-Control: max-age=%ld\r\n",
+             shape->max_age);
+  } else {
+    strcpy(cache, "Cache-Control: no-store\r\n");
+  }
+  conn->head_len = snprintf(conn->head, sizeof(conn->head),
+                            "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                            "%s%s%s\r\n",
+                            framing, cache,
+                            shape->close ? "Connection: close\r\n" : "");
+  conn->head_sent = 0;
+  conn->data_left = 0;
+  conn->body_left = shape->size;
+  conn->last_chunk = 0;
+  conn->state = WRITING;
+}
+
+// Queue the framing and data of the next piece of the body. Returns 0 once
+// the whole response has been queued.
+static int next_piece(conn_t *conn) {
+  int first = conn->body_left == conn->shape.size;
+
+  if (!conn->shape.chunked) {
+    conn->data_left = conn->body_left;
+    conn->body_left = 0;
+    return conn->data_left > 0;
+  }
+  if (conn->body_left > 0) {
+    uint64_t n = conn->body_left < ORIGIN_CHUNK ? conn->body_left
+                                                : ORIGIN_CHUNK;
+    conn->head_len = snprintf(conn->head, sizeof(conn->head), "%s%lx\r\n",
+                              first ? "" : "\r\n", n);
+    conn->data_left = n;
+    conn->body_left -= n;
+  } else if (!conn->last_chunk) {
+    conn->head_len = snprintf(conn->head, sizeof(conn->head), "%s0\r\n\r\n",
+                              conn->shape.size == 0 ? "" : "\r\n");
+    conn->last_chunk = 1;
+  } else {
+    return 0;
+  }
+  conn->head_sent = 0;
+  return 1;
+}
+
+static void close_conn(int epollfd, conn_t *conn) {
+  if (conn->state == WAITING) {
+    if (conn->prev_waiting != NULL) {
+      conn->prev_waiting->next_waiting = conn->next_waiting;
+    } else {
+      waiting = conn->next_waiting;
+    }
+    if (conn->next_waiting != NULL) {
+      conn->next_waiting->prev_waiting = conn->prev_waiting;
+    }
+  }
+  epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  free(conn);
+}
+
+static void handle_conn(int epollfd, conn_t *conn);
+
+// Send as much of the response as the socket takes. Returns -1 once the
+// connection is closed, 1 when the response is done and 0 to wait.
+static int write_response(int epollfd, conn_t *conn) {
+  while (1) {
+    ssize_t count;
+    if (conn->head_sent < conn->head_len) {
+      // the framing goes out in one segment with the data behind it
+      int more = conn->data_left > 0 ? MSG_MORE : 0;
+      count = send(conn->fd, conn->head + conn->head_sent,
+                   conn->head_len - conn->head_sent, MSG_NOSIGNAL | more);
+      if (count > 0) conn->head_sent += count;
+    } else if (conn->data_left > 0) {
+      // the body reads the same however it is cut into chunks
+      uint64_t offset =
+          conn->shape.size - conn->body_left - conn->data_left;
+      size_t at = offset % ORIGIN_PATTERN_PERIOD;
+      size_t len = conn->data_left < ORIGIN_PATTERN_SIZE - at
+                       ? conn->data_left
+                       : ORIGIN_PATTERN_SIZE - at;
+      count = send(conn->fd, pattern + at, len, MSG_NOSIGNAL);
+      if (count > 0) conn->data_left -= count;
+    } else if (next_piece(conn)) {
+      continue;
+    } else {
+      return 1;
+    }
+    if (count == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      close_conn(epollfd, conn);
+      return -1;
+    }
+  }
+}
+
+static void respond(int epollfd, conn_t *conn) {
+  int ret = write_response(epollfd, conn);
+  if (ret <= 0) {
+    return;
+  }
+  if (conn->shape.close) {
+    close_conn(epollfd, conn);
+    return;
+  }
+  // a pipelined request may already be in the buffer
+  uint32_t length = conn->parser.length;
+  memmove(conn->req, conn->req + length, conn->req_used - length);
+  conn->req_used -= length;
+  http_parser_init(&conn->parser);
+  conn->state = READING;
+  handle_conn(epollfd, conn);
+}
+
+static void handle_conn(int epollfd, conn_t *conn) {
+  if (conn->state == WRITING) {
+    respond(epollfd, conn);
+    return;
+  }
+  while (conn->state == READING) {
+    int parsed = http_parse(&conn->parser, conn->req, conn->req_used);
+    if (parsed < 0) {
+      close_conn(epollfd, conn);
+      return;
+    }
+    if (parsed == 1) {
+      parse_shape(conn);
+      if (conn->shape.delay > 0) {
+        conn->state = WAITING;
+        conn->due = now_ms() + conn->shape.delay;
+        conn->prev_waiting = NULL;
+        conn->next_waiting = waiting;
+        if (waiting != NULL) waiting->prev_waiting = conn;
+        waiting = conn;
+        return;
+      }
+      start_response(conn);
+      respond(epollfd, conn);
+      return;
+    }
+    if (conn->req_used == ORIGIN_REQUEST_MAX) {
+      close_conn(epollfd, conn);
+      return;
+    }
+    ssize_t count = recv(conn->fd, conn->req + conn->req_used,
+                         ORIGIN_REQUEST_MAX - conn->req_used, 0);
+    if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (count <= 0) {
+      close_conn(epollfd, conn);
+      return;
+    }
+    conn->req_used += count;
+  }
+}
+
+// Start the responses whose delay is over; returns the milliseconds until
+// the next one is due, -1 when none is waiting.
+static int run_waiting(int epollfd) {
+  uint64_t now = now_ms();
+  int timeout = -1;
+  conn_t *conn = waiting;
+
+  while (conn != NULL) {
+    conn_t *next = conn->next_waiting;
+    if (conn->due <= now) {
+      if (conn->prev_waiting != NULL) {
+        conn->prev_waiting->next_waiting = conn->next_waiting;
+      } else {
+        waiting = conn->next_waiting;
+      }
+      if (conn->next_waiting != NULL) {
+        conn->next_waiting->prev_waiting = conn->prev_waiting;
+      }
+      start_response(conn);
+      respond(epollfd, conn);
+    } else if (timeout == -1 || conn->due - now < (uint64_t)timeout) {
+      timeout = conn->due - now;
+    }
+    conn = next;
+  }
+  return timeout;
+}
+
+static int open_listener() {
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd == -1) {
+    perror("socket");
+    return -1;
+  }
+  int yes = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(sockfd, ORIGIN_BACKLOG) == -1) {
+    perror("bind");
+    close(sockfd);
+    return -1;
+  }
+  setnonblocking(sockfd);
+  return sockfd;
+}
+
+static void *run_worker(void *arg) {
+  int sockfd = open_listener();
+  int epollfd = epoll_create1(0);
+  if (sockfd == -1 || epollfd == -1) {
+    exit(EXIT_FAILURE);
+  }
+
+  struct epoll_event ev, events[ORIGIN_MAX_EVENTS];
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev);
+
+  int timeout = -1;
+  while (1) {
+    int n = epoll_wait(epollfd, events, ORIGIN_MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      conn_t *conn = events[i].data.ptr;
+      if (conn != NULL) {
+        handle_conn(epollfd, conn);
+        continue;
+      }
+      int fd;
+      while ((fd = accept(sockfd, NULL, NULL)) != -1) {
+        conn = calloc(1, sizeof(conn_t));
+        if (conn == NULL) {
+          close(fd);
+          continue;
+        }
+        setnonblocking(fd);
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        conn->fd = fd;
+        conn->state = READING;
+        http_parser_init(&conn->parser);
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = conn;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+        handle_conn(epollfd, conn);
+      }
+    }
+    timeout = run_waiting(epollfd);
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  const char *usage =
+      "usage: %s [-s size] [-l delay_ms] [-m max_age] [-C] [-k] "
+      "[-t workers] <port>\n"
+      "  -C chunked bodies, -k close after each response\n";
+
+  while ((opt = getopt(argc, argv, "s:l:m:Ckt:")) != -1) {
+    switch (opt) {
+      case 's':
+        defaults.size = parse_size(optarg);
+        break;
+      case 'l':
+        defaults.delay = atol(optarg);
+        break;
+      case 'm':
+        defaults.max_age = atol(optarg);
+        break;
+      case 'C':
+        defaults.chunked = 1;
+        break;
+      case 'k':
+        defaults.close = 1;
+        break;
+      case 't':
+        workers = atoi(optarg);
+        if (workers <= 0 || workers > ORIGIN_MAX_WORKERS) {
+          fprintf(stderr, "Invalid number of workers\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1 || (long long)defaults.size < 0) {
+    fprintf(stderr, usage, argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  port = atoi(argv[optind]);
+
+  for (int i = 0; i < ORIGIN_PATTERN_SIZE; i++) {
+    pattern[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+  }
+  for (long i = 1; i < workers; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, run_worker, (void *)i) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+  }
+  run_worker(NULL);
+  return 0;
+}
@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+
+#include "pipe_pool.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static __thread relay_pipe_t *idle = NULL;
+static __thread int idle_count = 0;
+
+static void close_pipe(relay_pipe_t *pipe) {
+  close(pipe->fds[0]);
+  close(pipe->fds[1]);
+  free(pipe);
+}
+
+// Returns an empty pipe, or NULL if none can be made.
+relay_pipe_t *pipe_pool_get() {
+  relay_pipe_t *pipe = idle;
+
+  if (pipe != NULL) {
+    idle = pipe->next;
+    idle_count--;
+    return pipe;
+  }
+
+  pipe = malloc(sizeof(relay_pipe_t));
+  if (pipe == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  if (pipe2(pipe->fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+    perror("pipe2");
+    free(pipe);
+    return NULL;
+  }
+  // a larger buffer means fewer splice() calls per body; the default size
+  // is kept if the limit in /proc/sys/fs/pipe-max-size is lower
+  fcntl(pipe->fds[1], F_SETPIPE_SZ, PIPE_POOL_SIZE);
+  int size = fcntl(pipe->fds[1], F_GETPIPE_SZ);
+  if (size <= 0) {
+    perror("fcntl");
+    close_pipe(pipe);
+    return NULL;
+  }
+  pipe->capacity = size;
+  return pipe;
+}
+
+// Give a pipe back; one still holding left bytes of an abandoned body is
+// closed rather than handed to the next response.
+void pipe_pool_put(relay_pipe_t *pipe, uint32_t left) {
+  if (left > 0 || idle_count >= PIPE_POOL_MAX) {
+    close_pipe(pipe);
+    return;
+  }
+  pipe->next = idle;
+  idle = pipe;
+  idle_count++;
+}
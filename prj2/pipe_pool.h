@@ -0,0 +1,19 @@
+#include <stdint.h>
+
+#include "common.h"
+
+// Pipes that carry response bodies from the origin socket to the client
+// socket with splice(). Creating a pipe and growing its buffer costs a few
+// system calls, so each worker keeps the empty ones for reuse.
+
+#define PIPE_POOL_MAX 64  // idle pipes per worker
+#define PIPE_POOL_SIZE (256 * 1024)
+
+typedef struct relay_pipe_t {
+  int fds[2];
+  uint32_t capacity;
+  struct relay_pipe_t *next;
+} relay_pipe_t;
+
+relay_pipe_t *pipe_pool_get();
+void pipe_pool_put(relay_pipe_t *pipe, uint32_t left);
@@ -0,0 +1,241 @@
+#include "pool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Idle connections are not watched by epoll. An origin that hangs up leaves
+// the socket readable at EOF, which pool_get() notices with a peek before
+// handing the connection out; anything left over is closed on expiry.
+// Every worker keeps a pool of its own, so none of it is locked; only the
+// statistics are shared.
+
+typedef struct pool_origin_t pool_origin_t;
+
+typedef struct pool_conn_t {
+  int fd;
+  time_t since;
+  pool_origin_t *origin;
+  struct pool_conn_t *prev;  // same origin, most recently parked first
+  struct pool_conn_t *next;
+  struct pool_conn_t *age_prev;  // all origins, most recently parked first
+  struct pool_conn_t *age_next;
+} pool_conn_t;
+
+struct pool_origin_t {
+  struct sockaddr_storage addr;  // IPv4 or IPv6, with the port
+  int idle;
+  pool_conn_t *conns;
+  pool_origin_t *next;
+};
+
+pool_stats_t pool_stats;
+
+static __thread pool_origin_t *buckets[POOL_BUCKETS];
+static __thread pool_conn_t *newest = NULL, *oldest = NULL;
+static __thread int idle = 0;
+static int idle_total = 0;  // across all workers
+
+static time_t now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static socklen_t addr_len(const struct sockaddr *addr) {
+  return addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                     : sizeof(struct sockaddr_in);
+}
+
+static uint32_t hash_addr(const struct sockaddr *addr) {
+  uint32_t h;
+  if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    const uint32_t *words = in6->sin6_addr.s6_addr32;
+    h = words[0] ^ words[1] ^ words[2] ^ words[3] ^
+        ((uint32_t)in6->sin6_port << 16);
+  } else {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    h = in->sin_addr.s_addr ^ ((uint32_t)in->sin_port << 16);
+  }
+  return (h * 2654435769u) >> 16;
+}
+
+static int same_addr(const struct sockaddr *a, const struct sockaddr *b) {
+  if (a->sa_family != b->sa_family) {
+    return 0;
+  }
+  if (a->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+    return x->sin6_port == y->sin6_port &&
+           memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+  }
+  const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+  const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+  return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+}
+
+static pool_origin_t **find_origin(const struct sockaddr *addr) {
+  pool_origin_t **link = &buckets[hash_addr(addr) % POOL_BUCKETS];
+  while (*link != NULL &&
+         !same_addr((struct sockaddr *)&(*link)->addr, addr)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// Unlink a connection from both lists; the origin goes once it is empty.
+static void unlink_conn(pool_conn_t *conn) {
+  pool_origin_t *origin = conn->origin;
+
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    origin->conns = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+
+  if (conn->age_prev) {
+    conn->age_prev->age_next = conn->age_next;
+  } else {
+    newest = conn->age_next;
+  }
+  if (conn->age_next) {
+    conn->age_next->age_prev = conn->age_prev;
+  } else {
+    oldest = conn->age_prev;
+  }
+
+  idle--;
+  STAT_ADD(idle_total, -1);
+  if (--origin->idle == 0) {
+    *find_origin((struct sockaddr *)&origin->addr) = origin->next;
+    free(origin);
+  }
+}
+
+static void drop_conn(pool_conn_t *conn) {
+  unlink_conn(conn);
+  close(conn->fd);
+  free(conn);
+}
+
+// An idle socket must have nothing to read: EOF or an error means the
+// origin closed it, and stray bytes mean the last response was misframed.
+static int is_alive(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Returns an open connection to addr, or -1 when none is parked.
+int pool_get(const struct sockaddr *addr) {
+  pool_origin_t *origin = *find_origin(addr);
+
+  while (origin != NULL) {
+    pool_conn_t *conn = origin->conns;
+    int fd = conn->fd;
+    int last = origin->idle == 1;
+
+    unlink_conn(conn);
+    free(conn);
+    if (is_alive(fd)) {
+      STAT_ADD(pool_stats.reused, 1);
+      return fd;
+    }
+    close(fd);
+    STAT_ADD(pool_stats.stale, 1);
+    if (last) break;
+  }
+  STAT_ADD(pool_stats.misses, 1);
+  return -1;
+}
+
+// Park a connection whose last response was relayed in full. fd must no
+// longer be registered with epoll.
+void pool_put(const struct sockaddr *addr, int fd) {
+  pool_origin_t **link = find_origin(addr);
+  pool_origin_t *origin = *link;
+
+  if (origin != NULL && origin->idle >= POOL_MAX_PER_ORIGIN) {
+    close(fd);
+    STAT_ADD(pool_stats.overflow, 1);
+    return;
+  }
+  if (idle >= POOL_MAX_IDLE) {
+    drop_conn(oldest);
+    STAT_ADD(pool_stats.overflow, 1);
+    // dropping may have freed the origin we looked up
+    link = find_origin(addr);
+    origin = *link;
+  }
+
+  pool_conn_t *conn = calloc(1, sizeof(pool_conn_t));
+  if (conn == NULL) {
+    close(fd);
+    return;
+  }
+  if (origin == NULL) {
+    origin = calloc(1, sizeof(pool_origin_t));
+    if (origin == NULL) {
+      free(conn);
+      close(fd);
+      return;
+    }
+    memcpy(&origin->addr, addr, addr_len(addr));
+    *link = origin;
+  }
+
+  conn->fd = fd;
+  conn->since = now_sec();
+  conn->origin = origin;
+  conn->next = origin->conns;
+  if (origin->conns) {
+    origin->conns->prev = conn;
+  }
+  origin->conns = conn;
+  origin->idle++;
+
+  conn->age_next = newest;
+  if (newest) {
+    newest->age_prev = conn;
+  } else {
+    oldest = conn;
+  }
+  newest = conn;
+  idle++;
+  STAT_ADD(idle_total, 1);
+  STAT_ADD(pool_stats.parked, 1);
+}
+
+void pool_expire() {
+  time_t now = now_sec();
+  while (oldest != NULL && now - oldest->since >= POOL_IDLE_TIMEOUT) {
+    drop_conn(oldest);
+    STAT_ADD(pool_stats.expired, 1);
+  }
+}
+
+// Milliseconds until the next idle connection expires, -1 when none is
+// parked; suitable as an epoll_wait() timeout.
+int pool_next_timeout() {
+  if (oldest == NULL) {
+    return -1;
+  }
+  time_t left = oldest->since + POOL_IDLE_TIMEOUT - now_sec();
+  return left > 0 ? left * 1000 : 0;
+}
+
+void pool_print_stats(FILE *out) {
+  fprintf(out,
+          "pool: %d idle, reused %lu, misses %lu, parked %lu, stale %lu, "
+          "expired %lu, overflow %lu\n",
+          idle_total, pool_stats.reused, pool_stats.misses, pool_stats.parked,
+          pool_stats.stale, pool_stats.expired, pool_stats.overflow);
+}
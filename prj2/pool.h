@@ -0,0 +1,32 @@
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "common.h"
+
+// Idle keep-alive connections to origins, keyed by address and port. A
+// connection is parked here once its response has been relayed in full and
+// handed to the next request for the same origin.
+
+#define POOL_BUCKETS 1024
+#define POOL_MAX_PER_ORIGIN 8
+#define POOL_MAX_IDLE 1024  // per worker
+#define POOL_IDLE_TIMEOUT 30  // seconds
+
+typedef struct {
+  uint64_t reused;
+  uint64_t misses;
+  uint64_t parked;
+  uint64_t stale;     // closed by the origin while idle
+  uint64_t expired;   // idle for longer than the timeout
+  uint64_t overflow;  // turned away because the pool was full
+} pool_stats_t;
+
+extern pool_stats_t pool_stats;
+
+int pool_get(const struct sockaddr *addr);
+void pool_put(const struct sockaddr *addr, int fd);
+void pool_expire();
+int pool_next_timeout();
+void pool_print_stats(FILE *out);
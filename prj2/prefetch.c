@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#include "prefetch.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "handler.h"
+
+#define SINK_READ_SIZE (64 * 1024)
+
+prefetch_stats_t prefetch_stats;
+
+typedef enum {
+  SCAN_TEXT,
+  SCAN_TAG,    // the element name
+  SCAN_ATTRS,  // between attributes
+  SCAN_VALUE_START,
+  SCAN_VALUE,
+} scan_state_t;
+
+struct prefetch_page_t {
+  scan_state_t state;
+  int links;  // taken from the page so far
+  char tag[8];
+  size_t tag_len;
+  char attr[8];
+  size_t attr_len;
+  int attr_done;  // whitespace followed the name
+  int wanted;     // the value being read names a subresource
+  char quote;     // around the value, 0 without
+  int url_len;    // -1 once the value cannot be used
+  char url[PREFETCH_URL_MAX];
+  char origin[RESOLVER_HOST_MAX + 16];  // "http://host[:port]"
+  size_t origin_len;
+  char base[PREFETCH_URL_MAX];  // the page's path up to its last '/'
+  char headers[PREFETCH_URL_MAX];  // passed on from the page's request
+};
+
+// A fetch in progress; it is found through its fd_data, which has no
+// proxy_data and so tells proxy.c that the socket is a sink.
+struct prefetch_sink_t {
+  fd_data_t fd_data;
+  uint64_t received;
+};
+
+static int concurrency = 0;  // fetches at once on each worker
+
+static __thread char *queue[PREFETCH_QUEUE];  // requests, oldest first
+static __thread int queue_head = 0;
+static __thread int queue_len = 0;
+static __thread int inflight = 0;
+
+int prefetch_init(int fetches) {
+  if (fetches <= 0) {
+    return -1;
+  }
+  concurrency = fetches;
+  return 0;
+}
+
+// Prefetched objects are only of use in the object cache.
+int prefetch_enabled() { return concurrency > 0 && cache_enabled(); }
+
+// Headers the page's request carried that a stored response may vary on,
+// so that its subresources are fetched as the browser will ask for them.
+static void copy_headers(prefetch_page_t *page, const char *req,
+                         size_t req_len) {
+  static const char *names[] = {"User-Agent", "Accept-Language",
+                                "Accept-Encoding"};
+  size_t used = 0;
+
+  page->headers[0] = '\0';
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    size_t len;
+    const char *value = find_header(req, req_len, names[i], &len);
+    if (value == NULL) {
+      continue;
+    }
+    int n = snprintf(page->headers + used, sizeof(page->headers) - used,
+                     "%s: %.*s\r\n", names[i], (int)len, value);
+    if (n < 0 || (size_t)n >= sizeof(page->headers) - used) {
+      page->headers[used] = '\0';
+      break;
+    }
+    used += n;
+  }
+}
+
+// Start scanning the response to req, an HTML page from host:port. Returns
+// NULL when the page's links cannot be worked out.
+prefetch_page_t *prefetch_page_begin(const char *req, size_t req_len,
+                                     const char *host, int port) {
+  const char *target = memchr(req, ' ', req_len);
+  if (target == NULL) {
+    return NULL;
+  }
+  target++;
+  const char *end = memchr(target, ' ', req + req_len - target);
+  if (end == NULL) {
+    return NULL;
+  }
+  // the path of an absolute URI starts after its authority
+  if (end - target > 7 && strncasecmp(target, "http://", 7) == 0) {
+    target = memchr(target + 7, '/', end - target - 7);
+    if (target == NULL) {
+      target = end;
+    }
+  }
+  const char *query = memchr(target, '?', end - target);
+  if (query != NULL) {
+    end = query;
+  }
+  while (end > target && end[-1] != '/') {
+    end--;
+  }
+
+  prefetch_page_t *page = malloc(sizeof(prefetch_page_t));
+  if (page == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  page->state = SCAN_TEXT;
+  page->links = 0;
+  int bracket = strchr(host, ':') != NULL;  // an IPv6 literal
+  page->origin_len =
+      snprintf(page->origin, sizeof(page->origin), "http://%s%s%s", bracket ?
+               "[" : "", host, bracket ? "]" : "");
+  if (port != 80) {
+    page->origin_len += snprintf(page->origin + page->origin_len,
+                                 sizeof(page->origin) - page->origin_len,
+                                 ":%d", port);
+  }
+  if (end == target) {
+    strcpy(page->base, "/");
+  } else if ((size_t)(end - target) < sizeof(page->base)) {
+    memcpy(page->base, target, end - target);
+    page->base[end - target] = '\0';
+  } else {
+    free(page);
+    return NULL;
+  }
+  copy_headers(page, req, req_len);
+  STAT_ADD(prefetch_stats.pages, 1);
+  return page;
+}
+
+void prefetch_page_end(prefetch_page_t *page) { free(page); }
+
+static void enqueue(char *req) {
+  if (queue_len == PREFETCH_QUEUE) {
+    STAT_ADD(prefetch_stats.dropped, 1);
+    free(req);
+    return;
+  }
+  queue[(queue_head + queue_len) % PREFETCH_QUEUE] = req;
+  queue_len++;
+}
+
+// The value just read names a subresource. One of the same origin is
+// queued for fetching, by the URL the browser will ask the proxy for.
+static void take_link(prefetch_page_t *page) {
+  char *url = page->url;
+  char path[2 * PREFETCH_URL_MAX];
+
+  url[page->url_len] = '\0';
+  url[strcspn(url, "#")] = '\0';
+  // &amp; is the one entity that turns up in URLs
+  char *amp;
+  while ((amp = strstr(url, "&amp;")) != NULL) {
+    memmove(amp + 1, amp + 5, strlen(amp + 5) + 1);
+  }
+  if (url[0] == '\0') {
+    return;
+  }
+
+  if (strncasecmp(url, "http://", 7) == 0 || strncmp(url, "//", 2) == 0) {
+    const char *authority = url + (url[0] == '/' ? 2 : 7);
+    size_t len = page->origin_len - 7;
+    if (strncasecmp(authority, page->origin + 7, len) != 0 ||
+        (authority[len] != '/' && authority[len] != '\0')) {
+      return;
+    }
+    snprintf(path, sizeof(path), "%s", authority[len] ? authority + len : "/");
+  } else if (url[0] == '/') {
+    snprintf(path, sizeof(path), "%s", url);
+  } else if (url[0] == '?' || url[strcspn(url, ":/?")] == ':') {
+    return;  // https:, data: and the like, or the page itself
+  } else {
+    snprintf(path, sizeof(path), "%s%s", page->base, url);
+  }
+  // the browser resolves dot segments before it asks; the cache key would
+  // not match
+  if (strstr(path, "/./") != NULL || strstr(path, "/../") != NULL) {
+    return;
+  }
+
+  page->links++;
+  STAT_ADD(prefetch_stats.links, 1);
+  char *req;
+  if (asprintf(&req,
+               "GET %s%s HTTP/1.1\r\nHost: %s\r\n%sConnection: close\r\n\r\n",
+               page->origin, path, page->origin + 7, page->headers) < 0) {
+    perror("asprintf");
+    return;
+  }
+  enqueue(req);
+}
+
+// Attributes that name a subresource: any element's src, and the href of
+// a link element such as a stylesheet. An anchor's href is a page the user
+// may never open.
+static int is_link_attr(const prefetch_page_t *page) {
+  if (page->attr_len == 3 && memcmp(page->attr, "src", 3) == 0) {
+    return 1;
+  }
+  return page->attr_len == 4 && memcmp(page->attr, "href", 4) == 0 &&
+         page->tag_len == 4 && memcmp(page->tag, "link", 4) == 0;
+}
+
+// Feed the next part of the page. Tags are tracked just far enough to find
+// attribute values, in whatever pieces the page arrives.
+void prefetch_page_scan(prefetch_page_t *page, const char *buf, size_t len) {
+  if (page == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < len && page->links < PREFETCH_PAGE_LINKS; i++) {
+    char c = buf[i];
+    int space = isspace((unsigned char)c);
+
+    switch (page->state) {
+      case SCAN_TEXT:
+        if (c == '<') {
+          page->state = SCAN_TAG;
+          page->tag_len = 0;
+        }
+        break;
+      case SCAN_TAG:
+        if (c == '>') {
+          page->state = SCAN_TEXT;
+        } else if (space) {
+          page->state = SCAN_ATTRS;
+          page->attr_len = 0;
+          page->attr_done = 0;
+        } else if (page->tag_len < sizeof(page->tag)) {
+          page->tag[page->tag_len++] = tolower((unsigned char)c);
+        }
+        break;
+      case SCAN_ATTRS:
+        if (c == '>') {
+          page->state = SCAN_TEXT;
+        } else if (c == '=') {
+          page->wanted = is_link_attr(page);
+          page->state = SCAN_VALUE_START;
+        } else if (space) {
+          page->attr_done = page->attr_len > 0;
+        } else {
+          if (page->attr_done) {
+            page->attr_len = 0;
+            page->attr_done = 0;
+          }
+          if (page->attr_len < sizeof(page->attr)) {
+            page->attr[page->attr_len++] = tolower((unsigned char)c);
+          }
+        }
+        break;
+      case SCAN_VALUE_START:
+        if (space) {
+          break;
+        }
+        if (c == '>') {
+          page->state = SCAN_TEXT;
+          break;
+        }
+        page->state = SCAN_VALUE;
+        page->attr_len = 0;
+        page->attr_done = 0;
+        page->url_len = 0;
+        page->quote = c == '"' || c == '\'' ? c : 0;
+        if (page->quote) {
+          break;
+        }
+        // an unquoted value starts with this character
+        // fall through
+      case SCAN_VALUE:
+        if (page->quote ? c == page->quote : space || c == '>') {
+          if (page->wanted && page->url_len > 0) {
+            take_link(page);
+          }
+          page->state = c == '>' ? SCAN_TEXT : SCAN_ATTRS;
+        } else if (page->wanted && page->url_len >= 0) {
+          if (page->url_len < PREFETCH_URL_MAX - 1 && c != '\r' && c != '\n' &&
+              c != '<' && c != ' ') {
+            page->url[page->url_len++] = c;
+          } else {
+            page->url_len = -1;
+          }
+        }
+        break;
+    }
+  }
+}
+
+// Whether the object req asks for is stored or on its way already.
+static int is_cached(const char *req) {
+  size_t len = strlen(req);
+  char *key = cache_make_key(req, len, "", 80);
+  char *variant = NULL;
+  if (key == NULL || (compress_enabled() && compress_accepted(req, len) &&
+                      (variant = compress_key(key)) == NULL)) {
+    free(key);
+    return 1;
+  }
+  int cached = cache_contains(key) || collapse_find(key) != NULL ||
+               (variant != NULL && cache_contains(variant));
+  free(key);
+  free(variant);
+  return cached;
+}
+
+// Hand req to the proxy as if a client had sent it, with the sink as that
+// client.
+static void start_fetch(const char *req, int epoll_fd) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == -1) {
+    perror("socketpair");
+    return;
+  }
+  size_t len = strlen(req);
+  if (send(fds[1], req, len, 0) != (ssize_t)len) {
+    perror("send");
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+  prefetch_sink_t *sink = malloc(sizeof(prefetch_sink_t));
+  if (sink == NULL) {
+    perror("malloc");
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+  sink->fd_data.fd = fds[1];
+  sink->fd_data.data = NULL;
+  sink->received = 0;
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = sink;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[1], &event) == -1) {
+    perror("epoll_ctl add prefetch");
+    close(fds[0]);
+    close(fds[1]);
+    free(sink);
+    return;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  proxy_data_t *data = open_client(fds[0], &addr, epoll_fd);
+  if (data == NULL) {
+    close(fds[1]);
+    free(sink);
+    return;
+  }
+  data->prefetch = 1;
+  inflight++;
+  STAT_ADD(prefetch_stats.fetches, 1);
+  DEBUG_PRINT("prefetch %.*s\n", (int)strcspn(req, "\r"), req);
+}
+
+// Start queued fetches while this worker has room for them. Called once the
+// events in hand have been dealt with, so prefetches come after clients.
+void prefetch_start(int epoll_fd) {
+  while (inflight < concurrency && queue_len > 0) {
+    char *req = queue[queue_head];
+    queue_head = (queue_head + 1) % PREFETCH_QUEUE;
+    queue_len--;
+    if (is_cached(req)) {
+      STAT_ADD(prefetch_stats.skipped, 1);
+    } else {
+      start_fetch(req, epoll_fd);
+    }
+    free(req);
+  }
+}
+
+// Discard what the proxy sends the sink. The fetch is over once the proxy
+// closes its end; a response past the size budget is not waited for.
+void prefetch_drain(prefetch_sink_t *sink) {
+  static __thread char scratch[SINK_READ_SIZE];
+
+  while (1) {
+    ssize_t count = recv(sink->fd_data.fd, scratch, sizeof(scratch), 0);
+    if (count > 0) {
+      sink->received += count;
+      STAT_ADD(prefetch_stats.bytes, count);
+      if (sink->received > PREFETCH_MAX_BYTES) {
+        STAT_ADD(prefetch_stats.abandoned, 1);
+        break;
+      }
+    } else if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      break;
+    }
+  }
+  close(sink->fd_data.fd);
+  free(sink);
+  inflight--;
+}
+
+void prefetch_print_stats(FILE *out) {
+  uint64_t fetches = prefetch_stats.fetches;
+  fprintf(out,
+          "prefetch: pages %lu, links %lu, dropped %lu, skipped %lu, fetches "
+          "%lu, abandoned %lu, bytes %lu\n",
+          prefetch_stats.pages, prefetch_stats.links, prefetch_stats.dropped,
+          prefetch_stats.skipped, prefetch_stats.fetches,
+          prefetch_stats.abandoned, prefetch_stats.bytes);
+  fprintf(out, "prefetch: used %lu, unused %lu, hit ratio %.3f\n",
+          cache_stats.prefetch_used, cache_stats.prefetch_unused,
+          (double)cache_stats.prefetch_used / (fetches ? fetches : 1));
+}
@@ -0,0 +1,45 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+
+// Speculative prefetching of subresources. An HTML page relayed from an
+// origin is scanned as it streams through for same-origin src attributes
+// and link hrefs, and the objects they name are fetched into the cache in
+// the background, a few at a time on each worker, so the requests the
+// browser makes for them once it has parsed the page are hits.
+//
+// A prefetch is an ordinary request made over a socketpair: the proxy
+// serves one end like any client and the sink at the other end throws the
+// response away.
+
+#define PREFETCH_PAGE_LINKS 16   // taken from one page at most
+#define PREFETCH_QUEUE 64        // waiting to start, per worker
+#define PREFETCH_URL_MAX 1024
+#define PREFETCH_MAX_BYTES (4 * 1024 * 1024)  // a larger response is dropped
+
+typedef struct prefetch_page_t prefetch_page_t;
+typedef struct prefetch_sink_t prefetch_sink_t;
+
+typedef struct {
+  uint64_t pages;    // HTML pages scanned
+  uint64_t links;    // same-origin subresources found in them
+  uint64_t dropped;  // found with the queue full
+  uint64_t skipped;  // cached or being fetched by the time their turn came
+  uint64_t fetches;
+  uint64_t abandoned;  // larger than PREFETCH_MAX_BYTES
+  uint64_t bytes;      // response bytes the sinks took
+} prefetch_stats_t;
+
+extern prefetch_stats_t prefetch_stats;
+
+int prefetch_init(int concurrency);
+int prefetch_enabled();
+prefetch_page_t *prefetch_page_begin(const char *req, size_t req_len,
+                                     const char *host, int port);
+void prefetch_page_scan(prefetch_page_t *page, const char *buf, size_t len);
+void prefetch_page_end(prefetch_page_t *page);
+void prefetch_start(int epoll_fd);
+void prefetch_drain(prefetch_sink_t *sink);
+void prefetch_print_stats(FILE *out);
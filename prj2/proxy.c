@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
@@ -9,49 +11,49 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "compress.h"
+#include "fair.h"
 #include "handler.h"
+#include "prefetch.h"
 #include "utils.h"
 
 #define MAX_EVENTS 100
 #define BACKLOG 1024
+#define MAX_WORKERS 64
 
-int main(int argc, char *argv[]) {
-  int port;
+static volatile sig_atomic_t dump_stats = 0;
+static volatile sig_atomic_t reload_blacklist = 0;
+static volatile sig_atomic_t step_log_level = 0;
 
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(EXIT_FAILURE);
-  }
-  port = atoi(argv[1]);
+static int port;
+static int workers = 1;
 
-  if (port <= 0 || port > 65535) {
-    fprintf(stderr, "Invalid port number");
-    exit(EXIT_FAILURE);
-  }
-
-  size_t black_url_count = 0;
-  char **black_urls = NULL;
-
-  if (is_stdin_redirected()) {
-    black_urls = read_urls_from_file(&black_url_count);
-    if (!black_urls) {
-      fprintf(stderr, "Failed to read urls from file");
-      exit(EXIT_FAILURE);
-    }
-    DEBUG_PRINT("black_url_count: %zu\n", black_url_count);
+void handle_signal(int sig) {
+  if (sig == SIGHUP) {
+    reload_blacklist = 1;
+  } else if (sig == SIGUSR2) {
+    step_log_level = 1;
+  } else {
+    dump_stats = 1;
   }
+}
 
+// With several workers every one binds its own socket to the port and the
+// kernel spreads incoming connections across them.
+static int open_listener() {
   int sockfd;
   if ((sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
     perror("socket");
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
   int yes = 1;
-  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+      (workers > 1 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+                                 sizeof(yes)) == -1)) {
     perror("setsockopt");
     close(sockfd);
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
   struct sockaddr_in saddr;
@@ -61,11 +63,36 @@ int main(int argc, char *argv[]) {
   saddr.sin_port = htons(port);
   if (bind(sockfd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
     perror("bind");
-    exit(EXIT_FAILURE);
+    close(sockfd);
+    return -1;
   }
 
   if (listen(sockfd, BACKLOG) < 0) {
     perror("listen");
+    close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
+// The sooner of the next connection deadline and the next idle upstream
+// connection to expire.
+static int next_timeout() {
+  int timeout = timer_next_timeout();
+  int pool_timeout = pool_next_timeout();
+  if (timeout == -1 || (pool_timeout != -1 && pool_timeout < timeout)) {
+    timeout = pool_timeout;
+  }
+  return timeout;
+}
+
+// One event loop with its own listener, epoll set and connections. Worker 0
+// runs on the main thread, the only one signals are delivered to.
+static void *run_worker(void *arg) {
+  int main_worker = arg == NULL;
+
+  int sockfd = open_listener();
+  if (sockfd == -1) {
     exit(EXIT_FAILURE);
   }
 
@@ -83,66 +110,264 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
+  if (access_log_attach() < 0) {
+    fprintf(stderr, "Failed to attach to the access log\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int resolver_fd = resolver_attach();
+  if (resolver_fd == -1) {
+    fprintf(stderr, "Failed to start resolver\n");
+    exit(EXIT_FAILURE);
+  }
+  ev.events = EPOLLIN;
+  ev.data.fd = resolver_fd;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, resolver_fd, &ev) == -1) {
+    perror("epoll_ctl resolver");
+    exit(EXIT_FAILURE);
+  }
+
   while (1) {
-    int n = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+    // connections waiting for a turn at sending need no event to go on
+    int n = epoll_wait(epollfd, events, MAX_EVENTS,
+                       send_round_pending() ? 0 : next_timeout());
+    timer_expire();
+    pool_expire();
+    if (main_worker && dump_stats) {
+      dump_stats = 0;
+      stats_print(stderr);
+      cache_print_stats(stderr);
+      disk_cache_print_stats(stderr);
+      pool_print_stats(stderr);
+      prefetch_print_stats(stderr);
+      compress_print_stats(stderr);
+      fair_print_stats(stderr);
+    }
+    if (main_worker && reload_blacklist) {
+      reload_blacklist = 0;
+      blacklist_reload();
+    }
+    if (main_worker && step_log_level) {
+      step_log_level = 0;
+      access_log_step_level();
+    }
     for (int i = 0; i < n; i++) {
-      if (events[i].data.fd == sockfd) {
+      if (events[i].data.fd == resolver_fd) {
+        resolver_process();
+      } else if (events[i].data.fd == sockfd) {
         struct sockaddr_in client_addr;
         socklen_t client_addr_len = sizeof(client_addr);
         int client_fd =
             accept(sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
 
+        // the rest of the batch still needs handling: its connections are
+        // edge-triggered and will not be reported again
         if (client_fd == -1) {
-          if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            break;
-          } else {
+          if (errno != EAGAIN && errno != EWOULDBLOCK) {
             perror("accept");
-            break;
           }
+          continue;
         }
         setnonblocking(client_fd);
-
-        ev.events = EPOLLIN | EPOLLET;
-
-        proxy_data_t *data = calloc(1, sizeof(proxy_data_t));
-        fd_data_t *client_fd_data = calloc(1, sizeof(fd_data_t));
-        client_fd_data->fd = client_fd;
-        client_fd_data->data = data;
-        data->client_fd = client_fd;
-        data->client_fd_data = client_fd_data;
-        data->server_fd = -1;
-        data->state |= CLIENT_OPEN;
-        data->state |= REQUEST_NOT_RECEIVED;
-        data->black_urls = black_urls;
-        data->black_urls_count = black_url_count;
-
-        ev.data.ptr = client_fd_data;
-
-        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
-          perror("epoll_ctl add client");
-          close(client_fd);
-          free(data);
-          free(client_fd_data);
-          break;
-        } else {
-          DEBUG_PRINT("client connected: %d\n", client_fd);
-        };
-
+        // a client that could not be set up has been closed already
+        open_client(client_fd, &client_addr, epollfd);
       } else {
         fd_data_t *fd_data = (fd_data_t *)events[i].data.ptr;
+        if (fd_data->data == NULL) {
+          // the far end of a prefetch, which starts with its fd_data
+          prefetch_drain((prefetch_sink_t *)fd_data);
+          continue;
+        }
+        if (fd_data->data->state & CLOSED) {
+          continue;
+        }
         if (fd_data->data->client_fd == fd_data->fd) {
           handle_client(fd_data->data, &events[i], epollfd);
-        }
-        if (fd_data->data->server_fd == fd_data->fd) {
+        } else if (fd_data->data->server_fd == fd_data->fd ||
+                   fd_data != fd_data->data->server_fd_data) {
+          // the server side, or one of the connects racing to become it
           handle_server(fd_data->data, &events[i], epollfd);
         }
       }
     }
+    run_send_round();
+    release_closed();
+    prefetch_start(epollfd);
   }
 
-  free_urls(black_urls, black_url_count);
   close(epollfd);
   close(sockfd);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  char *nameserver = NULL;
+  long long cache_budget = CACHE_DEFAULT_BUDGET;
+  long long disk_budget = DISK_DEFAULT_BUDGET;
+  char *disk_dir = NULL;
+  char *blacklist_path = NULL;
+  char *access_log_path = NULL;
+  long long send_quantum = FAIR_DEFAULT_QUANTUM;
+  long long client_rate = 0;
+  long long client_burst = 0;
+  const char *usage =
+      "usage: %s [-n nameserver[:port]] [-c cache_bytes] [-d cache_dir] "
+      "[-D disk_bytes] [-b blacklist] [-t workers] [-a access_log] "
+      "[-v error|info|debug] [-p prefetches] [-z gzip_level] "
+      "[-q send_quantum] [-r client_rate[:burst]] <port>\n";
+
+  while ((opt = getopt(argc, argv, "n:c:d:D:b:t:a:v:p:z:q:r:")) != -1) {
+    switch (opt) {
+      case 'p':
+        // subresources of HTML pages fetched ahead, so many at a time
+        if (prefetch_init(atoi(optarg)) < 0) {
+          fprintf(stderr, "Invalid number of prefetches\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'z':
+        // text bodies gzip encoded for clients that take it, at this level
+        if (compress_init(atoi(optarg)) < 0) {
+          fprintf(stderr, "Invalid compression level\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'q':
+        // bytes a connection sends its client per turn; 0 takes no turns
+        send_quantum = parse_size(optarg);
+        if (send_quantum < 0) {
+          fprintf(stderr, "Invalid send quantum\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'r': {
+        // bytes a second each client address is sent, with a burst size
+        char *burst = strchr(optarg, ':');
+        if (burst != NULL) {
+          *burst++ = '\0';
+          client_burst = parse_size(burst);
+        }
+        client_rate = parse_size(optarg);
+        if (client_rate <= 0 || client_burst < 0) {
+          fprintf(stderr, "Invalid client rate\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      }
+      case 'a':
+        access_log_path = optarg;
+        break;
+      case 'v':
+        log_level = access_log_parse_level(optarg);
+        if (log_level < 0) {
+          fprintf(stderr, "Invalid log level\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'b':
+        blacklist_path = optarg;
+        break;
+      case 'n':
+        nameserver = optarg;
+        break;
+      case 'c':
+        cache_budget = parse_size(optarg);
+        if (cache_budget < 0) {
+          fprintf(stderr, "Invalid cache size\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'd':
+        disk_dir = optarg;
+        break;
+      case 'D':
+        disk_budget = parse_size(optarg);
+        if (disk_budget <= 0) {
+          fprintf(stderr, "Invalid disk cache size\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 't':
+        workers = atoi(optarg);
+        if (workers <= 0 || workers > MAX_WORKERS) {
+          fprintf(stderr, "Invalid number of workers\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc - 1) {
+    fprintf(stderr, usage, argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  port = atoi(argv[optind]);
+
+  if (port <= 0 || port > 65535) {
+    fprintf(stderr, "Invalid port number");
+    exit(EXIT_FAILURE);
+  }
+
+  // a client hanging up mid-response must not kill the proxy
+  signal(SIGPIPE, SIG_IGN);
+
+  // SIGUSR1 dumps the cache statistics, SIGHUP reloads the blacklist and
+  // SIGUSR2 steps through the log levels
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGUSR2, &sa, NULL);
+
+  // every thread started from here on leaves them to the main thread
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  fair_init(send_quantum, client_rate, client_burst);
+  cache_init(cache_budget);
+  if (disk_dir != NULL && disk_cache_init(disk_dir, disk_budget) < 0) {
+    fprintf(stderr, "Failed to open disk cache in %s\n", disk_dir);
+    exit(EXIT_FAILURE);
+  }
+
+  // the list comes from -b, or from stdin when it is redirected from a file
+  if (blacklist_path != NULL || is_stdin_redirected()) {
+    if (blacklist_init(blacklist_path) < 0) {
+      fprintf(stderr, "Failed to read urls from file");
+      exit(EXIT_FAILURE);
+    }
+    DEBUG_PRINT("black_url_count: %zu\n", blacklist_entries());
+  }
+
+  if (access_log_path != NULL && access_log_init(access_log_path) < 0) {
+    fprintf(stderr, "Failed to open access log %s\n", access_log_path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (resolver_init(RESOLVER_THREADS, nameserver) == -1) {
+    fprintf(stderr, "Failed to start resolver\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (long i = 1; i < workers; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, run_worker, (void *)i) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+  }
+  pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
 
+  run_worker(NULL);
   return 0;
 }
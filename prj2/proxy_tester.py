@@ -6,7 +6,6 @@ import random
 import sys
 import signal
 import socket
-import telnetlib
 import time
 import threading
 from urllib import parse as urlparse
@@ -34,6 +33,12 @@ def main():
     except IndexError:
         port = str(random.randint(1025, 49151))
 
+    # any further arguments replace the public URLs, e.g. with the local
+    # origin server to test offline
+    global pub_urls
+    if len(sys.argv) > 3:
+        pub_urls = sys.argv[3:]
+
     print("Binary: {}".format(proxy_bin))
     print("Running on port {}".format(port))
     cid = os.spawnl(os.P_NOWAIT, proxy_bin, proxy_bin, port)
@@ -72,8 +77,9 @@ def main():
 
 
 def usage():
-    print("Usage: proxy_tested.py path/to/proxy/binary port")
+    print("Usage: proxy_tester.py path/to/proxy/binary [port [url ...]]")
     print("Omit the port argument for a randomly generated port.")
+    print("URLs given replace the built-in public ones.")
 
 
 def run_test(test, args, childid):
@@ -104,7 +110,7 @@ def compare_url(argtuple):
 
     A simple sample test: download a web page via the proxy, and then fetch the
     same page directly from the server.  Compare the two pages for any
-    differences, ignoring the Date header field if it is set.
+    differences, ignoring the Date and Connection header fields.
 
     Argument tuples is in the form (url, port), where url is the URL to open, and
     port is the port the proxy is running on.
@@ -119,20 +125,26 @@ def compare_url(argtuple):
         hostport = 80
 
     try:
-        proxy_data = get_data("localhost", port, url, host)
+        proxy_data = get_data("localhost", port, url, urldata[1])
     except socket.error:
         print("!!!! Socket error while attempting to talk to proxy!")
         return False
     else:
-        direct_data = get_data(host, hostport, url, host)
-        passed = True
-        for proxy, direct in zip(proxy_data, direct_data):
-            if proxy != direct or proxy.startswith(b"Date"):
-                if not direct.startswith(b"Date"):
+        direct_data = get_data(host, int(hostport), url, urldata[1])
+        # Date and the hop-by-hop Connection header may differ
+        skip = (b"Date:", b"Connection:")
+        proxy_data = [line for line in proxy_data if not line.startswith(skip)]
+        direct_data = [line for line in direct_data if not line.startswith(skip)]
+        passed = proxy_data == direct_data
+        if not passed:
+            for proxy, direct in zip(proxy_data, direct_data):
+                if proxy != direct:
                     print("Proxy: {}".format(proxy))
                     print("Direct: {}".format(direct))
-                    passed = False
-                    continue
+                    break
+            if len(proxy_data) != len(direct_data):
+                print("Proxy: {} lines, Direct: {} lines".format(
+                    len(proxy_data), len(direct_data)))
 
     return passed
 
@@ -258,12 +270,15 @@ def get_data(host, port, url, origin):
 
 
 def http_exchange(host, port, data):
-    conn = telnetlib.Telnet()
-    conn.open(host, port)
-    conn.write(data.encode("ascii"))
-    ret_data = conn.read_all()
-    conn.close()
-    return ret_data
+    with socket.create_connection((host, int(port))) as conn:
+        conn.sendall(data.encode("ascii"))
+        chunks = []
+        while True:
+            chunk = conn.recv(65536)
+            if not chunk:
+                break
+            chunks.append(chunk)
+    return b"".join(chunks)
 
 
 def live_process(pid):
@@ -286,7 +301,7 @@ def terminate(id):
     """Stops and cleans up a running child process."""
     if not live_process(id):
         raise AssertionError
-    None.kill(id, signal.SIGINT)
+    os.kill(id, signal.SIGINT)
     os.kill(id, signal.SIGKILL)
 
     try:
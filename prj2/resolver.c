@@ -0,0 +1,533 @@
+#include "resolver.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+// Name resolution runs on a small thread pool so a slow DNS server never
+// blocks the event loop. Workers only see jobs; the cache and the waiting
+// connections belong to the event loop thread, which picks up finished jobs
+// when its eventfd becomes readable. With several event loops each keeps a
+// cache of its own and the pool is shared.
+//
+// A name gets both its A and its AAAA records, the latter only when the host
+// has an IPv6 route at all, and the two families are interleaved so that a
+// connect that races them (RFC 8305) loses little to a broken one.
+
+typedef struct waiter_t {
+  resolve_cb_t cb;
+  void *arg;
+  struct waiter_t *next;
+} waiter_t;
+
+typedef enum {
+  ENTRY_PENDING,
+  ENTRY_RESOLVED,
+  ENTRY_FAILED,
+} entry_status_t;
+
+typedef struct cache_entry_t {
+  char host[RESOLVER_HOST_MAX];
+  entry_status_t status;
+  resolve_result_t result;
+  time_t expires;
+  waiter_t *waiters;
+  struct cache_entry_t *next;
+  struct cache_entry_t *older;  // in the order lookups last went out
+  struct cache_entry_t *newer;
+} cache_entry_t;
+
+typedef struct job_t job_t;
+
+// the finished jobs of one event loop thread
+typedef struct {
+  int event_fd;
+  job_t *done;
+} loop_t;
+
+struct job_t {
+  loop_t *loop;
+  cache_entry_t *entry;
+  char host[RESOLVER_HOST_MAX];
+  resolve_result_t result;
+  int ok;
+  uint32_t ttl;
+  job_t *next;
+};
+
+static __thread cache_entry_t *buckets[RESOLVER_BUCKETS];
+static __thread int entry_count = 0;
+static __thread cache_entry_t *oldest = NULL, *newest = NULL;
+static __thread loop_t *loop = NULL;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static job_t *jobs_head = NULL, *jobs_tail = NULL;
+
+static int custom_nameserver = 0;
+static struct sockaddr_in nameserver_addr;
+static int ipv6_route = 0;
+
+static time_t now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static uint32_t hash_host(const char *host) {
+  uint32_t h = 2166136261u;
+  for (; *host; host++) {
+    h = (h ^ (unsigned char)*host) * 16777619u;
+  }
+  return h % RESOLVER_BUCKETS;
+}
+
+// Whether the host can reach the IPv6 internet at all; connecting a UDP
+// socket only looks up the route and sends nothing.
+static int has_ipv6_route() {
+  struct sockaddr_in6 addr;
+  int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+  if (fd == -1) {
+    return 0;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(53);
+  inet_pton(AF_INET6, "2001:4860:4860::8888", &addr.sin6_addr);
+  int ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  close(fd);
+  return ok;
+}
+
+static void set_addr(resolve_addr_t *addr, int family, const void *raw) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sa.sa_family = family;
+  if (family == AF_INET6) {
+    memcpy(&addr->in6.sin6_addr, raw, 16);
+  } else {
+    memcpy(&addr->in.sin_addr, raw, 4);
+  }
+}
+
+// Collect the records of one type from a DNS answer. Returns how many.
+static int query_addrs(res_state statp, const char *host, int type,
+                       resolve_addr_t *addrs, uint32_t *ttl) {
+  unsigned char answer[NS_PACKETSZ * 4];
+  // the search list applies as it would for any other program on the host
+  int len = res_nsearch(statp, host, ns_c_in, type, answer, sizeof(answer));
+  int family = type == ns_t_aaaa ? AF_INET6 : AF_INET;
+  int size = type == ns_t_aaaa ? 16 : 4;
+  int count = 0;
+  ns_msg msg;
+
+  if (len <= 0 || ns_initparse(answer, len, &msg) != 0) {
+    return 0;
+  }
+  int n = ns_msg_count(msg, ns_s_an);
+  for (int i = 0; i < n && count < RESOLVER_MAX_ADDRS; i++) {
+    ns_rr rr;
+    if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+    if (ns_rr_type(rr) != type || ns_rr_rdlen(rr) != size) continue;
+    set_addr(&addrs[count++], family, ns_rr_rdata(rr));
+    if (ns_rr_ttl(rr) < *ttl) *ttl = ns_rr_ttl(rr);
+  }
+  return count;
+}
+
+// Alternate the families, IPv6 first, so that trying them in order reaches
+// the other family after one attempt whichever of the two is broken.
+static void interleave(resolve_result_t *result, const resolve_addr_t *v6,
+                       int n6, const resolve_addr_t *v4, int n4) {
+  result->count = 0;
+  for (int i = 0; i < n6 || i < n4; i++) {
+    if (i < n6 && result->count < RESOLVER_MAX_ADDRS) {
+      result->addrs[result->count++] = v6[i];
+    }
+    if (i < n4 && result->count < RESOLVER_MAX_ADDRS) {
+      result->addrs[result->count++] = v4[i];
+    }
+  }
+}
+
+// Names in the hosts file, which is all the fallback reads: the DNS answer,
+// from the -n nameserver or the system's, is final otherwise.
+static void hosts_lookup(const char *host, resolve_addr_t *v6, int *n6,
+                         resolve_addr_t *v4, int *n4) {
+  char line[1024];
+  FILE *file = fopen(RESOLVER_HOSTS_FILE, "re");
+  if (file == NULL) {
+    return;
+  }
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+    char *save;
+    char *addr = strtok_r(line, " \t\r\n", &save);
+    if (addr == NULL) continue;
+    char *name = strtok_r(NULL, " \t\r\n", &save);
+    while (name != NULL && strcasecmp(name, host) != 0) {
+      name = strtok_r(NULL, " \t\r\n", &save);
+    }
+    if (name == NULL) continue;
+
+    unsigned char raw[16];
+    if (inet_pton(AF_INET6, addr, raw) == 1) {
+      if (ipv6_route && *n6 < RESOLVER_MAX_ADDRS) {
+        set_addr(&v6[(*n6)++], AF_INET6, raw);
+      }
+    } else if (inet_pton(AF_INET, addr, raw) == 1 &&
+               *n4 < RESOLVER_MAX_ADDRS) {
+      set_addr(&v4[(*n4)++], AF_INET, raw);
+    }
+  }
+  fclose(file);
+}
+
+static int resolve_host(res_state statp, const char *host,
+                        resolve_result_t *result, uint32_t *ttl) {
+  resolve_addr_t v6[RESOLVER_MAX_ADDRS], v4[RESOLVER_MAX_ADDRS];
+  int n6 = 0, n4 = 0;
+
+  *ttl = UINT32_MAX;
+  n4 = query_addrs(statp, host, ns_t_a, v4, ttl);
+  if (ipv6_route) {
+    n6 = query_addrs(statp, host, ns_t_aaaa, v6, ttl);
+  }
+  if (n4 + n6 > 0) {
+    interleave(result, v6, n6, v4, n4);
+    return 0;
+  }
+
+  // names from the hosts file carry no TTL
+  hosts_lookup(host, v6, &n6, v4, &n4);
+  interleave(result, v6, n6, v4, n4);
+  *ttl = RESOLVER_DEFAULT_TTL;
+  return result->count > 0 ? 0 : -1;
+}
+
+static void *worker_main(void *unused) {
+  struct __res_state state;
+
+  memset(&state, 0, sizeof(state));
+  res_ninit(&state);
+  if (custom_nameserver) {
+    state.nscount = 1;
+    state.nsaddr_list[0] = nameserver_addr;
+  }
+
+  while (1) {
+    pthread_mutex_lock(&lock);
+    while (jobs_head == NULL) {
+      pthread_cond_wait(&job_ready, &lock);
+    }
+    job_t *job = jobs_head;
+    jobs_head = job->next;
+    if (jobs_head == NULL) jobs_tail = NULL;
+    pthread_mutex_unlock(&lock);
+
+    job->ok = resolve_host(&state, job->host, &job->result, &job->ttl) == 0;
+    DEBUG_PRINT("resolved %s: %s, ttl %u\n", job->host,
+                job->ok ? "ok" : "failed", job->ttl);
+
+    // the loop may free the job as soon as it is on the list
+    int event_fd = job->loop->event_fd;
+    pthread_mutex_lock(&lock);
+    job->next = job->loop->done;
+    job->loop->done = job;
+    pthread_mutex_unlock(&lock);
+
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) == -1) {
+      perror("write eventfd");
+    }
+  }
+  return NULL;
+}
+
+// Start the lookup threads; each event loop then calls resolver_attach().
+int resolver_init(int threads, const char *nameserver) {
+  if (nameserver != NULL) {
+    char ip[INET_ADDRSTRLEN];
+    int port = 53;
+    const char *colon = strchr(nameserver, ':');
+    size_t len = colon ? (size_t)(colon - nameserver) : strlen(nameserver);
+
+    if (len >= sizeof(ip)) return -1;
+    memcpy(ip, nameserver, len);
+    ip[len] = '\0';
+    if (colon) port = atoi(colon + 1);
+
+    memset(&nameserver_addr, 0, sizeof(nameserver_addr));
+    nameserver_addr.sin_family = AF_INET;
+    nameserver_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &nameserver_addr.sin_addr) != 1 || port <= 0 ||
+        port > 65535) {
+      return -1;
+    }
+    custom_nameserver = 1;
+  }
+  ipv6_route = has_ipv6_route();
+
+  for (int i = 0; i < threads; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, worker_main, NULL) != 0) {
+      perror("pthread_create");
+      return -1;
+    }
+    pthread_detach(tid);
+  }
+  return 0;
+}
+
+// Returns the eventfd that becomes readable when lookups started by the
+// calling thread have finished.
+int resolver_attach() {
+  loop = calloc(1, sizeof(loop_t));
+  if (loop == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->event_fd == -1) {
+    perror("eventfd");
+    free(loop);
+    loop = NULL;
+    return -1;
+  }
+  return loop->event_fd;
+}
+
+static void age_remove(cache_entry_t *entry) {
+  if (entry->older) {
+    entry->older->newer = entry->newer;
+  } else {
+    oldest = entry->newer;
+  }
+  if (entry->newer) {
+    entry->newer->older = entry->older;
+  } else {
+    newest = entry->older;
+  }
+  entry->older = entry->newer = NULL;
+}
+
+static void age_push(cache_entry_t *entry) {
+  entry->older = newest;
+  entry->newer = NULL;
+  if (newest) {
+    newest->newer = entry;
+  } else {
+    oldest = entry;
+  }
+  newest = entry;
+}
+
+static void drop_entry(cache_entry_t *entry) {
+  cache_entry_t **link = &buckets[hash_host(entry->host)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+  age_remove(entry);
+  free(entry);
+  entry_count--;
+}
+
+// Drop the answers that have expired, and the oldest of the rest until the
+// table is an eighth short of full, so that it is not full again at once.
+static void make_room(time_t now) {
+  cache_entry_t *entry = oldest;
+  while (entry != NULL) {
+    cache_entry_t *newer = entry->newer;
+    if (entry->status != ENTRY_PENDING &&
+        (entry->expires <= now ||
+         entry_count > RESOLVER_MAX_ENTRIES - RESOLVER_MAX_ENTRIES / 8)) {
+      drop_entry(entry);
+    }
+    entry = newer;
+  }
+}
+
+static void complete(cache_entry_t *entry) {
+  waiter_t *waiter = entry->waiters;
+  entry->waiters = NULL;
+
+  while (waiter != NULL) {
+    waiter_t *next = waiter->next;
+    waiter->cb(waiter->arg,
+               entry->status == ENTRY_RESOLVED ? &entry->result : NULL);
+    free(waiter);
+    waiter = next;
+  }
+}
+
+// Look up host and call cb with the result. Cached answers are delivered
+// before this returns; otherwise cb runs from resolver_process() once the
+// lookup finishes. Concurrent lookups of one name share a single query.
+void resolver_lookup(const char *host, resolve_cb_t cb, void *arg) {
+  char key[RESOLVER_HOST_MAX];
+  size_t len = strlen(host);
+  time_t now = now_sec();
+  resolve_result_t numeric;
+
+  if (len >= RESOLVER_HOST_MAX) {
+    cb(arg, NULL);
+    return;
+  }
+  for (size_t i = 0; i <= len; i++) {
+    key[i] = tolower((unsigned char)host[i]);
+  }
+
+  // literal addresses never go through the pool
+  unsigned char raw[16];
+  int family = inet_pton(AF_INET, key, raw) == 1    ? AF_INET
+               : inet_pton(AF_INET6, key, raw) == 1 ? AF_INET6
+                                                    : 0;
+  if (family != 0) {
+    set_addr(&numeric.addrs[0], family, raw);
+    numeric.count = 1;
+    cb(arg, &numeric);
+    return;
+  }
+
+  uint32_t bucket = hash_host(key);
+  cache_entry_t *entry = buckets[bucket];
+  while (entry != NULL && strcmp(entry->host, key) != 0) {
+    entry = entry->next;
+  }
+
+  if (entry != NULL && entry->status != ENTRY_PENDING && entry->expires > now) {
+    cb(arg, entry->status == ENTRY_RESOLVED ? &entry->result : NULL);
+    return;
+  }
+
+  waiter_t *waiter = malloc(sizeof(waiter_t));
+  if (waiter == NULL) {
+    perror("malloc");
+    cb(arg, NULL);
+    return;
+  }
+  waiter->cb = cb;
+  waiter->arg = arg;
+
+  if (entry != NULL && entry->status == ENTRY_PENDING) {
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+    return;
+  }
+
+  job_t *job = calloc(1, sizeof(job_t));
+  if (job == NULL) {
+    perror("calloc");
+    free(waiter);
+    cb(arg, NULL);
+    return;
+  }
+
+  if (entry == NULL) {
+    if (entry_count >= RESOLVER_MAX_ENTRIES) {
+      make_room(now);
+    }
+    entry = calloc(1, sizeof(cache_entry_t));
+    if (entry == NULL) {
+      perror("calloc");
+      free(waiter);
+      free(job);
+      cb(arg, NULL);
+      return;
+    }
+    strcpy(entry->host, key);
+    entry->next = buckets[bucket];
+    buckets[bucket] = entry;
+    entry_count++;
+  } else {
+    age_remove(entry);
+  }
+  age_push(entry);
+
+  entry->status = ENTRY_PENDING;
+  waiter->next = NULL;
+  entry->waiters = waiter;
+
+  job->loop = loop;
+  job->entry = entry;
+  strcpy(job->host, key);
+
+  pthread_mutex_lock(&lock);
+  if (jobs_tail) {
+    jobs_tail->next = job;
+  } else {
+    jobs_head = job;
+  }
+  jobs_tail = job;
+  pthread_cond_signal(&job_ready);
+  pthread_mutex_unlock(&lock);
+}
+
+// Forget a waiter whose connection went away before its lookup finished.
+void resolver_cancel(const char *host, void *arg) {
+  char key[RESOLVER_HOST_MAX];
+  size_t len = strlen(host);
+
+  if (len >= RESOLVER_HOST_MAX) return;
+  for (size_t i = 0; i <= len; i++) {
+    key[i] = tolower((unsigned char)host[i]);
+  }
+
+  cache_entry_t *entry = buckets[hash_host(key)];
+  while (entry != NULL && strcmp(entry->host, key) != 0) {
+    entry = entry->next;
+  }
+  if (entry == NULL) return;
+
+  waiter_t **link = &entry->waiters;
+  while (*link != NULL) {
+    if ((*link)->arg == arg) {
+      waiter_t *waiter = *link;
+      *link = waiter->next;
+      free(waiter);
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+// Deliver finished lookups; called when the eventfd is readable.
+void resolver_process() {
+  uint64_t count;
+  if (read(loop->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+    perror("read eventfd");
+  }
+
+  pthread_mutex_lock(&lock);
+  job_t *job = loop->done;
+  loop->done = NULL;
+  pthread_mutex_unlock(&lock);
+
+  time_t now = now_sec();
+  while (job != NULL) {
+    job_t *next = job->next;
+    cache_entry_t *entry = job->entry;
+
+    if (job->ok) {
+      entry->status = ENTRY_RESOLVED;
+      entry->result = job->result;
+      entry->expires = now + job->ttl;
+    } else {
+      entry->status = ENTRY_FAILED;
+      entry->expires = now + RESOLVER_NEGATIVE_TTL;
+    }
+    complete(entry);
+
+    free(job);
+    job = next;
+  }
+}
@@ -0,0 +1,36 @@
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "common.h"
+
+#define RESOLVER_THREADS 4
+#define RESOLVER_MAX_ADDRS 8  // both families together
+#define RESOLVER_HOST_MAX 256
+#define RESOLVER_BUCKETS 1024
+#define RESOLVER_MAX_ENTRIES 8192
+#define RESOLVER_DEFAULT_TTL 60
+#define RESOLVER_NEGATIVE_TTL 30
+#define RESOLVER_HOSTS_FILE "/etc/hosts"
+
+// an address of either family; the port is left to the caller
+typedef union {
+  struct sockaddr sa;
+  struct sockaddr_in in;
+  struct sockaddr_in6 in6;
+} resolve_addr_t;
+
+// the order is the one to try them in: the families alternate, IPv6 first
+typedef struct {
+  int count;
+  resolve_addr_t addrs[RESOLVER_MAX_ADDRS];
+} resolve_result_t;
+
+// result is NULL when the name could not be resolved
+typedef void (*resolve_cb_t)(void *arg, const resolve_result_t *result);
+
+int resolver_init(int threads, const char *nameserver);
+int resolver_attach();
+void resolver_lookup(const char *host, resolve_cb_t cb, void *arg);
+void resolver_cancel(const char *host, void *arg);
+void resolver_process();
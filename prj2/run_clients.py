@@ -1,6 +1,7 @@
-import telnetlib
-from joblib import Parallel, delayed
 import random
+import socket
+import sys
+from concurrent.futures import ThreadPoolExecutor
 
 pub_urls = [
     "http://www.testingmcafeesites.com/",
@@ -9,6 +10,7 @@ pub_urls = [
     "http://otl.kaist.ac.kr/timetable/",
 ]
 msg = "GET {} HTTP/1.0\r\nHost: {}\r\n\r\n"
+proxy_port = 8000
 
 
 def worker():
@@ -17,33 +19,51 @@ def worker():
     # extract host from url
     host = url.split("/")[2]
     data = msg.format(url, host)
-    ret_data = http_exchange("localhost", 8000, data)
-    ret_data_direct = http_exchange(host, 80, data)
-    return ret_data.decode("utf-8"), ret_data_direct.decode("utf-8")
+    (name, _, port) = host.partition(":")
+    ret_data = http_exchange("localhost", proxy_port, data)
+    ret_data_direct = http_exchange(name, int(port or 80), data)
+    return (ret_data.decode("utf-8", "replace"),
+            ret_data_direct.decode("utf-8", "replace"))
 
 
 def http_exchange(host, port, data):
-    conn = telnetlib.Telnet()
-    conn.open(host, port)
-    conn.write(data.encode("ascii"))
-    ret_data = conn.read_all()
-    conn.close()
-    return ret_data
+    with socket.create_connection((host, port)) as conn:
+        conn.sendall(data.encode("ascii"))
+        chunks = []
+        while True:
+            chunk = conn.recv(65536)
+            if not chunk:
+                break
+            chunks.append(chunk)
+    return b"".join(chunks)
+
+
+def comparable(response):
+    # Date and the hop-by-hop Connection header may differ
+    return [line for line in response.splitlines()
+            if not line.startswith(("Date:", "Connection:"))]
 
 
 def main():
+    # usage: run_clients.py [proxy_port [url ...]]
+    global proxy_port, pub_urls
+    if len(sys.argv) > 1:
+        proxy_port = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        pub_urls = sys.argv[2:]
     num_clients = 50
-    res = Parallel(n_jobs=num_clients)(delayed(worker)() for _ in range(num_clients))
+    with ThreadPoolExecutor(max_workers=num_clients) as pool:
+        res = list(pool.map(lambda _: worker(), range(num_clients)))
+    mismatches = 0
     with open("proxy_result.txt", "w") as f, open("direct_result.txt", "w") as g:
-        for i in range(num_clients):
-            for proxy_line, direct_line in zip(res[i][0].splitline(), res[i][1].splitline()):
-                if "Date" not in proxy_line and "Date" not in direct_line:
-                    if proxy_line != direct_line:
-                        print(res[i][0], file=f)
-                        print(file=f)
-                        print(res[i][1], file=g)
-                        print(file=g)
-                        break
+        for proxy_res, direct_res in res:
+            if comparable(proxy_res) != comparable(direct_res):
+                mismatches += 1
+                print(proxy_res, file=f)
+                print(file=f)
+                print(direct_res, file=g)
+                print(file=g)
+    print("{} of {} responses differ".format(mismatches, num_clients))
 
 
 if __name__ == "__main__":
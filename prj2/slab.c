@@ -0,0 +1,67 @@
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct free_chunk_t {
+  struct free_chunk_t *next;
+} free_chunk_t;
+
+static const size_t class_sizes[SLAB_CLASSES] = {512, 2048, 8192,
+                                                 SLAB_MAX_CHUNK};
+static free_chunk_t *free_lists[SLAB_CLASSES];
+static uint64_t pages = 0;
+
+static int class_of(size_t size) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    if (size <= class_sizes[i]) return i;
+  }
+  return -1;
+}
+
+// Returns the size of the chunk that slab_alloc would hand out for size
+// bytes, or 0 if the request is larger than the biggest class.
+size_t slab_chunk_size(size_t size) {
+  int cls = class_of(size);
+  return cls < 0 ? 0 : class_sizes[cls];
+}
+
+static int grow(int cls) {
+  char *page = malloc(SLAB_PAGE_SIZE);
+  if (page == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  pages++;
+
+  size_t chunk = class_sizes[cls];
+  for (size_t off = 0; off + chunk <= SLAB_PAGE_SIZE; off += chunk) {
+    free_chunk_t *c = (free_chunk_t *)(page + off);
+    c->next = free_lists[cls];
+    free_lists[cls] = c;
+  }
+  return 0;
+}
+
+void *slab_alloc(size_t size) {
+  int cls = class_of(size);
+  if (cls < 0) return NULL;
+
+  if (free_lists[cls] == NULL && grow(cls) < 0) {
+    return NULL;
+  }
+  free_chunk_t *c = free_lists[cls];
+  free_lists[cls] = c->next;
+  return c;
+}
+
+void slab_free(void *chunk, size_t size) {
+  int cls = class_of(size);
+  if (chunk == NULL || cls < 0) return;
+
+  free_chunk_t *c = (free_chunk_t *)chunk;
+  c->next = free_lists[cls];
+  free_lists[cls] = c;
+}
+
+uint64_t slab_pages() { return pages; }
@@ -0,0 +1,15 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-size chunk allocator for cached objects. Chunks are carved out of
+// large pages, one free list per size class, so cache churn does not
+// fragment the heap. Not locked: the cache calls it under its own mutex.
+
+#define SLAB_PAGE_SIZE (1024 * 1024)
+#define SLAB_CLASSES 4
+#define SLAB_MAX_CHUNK (32 * 1024)
+
+size_t slab_chunk_size(size_t size);
+void *slab_alloc(size_t size);
+void slab_free(void *chunk, size_t size);
+uint64_t slab_pages();
@@ -0,0 +1,111 @@
+#include "stats.h"
+
+#include <string.h>
+#include <time.h>
+
+// A phase is timed from one mark to another, and only when the transaction
+// went through both: a cache hit has no connect, and a request that joined
+// another client's fetch sees nothing of the origin.
+
+typedef struct {
+  const char *name;
+  mark_t from;
+  mark_t to;
+} phase_t;
+
+static const phase_t phases[] = {
+    {"request", MARK_ACCEPT, MARK_PARSED},
+    {"resolve", MARK_PARSED, MARK_RESOLVED},
+    {"connect", MARK_RESOLVED, MARK_CONNECTED},
+    {"first byte", MARK_CONNECTED, MARK_FIRST_BYTE},
+    {"transfer", MARK_FIRST_BYTE, MARK_LAST_BYTE},
+    {"drain", MARK_LAST_BYTE, MARK_DONE},
+    {"total", MARK_PARSED, MARK_DONE},
+};
+
+#define PHASE_COUNT (sizeof(phases) / sizeof(phases[0]))
+
+proxy_stats_t proxy_stats;
+static histogram_t histograms[PHASE_COUNT];
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Timestamp a point of the transaction, unless it was already reached; a
+// retried connect does not restart the phases.
+void stats_mark(uint64_t *marks, mark_t mark) {
+  if (marks[mark] == 0) {
+    marks[mark] = now_us();
+  }
+}
+
+static void add_sample(histogram_t *hist, uint64_t us) {
+  int bucket = us ? 64 - __builtin_clzll(us) : 0;
+  if (bucket >= HIST_BUCKETS) {
+    bucket = HIST_BUCKETS - 1;
+  }
+  STAT_ADD(hist->count, 1);
+  STAT_ADD(hist->sum_us, us);
+  STAT_ADD(hist->buckets[bucket], 1);
+}
+
+// Add the phases of a transaction whose response went out in full, and
+// clear its marks for the next one.
+void stats_record(uint64_t *marks) {
+  stats_mark(marks, MARK_DONE);
+  for (size_t i = 0; i < PHASE_COUNT; i++) {
+    uint64_t from = marks[phases[i].from], to = marks[phases[i].to];
+    if (from != 0 && to >= from) {
+      add_sample(&histograms[i], to - from);
+    }
+  }
+  memset(marks, 0, MARK_COUNT * sizeof(uint64_t));
+}
+
+// The upper bound of the bucket the given share of samples falls in.
+static uint64_t percentile(const histogram_t *hist, uint64_t count,
+                           double share) {
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= count * share) {
+      return 1ull << i;
+    }
+  }
+  return 1ull << (HIST_BUCKETS - 1);
+}
+
+void stats_print(FILE *out) {
+  fprintf(out,
+          "proxy: %ld active, connections %lu, requests %lu, tunnels %lu, "
+          "blacklisted %lu, upstream failures %lu, connect attempts %lu, "
+          "timeouts %lu, upstream bytes %lu\n",
+          proxy_stats.active, proxy_stats.connections, proxy_stats.requests,
+          proxy_stats.tunnels, proxy_stats.blacklisted,
+          proxy_stats.upstream_failures, proxy_stats.connect_attempts,
+          proxy_stats.timeouts,
+          proxy_stats.bytes_upstream);
+
+  for (size_t i = 0; i < PHASE_COUNT; i++) {
+    const histogram_t *hist = &histograms[i];
+    uint64_t count = hist->count;
+    fprintf(out, "latency %s: %lu samples", phases[i].name, count);
+    if (count == 0) {
+      fprintf(out, "\n");
+      continue;
+    }
+    fprintf(out, ", mean %lu us, p50 < %lu us, p90 < %lu us, p99 < %lu us\n",
+            hist->sum_us / count, percentile(hist, count, 0.5),
+            percentile(hist, count, 0.9), percentile(hist, count, 0.99));
+    fprintf(out, " ");
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+      if (hist->buckets[b] != 0) {
+        fprintf(out, " <%lu:%lu", 1ul << b, hist->buckets[b]);
+      }
+    }
+    fprintf(out, "\n");
+  }
+}
@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+
+// Where the time of a transaction goes. Each one is timestamped as it goes
+// through its phases, and once its response is out the phases are added to
+// histograms with power-of-two buckets in microseconds, shared by every
+// worker.
+
+#define STATS_PATH "/__proxy_stats"  // served by the proxy itself
+#define HIST_BUCKETS 32  // past any transaction deadline
+
+typedef enum {
+  MARK_ACCEPT,      // connection accepted, or the next request began
+  MARK_PARSED,      // request header complete
+  MARK_RESOLVED,    // origin address known
+  MARK_CONNECTED,   // connection to the origin up
+  MARK_FIRST_BYTE,  // first response byte from the origin
+  MARK_LAST_BYTE,   // response complete from the origin
+  MARK_DONE,        // last byte sent to the client
+  MARK_COUNT,
+} mark_t;
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum_us;
+  uint64_t buckets[HIST_BUCKETS];  // bucket i counts times under 2^i us
+} histogram_t;
+
+typedef struct {
+  uint64_t connections;
+  int64_t active;  // connections open now
+  uint64_t requests;
+  uint64_t tunnels;  // CONNECT requests among them
+  uint64_t blacklisted;
+  uint64_t upstream_failures;  // answered with a 502 or 504
+  uint64_t connect_attempts;   // origin addresses raced for a connection
+  uint64_t timeouts;
+  uint64_t bytes_upstream;  // response bytes read from origins
+} proxy_stats_t;
+
+extern proxy_stats_t proxy_stats;
+
+void stats_mark(uint64_t *marks, mark_t mark);
+void stats_record(uint64_t *marks);
+void stats_print(FILE *out);
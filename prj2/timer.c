@@ -0,0 +1,110 @@
+#include "timer.h"
+
+#include <stddef.h>
+#include <time.h>
+
+static __thread wheel_timer_t *slots[TIMER_SLOTS];
+static __thread uint64_t current = 0;  // the earliest tick not yet run
+static __thread uint64_t now = 0;      // as of the last timer_expire()
+static __thread int pending = 0;
+
+static uint64_t clock_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The time the current batch of events is handled at; reading the clock
+// once per batch is close enough for deadlines of seconds.
+uint64_t timer_now() {
+  if (now == 0) {
+    now = clock_ms();
+    current = now / TIMER_TICK_MS;
+  }
+  return now;
+}
+
+static void link_timer(wheel_timer_t *timer, wheel_timer_t **head) {
+  timer->next = *head;
+  if (*head != NULL) {
+    (*head)->pprev = &timer->next;
+  }
+  *head = timer;
+  timer->pprev = head;
+}
+
+static void unlink_timer(wheel_timer_t *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+// Arm the timer for the given time, moving it if it is already pending.
+void timer_set(wheel_timer_t *timer, uint64_t expires) {
+  timer_cancel(timer);
+  uint64_t tick = expires / TIMER_TICK_MS;
+  if (tick < current) {
+    tick = current;  // already due, runs on the next expiry
+  }
+  timer->expires = expires;
+  link_timer(timer, &slots[tick % TIMER_SLOTS]);
+  pending++;
+}
+
+void timer_cancel(wheel_timer_t *timer) {
+  if (timer->pprev != NULL) {
+    unlink_timer(timer);
+    pending--;
+  }
+}
+
+// Fire the timers that are due. A callback may set or cancel any timer,
+// including others that are due in the same pass.
+void timer_expire() {
+  timer_now();  // starts the wheel on first use
+  now = clock_ms();
+  uint64_t tick = now / TIMER_TICK_MS;
+  wheel_timer_t *due = NULL;
+
+  // the slot of the current tick is kept for the timers later in it
+  for (int turns = 0; current <= tick && turns < TIMER_SLOTS; turns++) {
+    wheel_timer_t *timer = slots[current % TIMER_SLOTS];
+    while (timer != NULL) {
+      wheel_timer_t *next = timer->next;
+      if (timer->expires <= now) {
+        unlink_timer(timer);
+        link_timer(timer, &due);
+      }
+      timer = next;
+    }
+    if (current == tick) {
+      break;
+    }
+    current++;
+  }
+  current = tick;
+
+  while (due != NULL) {
+    wheel_timer_t *timer = due;
+    unlink_timer(timer);
+    pending--;
+    timer->fire(timer);
+  }
+}
+
+// Milliseconds until the end of the next tick that has timers, -1 when none
+// is pending; suitable as an epoll_wait() timeout.
+int timer_next_timeout() {
+  if (pending == 0) {
+    return -1;
+  }
+  uint64_t tick = current;
+  while (slots[tick % TIMER_SLOTS] == NULL && tick < current + TIMER_SLOTS) {
+    tick++;
+  }
+  uint64_t end = (tick + 1) * TIMER_TICK_MS;
+  return end > now ? end - now : 0;
+}
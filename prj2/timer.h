@@ -0,0 +1,25 @@
+#include <stdint.h>
+
+#include "common.h"
+
+// Deadlines of this worker's connections on a hashed timing wheel. A timer
+// sits in the slot of the tick it expires on, so setting, moving and
+// cancelling one costs the same however many are pending; a deadline more
+// than a turn of the wheel away waits in its slot for the later turns.
+// Timers fire up to a tick late.
+
+#define TIMER_SLOTS 1024
+#define TIMER_TICK_MS 100
+
+typedef struct wheel_timer_t {
+  uint64_t expires;  // milliseconds on the monotonic clock
+  struct wheel_timer_t *next;
+  struct wheel_timer_t **pprev;  // NULL while not pending
+  void (*fire)(struct wheel_timer_t *timer);
+} wheel_timer_t;
+
+uint64_t timer_now();
+void timer_set(wheel_timer_t *timer, uint64_t expires);
+void timer_cancel(wheel_timer_t *timer);
+void timer_expire();
+int timer_next_timeout();
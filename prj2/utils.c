@@ -21,7 +21,7 @@ void setnonblocking(int sock) {
   }
 }
 
-char **read_urls_from_file(size_t *url_count) {
+char **read_urls_from_file(FILE *file, size_t *url_count) {
   size_t url_capacity = 10;
   char **urls = malloc(url_capacity * sizeof(char *));
   if (!urls) {
@@ -32,7 +32,7 @@ char **read_urls_from_file(size_t *url_count) {
   char *line = NULL;
   size_t len = 0;
   ssize_t read;
-  while ((read = getline(&line, &len, stdin)) != -1) {
+  while ((read = getline(&line, &len, file)) != -1) {
     if (read > 0 && line[read - 1] == '\n') {
       line[read - 1] = '\0';  // Remove newline character
     }
@@ -67,3 +67,104 @@ void free_urls(char **urls, size_t url_count) {
   }
   free(urls);
 }
+
+// Parse a byte count with an optional K, M or G suffix; -1 if malformed.
+long long parse_size(const char *arg) {
+  char *end;
+  long long n = strtoll(arg, &end, 10);
+
+  if (end == arg || n < 0) return -1;
+  switch (*end) {
+    case 'k':
+    case 'K':
+      n <<= 10;
+      end++;
+      break;
+    case 'm':
+    case 'M':
+      n <<= 20;
+      end++;
+      break;
+    case 'g':
+    case 'G':
+      n <<= 30;
+      end++;
+      break;
+  }
+  return *end == '\0' ? n : -1;
+}
+
+// Find a header field in a header block, matching the name without regard
+// to case. Returns the value with surrounding whitespace trimmed, or NULL.
+const char *find_header(const char *headers, size_t len, const char *name,
+                        size_t *value_len) {
+  size_t name_len = strlen(name);
+  const char *end = headers + len;
+  const char *line = memchr(headers, '\n', len);
+
+  // the first line is the request or status line
+  while (line != NULL && ++line < end) {
+    const char *eol = memchr(line, '\n', end - line);
+    if (eol == NULL) eol = end;
+
+    if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+        strncasecmp(line, name, name_len) == 0) {
+      const char *value = line + name_len + 1;
+      const char *value_end = eol;
+      while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+      while (value_end > value &&
+             (value_end[-1] == '\r' || value_end[-1] == ' ' ||
+              value_end[-1] == '\t')) {
+        value_end--;
+      }
+      *value_len = value_end - value;
+      return value;
+    }
+    line = eol;
+  }
+  return NULL;
+}
+
+// Returns the start of token within a comma separated list, NULL if absent.
+static const char *find_token(const char *value, size_t len,
+                              const char *token) {
+  size_t token_len = strlen(token);
+  const char *end = value + len;
+  const char *p = value;
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *item = p;
+    while (p < end && *p != ',' && *p != '=' && *p != ' ') p++;
+    if ((size_t)(p - item) == token_len &&
+        strncasecmp(item, token, token_len) == 0) {
+      return item;
+    }
+    while (p < end && *p != ',') p++;
+  }
+  return NULL;
+}
+
+int has_token(const char *value, size_t len, const char *token) {
+  return find_token(value, len, token) != NULL;
+}
+
+// Returns the numeric argument of a directive such as max-age=60, or -1.
+long token_value(const char *value, size_t len, const char *token) {
+  const char *item = find_token(value, len, token);
+  const char *end = value + len;
+
+  if (item == NULL) return -1;
+  item += strlen(token);
+  if (item >= end || *item != '=') return -1;
+  item++;
+  if (item < end && *item == '"') item++;
+  if (item >= end || *item < '0' || *item > '9') return -1;
+
+  long n = 0;
+  while (item < end && *item >= '0' && *item <= '9') {
+    n = n * 10 + (*item++ - '0');
+    if (n > 0x7fffffffL) return 0x7fffffffL;
+  }
+  return n;
+}
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -10,5 +12,10 @@
 
 int is_stdin_redirected();
 void setnonblocking(int sock);
-char **read_urls_from_file(size_t *url_count);
-void free_urls(char **urls, size_t url_count);
\ No newline at end of file
+char **read_urls_from_file(FILE *file, size_t *url_count);
+void free_urls(char **urls, size_t url_count);
+long long parse_size(const char *arg);
+const char *find_header(const char *headers, size_t len, const char *name,
+                        size_t *value_len);
+int has_token(const char *value, size_t len, const char *token);
+long token_value(const char *value, size_t len, const char *token);
\ No newline at end of file